@@ -47,23 +47,102 @@
 
 #include <Partio.h>
 
-#include <boost/bimap.hpp>
 #include <boost/filesystem.hpp>
-#include <boost/regex.hpp>
-#include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/algorithm/string.hpp>  
 #include <boost/assign.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/chrono.hpp>
+
+#include <zlib.h>		//	already linked for Partio
+
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <list>
 
 
 #ifdef __APPLE__
 typedef unsigned long long _ULONGLONG;
 #endif
 
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define MODOPARTIO_SSE
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>		//	named pipes
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 
 static const char * paddingStringList[] = {
 	"#", "##", "###", "####", "#####", NULL
 };
 
+enum SubFrameMode		//	what a fractional input frame does
+{
+	SUBFRAME_SNAP,			//	nearest cached frame
+	SUBFRAME_INTERPOLATE,	//	blend the cached frames either side, joining particles by id
+	SUBFRAME_VELOCITY		//	move the nearest cached frame along its velocities, so motion blur samples share one frame
+};
+
+static const char * subFrameModeList[] = {
+	"Snap to Frame", "Interpolate", "Extrapolate Velocity", NULL
+};
+
+enum ExportPrecision	//	how written caches store their attributes
+{
+	PRECISION_FULL,			//	every feature as Modo gives it, in 32-bit floats
+	PRECISION_COMPACT		//	whole ids as integers, and .mpc orientation as a quaternion and columns quantized within the tolerances
+};
+
+static const char * exportPrecisionList[] = {
+	"Full", "Compact", NULL
+};
+
+static float PreviewHash(unsigned id)		//	well mixed value in [0, 1) for each particle id
+{
+	id ^= id >> 16;
+	id *= 0x7feb352d;
+	id ^= id >> 15;
+	id *= 0x846ca68b;
+	id ^= id >> 16;
+	return (float)(id >> 8) * (1.0f / 16777216.0f);
+}
+
+static const char * velocityNames[] = {LXsTBLX_PARTICLE_VEL, "velocity", "v", "PointVelocity", "Velocity", NULL};	//	as written by the formats we read
+static const char * idNames[] = {LXsTBLX_PARTICLE_ID, "ID", "Id", "particleId", NULL};
+static const char * normalNames[] = {"normal", "Normal", "N", "nrm", NULL};
+
 const std::map<std::string, int> graphTypes = boost::assign::map_list_of(LXsGRAPH_PARTICLE, 1)("pointCache", 2);
 
 std::string modoParticleFeatureArray[] = {LXsTBLX_PARTICLE_POS   ,
@@ -84,60 +163,21 @@ std::string modoParticleFeatureArray[] = {LXsTBLX_PARTICLE_POS   ,
 										LXsTBLX_PARTICLE_LUM   ,
 										LXsTBLX_PARTICLE_RGB   };
 
-const std::set<std::string> modoParticleFeaturesSet(modoParticleFeatureArray, modoParticleFeatureArray + sizeof(modoParticleFeatureArray) / sizeof(modoParticleFeatureArray[0]));
-
-typedef boost::bimap<std::string, std::string> ConversionBimap;
-typedef ConversionBimap::value_type ConversionBimapValue;
-
-
-class Conversion	//	for converting particle feature names between modo and other formats/applications
+enum ModoParticleFeatureID		//	index into modoParticleFeatureArray, so features can be compared without strings
 {
-public:
-	ConversionBimap bimap;
-
-	Conversion()
-	{
-		SetConstants();
-	}
-	Conversion(std::string format)
-	{
-		SetFormat(format);
-	}
-
-	void SetConstants()
-	{
-		//bimap.insert(ConversionBimapValue("importedID", "id"));	//	avoid collision with id's for other formats/applications
-		//bimap.insert(ConversionBimapValue(LXsTBLX_PARTICLE_ID, "ModoID"));	
-
-		bimap.insert(ConversionBimapValue(LXsTBLX_PARTICLE_POS, "position"));	//	dedicated Partio term 
-	}
-
-	void SetFormat(std::string format)
-	{
-		bimap.clear();
-		SetConstants();
-
-		boost::algorithm::to_lower(format);
-		if (format == ".icecache")
-		{
-			bimap.insert(ConversionBimapValue(LXsTBLX_PARTICLE_XFRM, "Orientation"));
-			bimap.insert(ConversionBimapValue(LXsTBLX_PARTICLE_SIZE, "Size"));
-			bimap.insert(ConversionBimapValue(LXsTBLX_PARTICLE_VEL, "PointVelocity"));
-			bimap.insert(ConversionBimapValue(LXsTBLX_PARTICLE_MASS, "Mass"));
-			bimap.insert(ConversionBimapValue(LXsTBLX_PARTICLE_FORCE, "Force"));
-			bimap.insert(ConversionBimapValue(LXsTBLX_PARTICLE_AGE, "Age"));
-			bimap.insert(ConversionBimapValue(LXsTBLX_PARTICLE_ANGVEL, "AngularVelocity"));
-			bimap.insert(ConversionBimapValue(LXsTBLX_PARTICLE_RGB, "Color"));
-		}
-		else if (format == ".bin")
-		{
-			bimap.insert(ConversionBimapValue(LXsTBLX_PARTICLE_VEL, "velocity"));
-		}
-	}
+	FEATURE_OTHER = -1,
+	FEATURE_POS, FEATURE_XFRM, FEATURE_ID, FEATURE_SIZE, FEATURE_VEL, FEATURE_MASS, FEATURE_FORCE, FEATURE_AGE, FEATURE_PATH,
+	FEATURE_DISS, FEATURE_RATE, FEATURE_ITEM, FEATURE_ANGVEL, FEATURE_TORQUE, FEATURE_PPREV, FEATURE_LUM, FEATURE_RGB
 };
 
+const std::set<std::string> modoParticleFeaturesSet(modoParticleFeatureArray, modoParticleFeatureArray + sizeof(modoParticleFeatureArray) / sizeof(modoParticleFeatureArray[0]));
 
-
+static ModoParticleFeatureID FeatureID(const std::string & name)
+{
+	const std::string * end = modoParticleFeatureArray + sizeof(modoParticleFeatureArray) / sizeof(modoParticleFeatureArray[0]);
+	const std::string * found = std::find((const std::string *)modoParticleFeatureArray, end, name);
+	return found == end ? FEATURE_OTHER : (ModoParticleFeatureID)(found - modoParticleFeatureArray);
+}
 
 struct ParticleFeature
 {
@@ -145,1206 +185,6743 @@ struct ParticleFeature
 	int offset;
 	unsigned size;		//	number of floats
 	Partio::ParticleAttribute attr;
-	Partio::ParticleAccessor * pacc;
+	bool bound;			//	attr is in the file
 
 	ParticleFeature()
 	{
 		name = "";
 		offset = -1;
 		size = -1;
-		pacc = NULL;
+		bound = false;
 	}
 	ParticleFeature(std::string in_name, unsigned in_offset, unsigned in_size)
 	{
 		name = in_name;
 		offset = in_offset;
 		size = in_size;
-		pacc = NULL;
+		bound = false;
 	}
-	ParticleFeature(std::string in_name, unsigned in_offset, unsigned in_size, Partio::ParticleAttribute in_attr, Partio::ParticleAccessor * in_pacc)
+	ParticleFeature(std::string in_name, unsigned in_offset, unsigned in_size, Partio::ParticleAttribute in_attr)
 	{
 		name = in_name;
 		offset = in_offset;
 		size = in_size;
 		attr = in_attr;
-		pacc = in_pacc;
-	}
-
-	~ParticleFeature()
-	{
-		if (pacc)
-		{
-			delete pacc;
-		}
+		bound = true;
 	}
 };
 
-struct Compare : std::binary_function<ParticleFeature,ParticleFeature,bool> {
-//	Compare(int i) : _i(i) { }
-
-	bool operator()(const ParticleFeature& v1, const ParticleFeature& v2) const {
-		return (v1.offset < v2.offset)/* && (_i != 1)*/;
-	}
-
-//	int _i;
+/*
+ * tsrf_Sample fills each vertex by running a flat list of copy steps compiled
+ * from the particle features, so the per particle loop doesn't compare names or
+ * check attribute types.
+ */
+enum CopyKernel
+{
+	KERNEL_FLOAT,			//	copy floats from Partio
+	KERNEL_INT,				//	widen ints from Partio to floats
+	KERNEL_QUAT_XFRM,		//	expand an ICECACHE quaternion to a rotation matrix
+	KERNEL_IDENTITY_XFRM,	//	identity rotation matrix
+	KERNEL_RANDOM_ID		//	random particle id
 };
 
-
-#define SRVNAME_PACKAGE		"ModoPartio"
-#define SPNNAME_INSTANCE	"ModoPartio.inst"
-#define SPNNAME_GENERATOR	"ModoPartio.gen"
+struct CopyStep
+{
+	CopyKernel kernel;
+	int offset;		//	into the vertex vector
+	unsigned size;	//	number of floats
+	bool bound;		//	attr is in the file
+	const Partio::ParticleAttribute * attr;
+	unsigned staging;	//	block of the staging buffer for kernels converted a block at a time
+	ModoParticleFeatureID feature;
+};
 
 
 /*
- * Class Declarations
- *
- * These have to come before their implementations because they reference each
- * other. Descriptions are attached to the implementations.
+ * Quaternion to rotation matrix conversion for a block of particles. Quaternions
+ * are (w, x, y, z), stride floats apart, and are normalised on the way. Matrix
+ * element k of particle i goes to matrices[k * matrixStride + i]. The SSE version
+ * converts four particles at a time and is picked at load time if the CPU has
+ * SSE2.
  */
-class CModoPartioPackage;
+typedef void (*QuatToMatrixFunc)(const float * quats, unsigned stride, unsigned count, float * matrices, unsigned matrixStride);
 
-class CModoPartioGenerator :
-                public CLxImpl_TableauSurface
-//                public CLxDynamicAttributes
+static void QuatToMatrixScalar(const float * quats, unsigned stride, unsigned count, float * matrices, unsigned matrixStride)
 {
-    public:
-                static void
-        initialize ()
-        {
-                CLxGenericPolymorph	*srv;
+	for (unsigned i = 0; i < count; ++i)
+	{
+		const float * q = quats + i * stride;
+		float magnitude = sqrtf(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+		float w = q[0] / magnitude, x = q[1] / magnitude, y = q[2] / magnitude, z = q[3] / magnitude;
+		float * m = matrices + i;
+		m[0 * matrixStride] = 1.0f - 2.0f * y * y - 2.0f * z * z;
+		m[1 * matrixStride] = 2.0f * x * y + 2.0f * z * w;
+		m[2 * matrixStride] = 2.0f * x * z - 2.0f * y * w;
+		m[3 * matrixStride] = 2.0f * x * y - 2.0f * z * w;
+		m[4 * matrixStride] = 1.0f - 2.0f * x * x - 2.0f * z * z;
+		m[5 * matrixStride] = 2.0f * y * z + 2.0f * x * w;
+		m[6 * matrixStride] = 2.0f * x * z + 2.0f * y * w;
+		m[7 * matrixStride] = 2.0f * y * z - 2.0f * x * w;
+		m[8 * matrixStride] = 1.0f - 2.0f * x * x - 2.0f * y * y;
+	}
+}
 
-                srv = new CLxPolymorph<CModoPartioGenerator>;
-                srv->AddInterface (new CLxIfc_TableauSurface<CModoPartioGenerator>);
- //               srv->AddInterface (new CLxIfc_Attributes    <CModoPartioGenerator>);
-                lx::AddSpawner (SPNNAME_GENERATOR, srv);
-        }
+#ifdef MODOPARTIO_SSE
+static void QuatToMatrixSSE(const float * quats, unsigned stride, unsigned count, float * matrices, unsigned matrixStride)
+{
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 two = _mm_set1_ps(2.0f);
 
+	unsigned i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 w = _mm_loadu_ps(quats + (i + 0) * stride);
+		__m128 x = _mm_loadu_ps(quats + (i + 1) * stride);
+		__m128 y = _mm_loadu_ps(quats + (i + 2) * stride);
+		__m128 z = _mm_loadu_ps(quats + (i + 3) * stride);
+		_MM_TRANSPOSE4_PS(w, x, y, z);		//	one component of four quaternions per register
+
+		__m128 magnitude = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(w, w), _mm_mul_ps(x, x)), _mm_add_ps(_mm_mul_ps(y, y), _mm_mul_ps(z, z))));
+		w = _mm_div_ps(w, magnitude);
+		x = _mm_div_ps(x, magnitude);
+		y = _mm_div_ps(y, magnitude);
+		z = _mm_div_ps(z, magnitude);
+
+		__m128 xx = _mm_mul_ps(two, _mm_mul_ps(x, x)), yy = _mm_mul_ps(two, _mm_mul_ps(y, y)), zz = _mm_mul_ps(two, _mm_mul_ps(z, z));
+		__m128 xy = _mm_mul_ps(two, _mm_mul_ps(x, y)), xz = _mm_mul_ps(two, _mm_mul_ps(x, z)), yz = _mm_mul_ps(two, _mm_mul_ps(y, z));
+		__m128 xw = _mm_mul_ps(two, _mm_mul_ps(x, w)), yw = _mm_mul_ps(two, _mm_mul_ps(y, w)), zw = _mm_mul_ps(two, _mm_mul_ps(z, w));
+
+		float * m = matrices + i;
+		_mm_storeu_ps(m + 0 * matrixStride, _mm_sub_ps(_mm_sub_ps(one, yy), zz));
+		_mm_storeu_ps(m + 1 * matrixStride, _mm_add_ps(xy, zw));
+		_mm_storeu_ps(m + 2 * matrixStride, _mm_sub_ps(xz, yw));
+		_mm_storeu_ps(m + 3 * matrixStride, _mm_sub_ps(xy, zw));
+		_mm_storeu_ps(m + 4 * matrixStride, _mm_sub_ps(_mm_sub_ps(one, xx), zz));
+		_mm_storeu_ps(m + 5 * matrixStride, _mm_add_ps(yz, xw));
+		_mm_storeu_ps(m + 6 * matrixStride, _mm_add_ps(xz, yw));
+		_mm_storeu_ps(m + 7 * matrixStride, _mm_sub_ps(yz, xw));
+		_mm_storeu_ps(m + 8 * matrixStride, _mm_sub_ps(_mm_sub_ps(one, xx), yy));
+	}
 
-        CLxUser_Matrix		 w_matrix;
-		int		frame;
+	QuatToMatrixScalar(quats + i * stride, stride, count - i, matrices + i, matrixStride);
+}
 
-		std::string		s_path, fileType, cacheFileName;
-		CLxUser_Item pins_item;
-        CLxUser_TriangleSoup	 tri_soup;
-        CLxPseudoRandom		 rand_seq;
-        int			 vrt_size;
-        float			*vrt_vec;
+static bool CPUHasSSE2()
+{
+	unsigned features;
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	features = (unsigned)info[3];
+#else
+	unsigned eax, ebx, ecx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &features))
+	{
+		return false;
+	}
+#endif
+	return (features & (1 << 26)) != 0;
+}
+#endif
 
-		boost::ptr_vector<ParticleFeature> particleFeatures;
+static QuatToMatrixFunc SelectQuatToMatrix()
+{
+#ifdef MODOPARTIO_SSE
+	if (CPUHasSSE2())
+	{
+		return QuatToMatrixSSE;
+	}
+#endif
+	return QuatToMatrixScalar;
+}
 
-		Partio::ParticlesData * data;
-		std::vector<std::string> particleAttributeNames;
+static const QuatToMatrixFunc QuatToMatrix = SelectQuatToMatrix();
 
-		Conversion conversion;
 
+/*
+ * Export conversions, run over a block of staged vertices. Input feature values
+ * are vertexStride floats apart, output attribute values outStride floats apart.
+ * The kernel for each feature is picked once in pcache_Initialize.
+ */
+typedef void (*ExportKernelFunc)(const float * vertices, unsigned vertexStride, unsigned count, float * out, unsigned outStride);
 
-        CModoPartioGenerator ();
+struct ExportStep	//	how one feature becomes a Partio attribute, parallel to the instance's particleFeatures
+{
+	std::string attrName;
+	unsigned attrSize;
+	ExportKernelFunc convert;	//	NULL to copy the feature unchanged
+	bool integer;				//	stored as Partio::INT when every value in the frame is a whole number, convert writes ints
+	float tolerance;			//	largest error an .mpc column may be quantized with, 0 to keep it exact
+};
 
-        unsigned int	 tsrf_FeatureCount (LXtID4 type) LXx_OVERRIDE;
-        LxResult	 tsrf_FeatureByIndex (LXtID4 type, unsigned int index, const char **name) LXx_OVERRIDE;
-        LxResult	 tsrf_SetVertex (ILxUnknownID vdesc) LXx_OVERRIDE;
-        LxResult	 tsrf_Sample (const LXtTableauBox bbox, float scale, ILxUnknownID trisoup) LXx_OVERRIDE;
+static void ExportCopy3(const float * vertices, unsigned vertexStride, unsigned count, float * out, unsigned outStride)
+{
+	for (unsigned i = 0; i < count; ++i, vertices += vertexStride, out += outStride)
+	{
+		out[0] = vertices[0];
+		out[1] = vertices[1];
+		out[2] = vertices[2];
+	}
+}
 
-	private:
-		void		ReadModoPartio();
-};
+static void ExportColorAlphaScalar(const float * vertices, unsigned vertexStride, unsigned count, float * out, unsigned outStride)	//	RGB to Softimage RGBA
+{
+	ExportCopy3(vertices, vertexStride, count, out, outStride);
+	for (unsigned i = 0; i < count; ++i, out += outStride)
+	{
+		out[3] = 1.0f;
+	}
+}
 
-class CModoPartioInstance :
-        public CLxImpl_PackageInstance,
-        public CLxImpl_ParticleItem,
-		public CLxImpl_TableauSource,
-		public CLxImpl_PointCacheItem,
-		public CLxImpl_SceneItemListener,
-		public CLxImpl_ChannelUI
+static void ExportToInt(const float * vertices, unsigned vertexStride, unsigned count, float * out, unsigned outStride)	//	only used for values already known to be whole numbers
 {
-	friend class CLxTriSoup;
+	for (unsigned i = 0; i < count; ++i, vertices += vertexStride, out += outStride)
+	{
+		*(int *)out = (int)vertices[0];
+	}
+}
 
-    public:
-                static void
-        initialize ()
-        {
-                CLxGenericPolymorph	*srv;
+static void ExportAngularVelocityScalar(const float * vertices, unsigned vertexStride, unsigned count, float * out, unsigned outStride)
+{
+	for (unsigned i = 0; i < count; ++i, vertices += vertexStride, out += outStride)
+	{
+		out[0] = vertices[0];
+		out[1] = vertices[1];
+		out[2] = vertices[2];
+		out[3] = sqrtf(out[0] * out[0] + out[1] * out[1] + out[2] * out[2]);		//	probably not the correct conversion
+	}
+}
 
-                srv = new CLxPolymorph<CModoPartioInstance>;
-                srv->AddInterface (new CLxIfc_PackageInstance<CModoPartioInstance>);
-                srv->AddInterface (new CLxIfc_ParticleItem   <CModoPartioInstance>);
-                srv->AddInterface (new CLxIfc_TableauSource  <CModoPartioInstance>);
-				srv->AddInterface(new CLxIfc_PointCacheItem <CModoPartioInstance>);
-				srv->AddInterface(new CLxIfc_SceneItemListener <CModoPartioInstance>);
-				srv->AddInterface(new CLxIfc_ChannelUI <CModoPartioInstance>);
-                lx::AddSpawner (SPNNAME_INSTANCE, srv);
-        }
+static void ExportMatrixToQuatScalar(const float * vertices, unsigned vertexStride, unsigned count, float * out, unsigned outStride)	//	rotation matrix to (w, x, y, z)
+{
+	for (unsigned i = 0; i < count; ++i, vertices += vertexStride, out += outStride)
+	{
+		const float * xfrm = vertices;
+		float * q = out;
+		float trace = xfrm[0] + xfrm[4] + xfrm[8]; 
+		if( trace > 0 ) {
+			float s = 0.5f / sqrtf(trace+ 1.0f);
+			q[0] = 0.25f / s;
+			q[1] = ( xfrm[5] - xfrm[7] ) * s;
+			q[2] = ( xfrm[6] - xfrm[2] ) * s;
+			q[3] = ( xfrm[1] - xfrm[3] ) * s;
+		} 
+		else {
+			if ( xfrm[0] > xfrm[4] && xfrm[0] > xfrm[8] ) {
+				float s = 2.0f * sqrtf( 1.0f + xfrm[0] - xfrm[4] - xfrm[8]);
+				q[0] = (xfrm[5] - xfrm[7] ) / s;
+				q[1] = 0.25f * s;
+				q[2] = (xfrm[3] + xfrm[1] ) / s;
+				q[3] = (xfrm[6] + xfrm[2] ) / s;
+			} else if (xfrm[4] > xfrm[8]) {
+				float s = 2.0f * sqrtf( 1.0f + xfrm[4] - xfrm[0] - xfrm[8]);
+				q[0] = (xfrm[6] - xfrm[2] ) / s;
+				q[1] = (xfrm[3] + xfrm[1] ) / s;
+				q[2] = 0.25f * s;
+				q[3] = (xfrm[7] + xfrm[5] ) / s;
+			} else {
+				float s = 2.0f * sqrtf( 1.0f + xfrm[8] - xfrm[0] - xfrm[4] );
+				q[0] = (xfrm[1] - xfrm[3] ) / s;
+				q[1] = (xfrm[6] + xfrm[2] ) / s;
+				q[2] = (xfrm[7] + xfrm[5] ) / s;
+				q[3] = 0.25f * s;
+			}
+		}
+	}
+}
 
-        CLxSpawner<CModoPartioGenerator>	 gen_spawn;
-        CLxUser_Item			 m_item;
-		ILxUnknownID	 self_obj;
+#ifdef MODOPARTIO_SSE
+static inline __m128 Select(__m128 mask, __m128 a, __m128 b)	//	mask ? a : b
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
 
-		Partio::ParticlesDataMutable * pData;
-		std::string fileName;
-		std::string fileType;
-		Partio::ParticleIndex particleIndex;
-		unsigned int padding;
-		std::string paddingString;
+/*
+ * The three-float features are loaded four floats at a time, so the last
+ * vertex of a block, whose fourth float may lie past the end, is left to the
+ * scalar kernel.
+ */
+static void ExportAngularVelocitySSE(const float * vertices, unsigned vertexStride, unsigned count, float * out, unsigned outStride)
+{
+	unsigned i = 0;
+	for (; i + 4 < count; i += 4)
+	{
+		const float * v = vertices + i * vertexStride;
+		__m128 x = _mm_loadu_ps(v);
+		__m128 y = _mm_loadu_ps(v + vertexStride);
+		__m128 z = _mm_loadu_ps(v + 2 * vertexStride);
+		__m128 length = _mm_loadu_ps(v + 3 * vertexStride);
+		_MM_TRANSPOSE4_PS(x, y, z, length);		//	one component of four vectors per register, the last is whatever followed them
+
+		length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+		_MM_TRANSPOSE4_PS(x, y, z, length);		//	back to (x, y, z, length) per particle
+		_mm_storeu_ps(out + (i + 0) * outStride, x);
+		_mm_storeu_ps(out + (i + 1) * outStride, y);
+		_mm_storeu_ps(out + (i + 2) * outStride, z);
+		_mm_storeu_ps(out + (i + 3) * outStride, length);
+	}
 
-		Conversion conversion;
+	ExportAngularVelocityScalar(vertices + i * vertexStride, vertexStride, count - i, out + i * outStride, outStride);
+}
 
-        CModoPartioInstance ()
-                : gen_spawn (SPNNAME_GENERATOR), pData(NULL), paddingString("0000")
-        {}
+static void ExportColorAlphaSSE(const float * vertices, unsigned vertexStride, unsigned count, float * out, unsigned outStride)
+{
+	const __m128 rgb = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+	const __m128 alpha = _mm_set_ps(1.0f, 0.0f, 0.0f, 0.0f);
 
-        /*
-         * PackageInstance interface.
-         */
-        LxResult	 pins_Initialize (ILxUnknownID item, ILxUnknownID super) LXx_OVERRIDE;
-        void		 pins_Cleanup (void) LXx_OVERRIDE;
+	unsigned i = 0;
+	for (; i + 1 < count; ++i)
+	{
+		_mm_storeu_ps(out + i * outStride, _mm_or_ps(_mm_and_ps(_mm_loadu_ps(vertices + i * vertexStride), rgb), alpha));
+	}
 
-        /*
-         * ParticleItem interface.
-         */
-        LxResult	 prti_Prepare  (ILxUnknownID eval, unsigned *index) LXx_OVERRIDE;
-        LxResult	 prti_Evaluate (ILxUnknownID attr, unsigned index, void **ppvObj) LXx_OVERRIDE;
+	ExportColorAlphaScalar(vertices + i * vertexStride, vertexStride, count - i, out + i * outStride, outStride);
+}
 
-        /*
-         * TableauSource interface.
-         */
-        LxResult	 tsrc_PreviewUpdate (int chanIndex, int *update) LXx_OVERRIDE;
+static void ExportMatrixToQuatSSE(const float * vertices, unsigned vertexStride, unsigned count, float * out, unsigned outStride)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 quarter = _mm_set1_ps(0.25f);
+	const __m128 two = _mm_set1_ps(2.0f);
+
+	unsigned i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		const float * v = vertices + i * vertexStride;
+		__m128 m[9];
+		for (unsigned k = 0; k < 9; ++k)
+		{
+			m[k] = _mm_set_ps(v[3 * vertexStride + k], v[2 * vertexStride + k], v[vertexStride + k], v[k]);
+		}
 
 		/*
-         * PointCacheItem interface.
-         */
-		boost::ptr_vector<ParticleFeature>particleFeatures;
-
-		LxResult pcache_Prepare(ILxUnknownID eval, unsigned *index) LXx_OVERRIDE;
-		LxResult pcache_Initialize(ILxUnknownID vdesc, ILxUnknownID attr, unsigned index, double time, double sample) LXx_OVERRIDE;
-		LxResult pcache_SaveFrame(ILxUnknownID pobj, double time) LXx_OVERRIDE;
-		LxResult pcache_Cleanup() LXx_OVERRIDE;
+		 * Evaluate all four branches of the scalar conversion and keep the one
+		 * each particle would have taken. Lanes that take another branch may
+		 * hold NaNs, which the selects discard.
+		 */
+		__m128 trace = _mm_add_ps(_mm_add_ps(m[0], m[4]), m[8]);
+		__m128 useA = _mm_cmpgt_ps(trace, zero);
+		__m128 useB = _mm_andnot_ps(useA, _mm_and_ps(_mm_cmpgt_ps(m[0], m[4]), _mm_cmpgt_ps(m[0], m[8])));
+		__m128 useC = _mm_andnot_ps(_mm_or_ps(useA, useB), _mm_cmpgt_ps(m[4], m[8]));
+
+		__m128 sA = _mm_div_ps(half, _mm_sqrt_ps(_mm_add_ps(trace, one)));
+		__m128 sB = _mm_mul_ps(two, _mm_sqrt_ps(_mm_sub_ps(_mm_sub_ps(_mm_add_ps(one, m[0]), m[4]), m[8])));
+		__m128 sC = _mm_mul_ps(two, _mm_sqrt_ps(_mm_sub_ps(_mm_sub_ps(_mm_add_ps(one, m[4]), m[0]), m[8])));
+		__m128 sD = _mm_mul_ps(two, _mm_sqrt_ps(_mm_sub_ps(_mm_sub_ps(_mm_add_ps(one, m[8]), m[0]), m[4])));
+
+		__m128 d57 = _mm_sub_ps(m[5], m[7]), d62 = _mm_sub_ps(m[6], m[2]), d13 = _mm_sub_ps(m[1], m[3]);
+		__m128 s31 = _mm_add_ps(m[3], m[1]), s62 = _mm_add_ps(m[6], m[2]), s75 = _mm_add_ps(m[7], m[5]);
+
+		__m128 w = Select(useA, _mm_div_ps(quarter, sA), Select(useB, _mm_div_ps(d57, sB), Select(useC, _mm_div_ps(d62, sC), _mm_div_ps(d13, sD))));
+		__m128 x = Select(useA, _mm_mul_ps(d57, sA), Select(useB, _mm_mul_ps(quarter, sB), Select(useC, _mm_div_ps(s31, sC), _mm_div_ps(s62, sD))));
+		__m128 y = Select(useA, _mm_mul_ps(d62, sA), Select(useB, _mm_div_ps(s31, sB), Select(useC, _mm_mul_ps(quarter, sC), _mm_div_ps(s75, sD))));
+		__m128 z = Select(useA, _mm_mul_ps(d13, sA), Select(useB, _mm_div_ps(s62, sB), Select(useC, _mm_div_ps(s75, sC), _mm_mul_ps(quarter, sD))));
+
+		_MM_TRANSPOSE4_PS(w, x, y, z);		//	back to one quaternion per register
+		_mm_storeu_ps(out + (i + 0) * outStride, w);
+		_mm_storeu_ps(out + (i + 1) * outStride, x);
+		_mm_storeu_ps(out + (i + 2) * outStride, y);
+		_mm_storeu_ps(out + (i + 3) * outStride, z);
+	}
 
-        /*
-         * SceneItemListener interface.
-         */
-		void sil_LinkAdd(const char *graph, ILxUnknownID itemFrom, ILxUnknownID itemTo) LXx_OVERRIDE;
+	ExportMatrixToQuatScalar(vertices + i * vertexStride, vertexStride, count - i, out + i * outStride, outStride);
+}
+#endif
 
+#ifdef MODOPARTIO_SSE
+static ExportKernelFunc SelectExportKernel(ExportKernelFunc scalar, ExportKernelFunc sse)
+{
+	return CPUHasSSE2() ? sse : scalar;
+}
 
+static const ExportKernelFunc ExportMatrixToQuat = SelectExportKernel(ExportMatrixToQuatScalar, ExportMatrixToQuatSSE);
+static const ExportKernelFunc ExportAngularVelocity = SelectExportKernel(ExportAngularVelocityScalar, ExportAngularVelocitySSE);
+static const ExportKernelFunc ExportColorAlpha = SelectExportKernel(ExportColorAlphaScalar, ExportColorAlphaSSE);
+#else
+static const ExportKernelFunc ExportMatrixToQuat = ExportMatrixToQuatScalar;
+static const ExportKernelFunc ExportAngularVelocity = ExportAngularVelocityScalar;
+static const ExportKernelFunc ExportColorAlpha = ExportColorAlphaScalar;
+#endif
 
-	private:
-		void AddVertex(const float *vertex,	unsigned int *index);
 
-		static inline void CalculateRotation( float * q, const float * xfrm );
+/*
+ * What sets each file format apart, resolved once from the file type. A format
+ * renames some Modo features to the attributes other applications expect, and
+ * may store them with a different width through an export kernel. Features
+ * without a mapping keep their Modo name, and position is always Partio's
+ * "position". The tables are plain static data, so a new format is a new
+ * entry rather than new branches.
+ */
+struct FeatureMapping
+{
+	ModoParticleFeatureID feature;
+	const char * attrName;
+	unsigned attrSize;			//	0 to store the feature at its own size
+	ExportKernelFunc convert;	//	NULL to copy the feature unchanged
 };
 
-class CModoPartioPackage :
-	public CLxImpl_Package,
-	public CLxImpl_ChannelUI
-				
+struct FormatTraits
 {
-    public:
-        static LXtTagInfoDesc		 descInfo[];
+	const char * fileType;
+	const FeatureMapping * mappings;	//	ends with a FEATURE_OTHER entry
+	bool quatOrientation;				//	orientation is stored as a (w, x, y, z) quaternion
+	bool streams;						//	ChunkReader can read frames of this format a chunk at a time
 
-                static void
-        initialize ()
-        {
-                CLxGenericPolymorph	*srv;
+	const FeatureMapping * Find(ModoParticleFeatureID feature) const
+	{
+		for (const FeatureMapping * mapping = mappings; mapping->feature != FEATURE_OTHER; ++mapping)
+		{
+			if (mapping->feature == feature)
+			{
+				return mapping;
+			}
+		}
+		return NULL;
+	}
 
-                srv = new CLxPolymorph<CModoPartioPackage>;
-                srv->AddInterface (new CLxIfc_Package   <CModoPartioPackage>);
-                srv->AddInterface (new CLxIfc_StaticDesc<CModoPartioPackage>);
-				srv->AddInterface(new CLxIfc_ChannelUI<CModoPartioPackage>);
-                lx::AddServer (SRVNAME_PACKAGE, srv);
-        }
-
-        CLxSpawner<CModoPartioInstance>	 inst_spawn;
-
-        CModoPartioPackage ()
-                : inst_spawn (SPNNAME_INSTANCE)
-        {}
+	const FeatureMapping * Find(const std::string & attrName) const		//	whatever the case, Partio changes it for some formats
+	{
+		for (const FeatureMapping * mapping = mappings; mapping->feature != FEATURE_OTHER; ++mapping)
+		{
+			if (boost::algorithm::iequals(attrName, mapping->attrName))
+			{
+				return mapping;
+			}
+		}
+		return NULL;
+	}
 
+	std::string AttributeName(const std::string & featureName) const		//	Partio attribute a Modo feature is stored as
+	{
+		ModoParticleFeatureID feature = FeatureID(featureName);
+		if (feature == FEATURE_POS)
+		{
+			return "position";		//	dedicated Partio term
+		}
+		const FeatureMapping * mapping = Find(feature);
+		return mapping ? mapping->attrName : featureName;
+	}
 
-        LxResult		pkg_SetupChannels (ILxUnknownID addChan) LXx_OVERRIDE;
-        LxResult		pkg_TestInterface (const LXtGUID *guid) LXx_OVERRIDE;
-        LxResult		pkg_Attach (void **ppvObj) LXx_OVERRIDE;
+	const char * FeatureName(const std::string & attrName) const		//	Modo feature a Partio attribute holds, NULL if none
+	{
+		if (attrName == "position")
+		{
+			return LXsTBLX_PARTICLE_POS;
+		}
+		const FeatureMapping * mapping = Find(attrName);
+		return mapping ? modoParticleFeatureArray[mapping->feature].c_str() : NULL;
+	}
 
-		LxResult		cui_UIHints(const char *channelName, ILxUnknownID hints) LXx_OVERRIDE; 
-		LxResult		cui_Enabled(const char *channelName, ILxUnknownID msg, ILxUnknownID item, ILxUnknownID chanRead) LXx_OVERRIDE;
+	static const FormatTraits & Get(std::string fileType);
 };
 
+static const FeatureMapping icecacheMappings[] = {
+	{FEATURE_XFRM, "Orientation", 4, ExportMatrixToQuat},		//	quaternion rotation
+	{FEATURE_SIZE, "Size", 0, NULL},
+	{FEATURE_VEL, "PointVelocity", 0, NULL},
+	{FEATURE_MASS, "Mass", 0, NULL},
+	{FEATURE_FORCE, "Force", 0, NULL},
+	{FEATURE_AGE, "Age", 0, NULL},
+	{FEATURE_ANGVEL, "AngularVelocity", 4, ExportAngularVelocity},
+	{FEATURE_RGB, "Color", 4, ExportColorAlpha},		//	RGBA in Softimage
+	{FEATURE_OTHER, NULL, 0, NULL}
+};
 
-
-/*
- * ----------------------------------------------------------------
- * Package Class
- *
- * Packages implement item types, or simple item extensions. They are
- * like the metatype object for the item type.
- *
- * The ModoPartio package is a locator.
- */
-LXtTagInfoDesc	 CModoPartioPackage::descInfo[] = {
-        { LXsPKG_SUPERTYPE,	LXsITYPE_LOCATOR	},
-        { 0 }
+static const FeatureMapping binMappings[] = {
+	{FEATURE_VEL, "velocity", 0, NULL},
+	{FEATURE_OTHER, NULL, 0, NULL}
 };
 
+static const FeatureMapping prtMappings[] = {		//	Krakatoa channel names
+	{FEATURE_ID, "ID", 0, NULL},
+	{FEATURE_VEL, "Velocity", 0, NULL},
+	{FEATURE_MASS, "Mass", 0, NULL},
+	{FEATURE_AGE, "Age", 0, NULL},
+	{FEATURE_RGB, "Color", 0, NULL},
+	{FEATURE_OTHER, NULL, 0, NULL}
+};
 
-/*
- * The package has a set of standard channels with default values. These
- * are setup at the start using the AddChannel interface.
- */
+static const FeatureMapping noMappings[] = {
+	{FEATURE_OTHER, NULL, 0, NULL}
+};
 
+static const FormatTraits formatTraits[] = {
+	{".icecache", icecacheMappings, true, false},
+	{".bin", binMappings, false, false},
+	{".prt", prtMappings, false, true},
+	{".bgeo", noMappings, false, true},
+	{".geo", noMappings, false, false},
+	{".pdb", noMappings, false, false},
+	{".pdc", noMappings, false, true},
+	{".pda", noMappings, false, false},
+	{".mpc", noMappings, false, false},
+	{"", noMappings, false, false}		//	anything else Partio reads
+};
 
-        LxResult
-CModoPartioPackage::pkg_SetupChannels (
-        ILxUnknownID		 addChan)
+const FormatTraits & FormatTraits::Get(std::string fileType)
 {
-        CLxUser_AddChannel	 ac (addChan);
-
-
-		// Create a new LXtObjectID. This will be used for storing the default value.
-		LXtObjectID	obj;
-
-		// CLxUser_Value SetString() method will be used to set the value of the string channel.
-		CLxUser_Value	val;
-
-		// Add the new channel. Define it as a string channel.
-		ac.NewChannel("cacheFileName", LXsTYPE_STRING);
-
-		// Next, set the storage type as a string. This is the type of value
-		// that will be stored in the action layer.
-		ac.SetStorage(LXsTYPE_STRING);
-
-		// Finally we set the default object to be the LXtObjectID (obj).
-		// This returns an object which we can use to store the value.
-		ac.SetDefaultObj(&obj);
+	boost::algorithm::to_lower(fileType);
+	const FormatTraits * traits = formatTraits;
+	while (*traits->fileType && fileType != traits->fileType)
+	{
+		++traits;
+	}
+	return *traits;
+}
 
-		// Localize the LXtObjectID.
-		val.take(obj);
+struct Compare : std::binary_function<ParticleFeature,ParticleFeature,bool> {
+//	Compare(int i) : _i(i) { }
 
-		// Finally, the SetString method is called to set the default
+	bool operator()(const ParticleFeature& v1, const ParticleFeature& v2) const {
+		return (v1.offset < v2.offset)/* && (_i != 1)*/;
+	}
 
-		val.SetString("*.*");
+//	int _i;
+};
 
-		ac.NewChannel("padding", LXsTYPE_INTEGER);
-		ac.SetDefault(0.0, 0);
 
-		ac.NewChannel("frame", LXsTYPE_INTEGER);
+/*
+ * Memory limits, in MB unless set in the environment. They are logged once
+ * when the plug-in loads, so the values in effect show in the debug output.
+ */
+enum MemoryBudget
+{
+	BUDGET_CACHE,			//	decoded frames kept by the frame cache
+	BUDGET_WRITE_QUEUE,		//	baked frames waiting to be written
+	BUDGET_STREAM,			//	frames larger than this are read a chunk at a time
+	BUDGET_COUNT
+};
 
-		ac.NewChannel("partioMode", LXsTYPE_INTEGER);
-		ac.SetDefault(0.0, 0);
+static const char * budgetVariables[BUDGET_COUNT] = {"MODOPARTIO_CACHE_MB", "MODOPARTIO_WRITE_QUEUE_MB", "MODOPARTIO_STREAM_MB"};
+static const int budgetDefaults[BUDGET_COUNT] = {2048, 1024, 1024};
 
-        return LXe_OK;
+static int BudgetMegabytes(MemoryBudget budget)
+{
+	const char * megabytes = getenv(budgetVariables[budget]);
+	return (megabytes && atoi(megabytes) > 0) ? atoi(megabytes) : budgetDefaults[budget];
 }
 
-
-/*
- * TestInterface() is required so that nexus knows what interfaces instance
- * of this package support. Necessary to prevent query loops.
- */
-        LxResult
-CModoPartioPackage::pkg_TestInterface (
-        const LXtGUID		*guid)
+static size_t BudgetBytes(MemoryBudget budget)
 {
-        return inst_spawn.TestInterfaceRC (guid);
+	return (size_t)BudgetMegabytes(budget) << 20;
 }
 
 
 /*
- * Attach is called to create a new instance of this item. The returned
- * object implements a specific item of this type in the scene.
+ * Where an item's time goes. A StageTimer around a piece of work adds its time,
+ * and the particles and bytes it handled, to the profile bound to the thread,
+ * so the frame cache, the readers and the writer charge the item that asked
+ * for them without being passed it. Work posted to the worker pool binds the
+ * profile of the item that posted it. Times are inclusive, so a decode done
+ * while resolving a frame counts in both. Each item logs its totals when it is
+ * cleaned up. The totals go to the debug output through the log service rather
+ * than as lxu_log event log entries, which would add one entry per stage.
+ *
+ * Setting MODOPARTIO_TRACE to a file name also writes every timed stage there
+ * as a chrome://tracing timeline. The file is written as the stages finish and
+ * its array is closed when the plug-in is unloaded.
  */
-        LxResult
-CModoPartioPackage::pkg_Attach (
-        void		       **ppvObj)
+enum ProfileStage
 {
-        CModoPartioInstance * inst = inst_spawn.Alloc (ppvObj);
-		inst->self_obj = (ILxUnknownID)ppvObj[0];
+	STAGE_RESOLVE,		//	finding the frame's file and its attributes
+	STAGE_SCAN,			//	listing a sequence's directory
+	STAGE_DECODE,		//	reading particles from a file
+	STAGE_NEGOTIATE,	//	matching features to attributes
+	STAGE_SAMPLE,
+	STAGE_CONVERT,		//	filling vertices from the particles
+	STAGE_EMIT,			//	handing vertices to the soup
+	STAGE_WRITE,		//	writing a baked frame
+	STAGE_COUNT
+};
 
-        return LXe_OK;
-}
+static const char * stageNames[STAGE_COUNT] = {"resolve", "scan", "decode", "negotiate", "sample", "convert", "emit", "write"};
 
+typedef boost::chrono::steady_clock ProfileClock;
 
-		LxResult
-CModoPartioPackage::cui_UIHints(const char *channelName, ILxUnknownID hints)
-		{
-			std::string nameString(channelName);
+class TraceLog
+{
+public:
+	static TraceLog * Get()		//	NULL unless MODOPARTIO_TRACE is set
+	{
+		static TraceLog * trace = getenv("MODOPARTIO_TRACE") && *getenv("MODOPARTIO_TRACE") ? new TraceLog(getenv("MODOPARTIO_TRACE")) : NULL;
+		return trace;
+	}
 
-			CLxUser_UIHints phints(hints);
+	void Event(ProfileStage stage, const std::string & item, ProfileClock::time_point start, ProfileClock::duration duration, unsigned long long particles, unsigned long long bytes)
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		if (!file)
+		{
+			return;
+		}
+		ThreadMap::iterator thread = threads.insert(ThreadMap::value_type(boost::this_thread::get_id(), (unsigned)threads.size() + 1)).first;
 
-			if (nameString.compare("padding") == 0)
+		char event[256];
+		sprintf(event, ",\n{\"name\":\"%s\",\"cat\":\"ModoPartio\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"particles\":%llu,\"bytes\":%llu,\"item\":\"",
+				stageNames[stage], thread->second, boost::chrono::duration<double, boost::micro>(start - epoch).count(), boost::chrono::duration<double, boost::micro>(duration).count(), particles, bytes);
+		buffer += event;
+		for (std::string::const_iterator c = item.begin(); c != item.end(); ++c)
+		{
+			if (*c == '"' || *c == '\\')
 			{
-				phints.Class("iPopChoice");
-				phints.Label("Output Padding");
-				phints.StringList(paddingStringList);
+				buffer += '\\';
 			}
-
-
-			return LXe_OK;
+			buffer += ((unsigned char)*c < 0x20) ? ' ' : *c;
+		}
+		buffer += "\"}}";
+		if (buffer.size() > flushSize)
+		{
+			Flush();
 		}
+	}
 
-LxResult CModoPartioPackage::cui_Enabled(const char *channelName, ILxUnknownID msg, ILxUnknownID item, ILxUnknownID chanRead)
+	void Flush()		//	called with the mutex held
+	{
+		if (file && !buffer.empty())
 		{
-			LxResult result = LXe_OK;
-			std::string channelNameString(channelName);
+			fwrite(buffer.data(), 1, buffer.size(), file);
+			fflush(file);
+		}
+		buffer.clear();
+	}
 
-			if (channelNameString == "padding")
-			{
-				CLxUser_Item userItem(item);
-				std::string ident = userItem.GetIdentity();
+	void Sync()
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		Flush();
+	}
 
-				CLxUser_ChannelRead chan(chanRead);
-				CLxUser_Message res(msg);
+	static void Shutdown()		//	closes the trace if one was opened
+	{
+		if (opened)
+		{
+			opened->Close();
+		}
+	}
 
-				int partioMode = chan.IValue(userItem, "partioMode");
-				if (partioMode == 2)
-				{
-					res.SetCode(LXe_OK);
-				}
-				else
-				{
-					res.SetCode(LXe_CMD_DISABLED);
-					result = LXe_CMD_DISABLED;
-				}
-			}
-			else if (channelNameString == "frame")
-			{
-				CLxUser_Item userItem(item);
-				std::string ident = userItem.GetIdentity();
+	void Close()		//	ends the array, events after it are dropped
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		if (file)
+		{
+			buffer += "\n]\n";
+			Flush();
+			fclose(file);
+			file = NULL;
+		}
+	}
 
-				CLxUser_ChannelRead chan(chanRead);
-				CLxUser_Message res(msg);
+private:
+	typedef std::map<boost::thread::id, unsigned> ThreadMap;
+	static const size_t flushSize = 1 << 20;
 
-				int partioMode = chan.IValue(userItem, "partioMode");
-				if (partioMode != 2)
-				{
-					res.SetCode(LXe_OK);
-				}
-				else
-				{
-					res.SetCode(LXe_CMD_DISABLED);
-					result = LXe_CMD_DISABLED;
-				}
-			}
+	boost::mutex mutex;
+	FILE * file;
+	std::string buffer;
+	ThreadMap threads;		//	small numbers for the viewer's rows
+	ProfileClock::time_point epoch;
+	static TraceLog * opened;
 
-			return result;
+	TraceLog(const char * fileName) : epoch(ProfileClock::now())
+	{
+		file = fopen(fileName, "w");
+		if (!file)
+		{
+			CLxUser_LogService log;
+			log.DebugOut(LXi_DBLOG_ERROR, "ModoPartio: could not open trace file %s", fileName);
+			return;
 		}
+		buffer = "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"ModoPartio\"}}";		//	every event after it starts with a comma
+		opened = this;
+	}
+};
 
+TraceLog * TraceLog::opened = NULL;
 
-/*
- * ----------------------------------------------------------------
- * ModoPartio Item Instance
- *
- * The instance is the implementation of the item, and there will be one
- * allocated for each item in the scene. It can respond to a set of
- * events. Initialization typically stores the item it's attached to.
- */
+static struct TraceLogCloser		//	the trace is closed when the plug-in is unloaded
+{
+	~TraceLogCloser()
+	{
+		TraceLog::Shutdown();
+	}
+} traceLogCloser;
 
-void CModoPartioInstance::sil_LinkAdd(const char *graph, ILxUnknownID itemFrom, ILxUnknownID itemTo)
+class StageProfile
 {
-	CLxUser_Item userItemTo(itemTo);
-	CLxUser_Item userItemFrom(itemFrom);
-	std::string graphName(graph);
+public:
+	StageProfile(const std::string & name) : name(name)
+	{
+		Reset();
+	}
 
-	if (userItemFrom == m_item)		//	instance connected to something new
+	class Bind		//	charges the stages timed on this thread to profile until it ends
 	{
-		std::map<std::string, int>::const_iterator graphIter;
-		graphIter = graphTypes.find(graphName);
-		if (graphIter != graphTypes.end())
+	public:
+		Bind(const boost::shared_ptr<StageProfile> & profile) : profile(profile), previous(current.get())
 		{
-			CLxUser_ChannelWrite chan;
-			chan.from(m_item);
-			chan.Set(m_item, "partioMode", graphIter->second);
+			current.reset(this);
+		}
 
-			CLxUser_Scene scn;
-			scn.from(m_item);
-			CLxUser_ItemGraph iGraph;
-			unsigned link_count;
-			CLxUser_Item dest;
-			for (graphIter = graphTypes.begin(); graphIter != graphTypes.end(); ++graphIter)
-			{
-				if (scn.GetGraph(graphIter->first.c_str(), iGraph))
-				{
-					iGraph.FwdCount(m_item, &link_count);
-					for (unsigned i=0; i < link_count; ++i)
-					{
-						if (iGraph.Forward(m_item, i, dest))
-						{
-							if (dest != userItemTo || graphIter->first != graph)
-							{
-								iGraph.DeleteLink(m_item, dest);
-							}
-						}
-					}
-				}
-			}
+		~Bind()
+		{
+			current.reset(previous);
 		}
-	}
 
-	return;
-}
+	private:
+		friend class StageProfile;
 
+		boost::shared_ptr<StageProfile> profile;
+		Bind * previous;
 
-        LxResult
-CModoPartioInstance::pins_Initialize (
-        ILxUnknownID		 item,
-        ILxUnknownID		 super)
-{
-        m_item.set (item);
+		Bind(const Bind &);
+		Bind & operator=(const Bind &);
+	};
 
-		CLxUser_Scene		 scene (m_item);
-		CLxUser_ListenerPort	 port (scene);
+	static StageProfile * Current()
+	{
+		Bind * bind = current.get();
+		return bind ? bind->profile.get() : NULL;
+	}
+
+	static boost::shared_ptr<StageProfile> Shared()		//	for work posted to other threads
+	{
+		Bind * bind = current.get();
+		return bind ? bind->profile : boost::shared_ptr<StageProfile>();
+	}
+
+	const std::string & Name() const
+	{
+		return name;
+	}
+
+	void Add(ProfileStage stage, ProfileClock::duration duration, unsigned long long particles, unsigned long long bytes)
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		Totals & total = totals[stage];
+		++total.calls;
+		total.duration += duration;
+		total.particles += particles;
+		total.bytes += bytes;
+	}
+
+	void CountFrame(bool hit)
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		++(hit ? frameHits : frameMisses);
+	}
+
+	void CountPlan(bool hit)
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		++(hit ? planHits : planMisses);
+	}
+
+	void Report()		//	logs the totals since the last report and starts again
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		CLxUser_LogService log;
+		for (int stage = 0; stage < STAGE_COUNT; ++stage)
+		{
+			const Totals & total = totals[stage];
+			if (total.calls > 0)
+			{
+				log.DebugOut(LXi_DBLOG_NORMAL, "ModoPartio %s: %-9s %6u calls %10.3f s %12llu particles %10.1f MB",
+						name.c_str(), stageNames[stage], total.calls, boost::chrono::duration<double>(total.duration).count(), total.particles, total.bytes / 1048576.0);
+			}
+		}
+		if (frameHits + frameMisses + planHits + planMisses > 0)
+		{
+			log.DebugOut(LXi_DBLOG_NORMAL, "ModoPartio %s: frame cache %u hits %u misses, feature plans %u hits %u misses", name.c_str(), frameHits, frameMisses, planHits, planMisses);
+		}
+		Reset();
+
+		if (TraceLog::Get())
+		{
+			TraceLog::Get()->Sync();
+		}
+	}
+
+private:
+	struct Totals
+	{
+		unsigned calls;
+		ProfileClock::duration duration;
+		unsigned long long particles, bytes;
+	};
+
+	static boost::thread_specific_ptr<Bind> current;
+
+	boost::mutex mutex;
+	std::string name;
+	Totals totals[STAGE_COUNT];
+	unsigned frameHits, frameMisses, planHits, planMisses;
+
+	void Reset()
+	{
+		for (int stage = 0; stage < STAGE_COUNT; ++stage)
+		{
+			totals[stage].calls = 0;
+			totals[stage].duration = ProfileClock::duration::zero();
+			totals[stage].particles = 0;
+			totals[stage].bytes = 0;
+		}
+		frameHits = frameMisses = planHits = planMisses = 0;
+	}
+
+	static void Unbind(Bind *)		//	binds live on the stack
+	{}
+};
+
+boost::thread_specific_ptr<StageProfile::Bind> StageProfile::current(&StageProfile::Unbind);
+
+class StageTimer	//	times the scope it's declared in, if anything is listening
+{
+public:
+	StageTimer(ProfileStage stage) : stage(stage), particles(0), bytes(0), profile(StageProfile::Current()), trace(TraceLog::Get())
+	{
+		if (profile || trace)
+		{
+			start = ProfileClock::now();
+		}
+	}
+
+	~StageTimer()
+	{
+		if (!profile && !trace)
+		{
+			return;
+		}
+		ProfileClock::duration duration = ProfileClock::now() - start;
+		if (profile)
+		{
+			profile->Add(stage, duration, particles, bytes);
+		}
+		if (trace)
+		{
+			trace->Event(stage, profile ? profile->Name() : std::string(), start, duration, particles, bytes);
+		}
+	}
+
+	void Count(unsigned long long in_particles, unsigned long long in_bytes = 0)
+	{
+		particles += in_particles;
+		bytes += in_bytes;
+	}
+
+private:
+	ProfileStage stage;
+	unsigned long long particles, bytes;
+	StageProfile * profile;
+	TraceLog * trace;
+	ProfileClock::time_point start;
+
+	StageTimer(const StageTimer &);
+	StageTimer & operator=(const StageTimer &);
+};
+
+
+/*
+ * Maps frame numbers to cache files for one cacheFileName pattern, shared by
+ * all items. A partitioned sequence writes each frame as several files, such
+ * as name.part003.0042.bgeo; its index maps a frame to all of them, in
+ * partition order, and resolves the frame to a single name with a * where the
+ * partition number goes, name.part*.0042.bgeo, which the frame cache reads
+ * through PartitionedFrame. * can't appear in a real file name on Windows, and
+ * isn't used for one elsewhere.
+ */
+class FrameSequenceIndex
+{
+public:
+	static bool Resolve(const boost::filesystem::path & pattern, int frame, boost::filesystem::path & resolved, bool partitioned = false)
+	{
+		if (!pattern.has_parent_path())
+		{
+			return false;
+		}
+
+		std::string fileStem = pattern.stem().string();
+		size_t numbers = fileStem.find_last_not_of("#1234567890");
+		std::string prefix = fileStem.substr(0, numbers + 1);
+		std::string extension = pattern.extension().string();
+
+		if (partitioned)
+		{
+			size_t last = prefix.find_last_of("#1234567890");		//	the partition number is the last one before the frame's
+			if (last != prefix.npos)
+			{
+				size_t first = prefix.find_last_not_of("#1234567890", last);
+				first = (first == prefix.npos) ? 0 : first + 1;
+				prefix = prefix.substr(0, first) + "*" + prefix.substr(last + 1);
+				boost::algorithm::to_lower(extension);		//	as the frame cache keys it
+			}
+		}
+
+		FrameSequenceIndex & index = Get(pattern.parent_path(), prefix, extension);
+		return index.Lookup(frame, resolved);
+	}
+
+	static void Written(const boost::filesystem::path & file)		//	a frame the writer has just finished, added to the sequences already scanned without listing the directory again
+	{
+		std::vector<FrameSequenceIndex *> matches;
+		{
+			boost::lock_guard<boost::mutex> lock(IndexMutex());
+			for (IndexMap::iterator iter = Indices().begin(); iter != Indices().end(); ++iter)
+			{
+				if (iter->second->directory == file.parent_path())
+				{
+					matches.push_back(iter->second);
+				}
+			}
+		}
+		for (size_t i = 0; i < matches.size(); ++i)
+		{
+			boost::lock_guard<boost::mutex> lock(matches[i]->mutex);
+			if (matches[i]->scanned)
+			{
+				matches[i]->Insert(file);
+			}
+		}
+	}
+
+	static bool Partitions(const boost::filesystem::path & resolved, std::vector<boost::filesystem::path> & files)		//	files of a partitioned frame returned by Resolve
+	{
+		std::string fileName = resolved.filename().string();
+		std::string extension = resolved.extension().string();
+		size_t star = fileName.find('*');
+		if (star == fileName.npos || !resolved.has_parent_path())
+		{
+			return false;
+		}
+		boost::algorithm::to_lower(extension);
+
+		std::string rest = fileName.substr(star + 1, fileName.size() - star - 1 - extension.size());	//	<separator>[-]<frame>
+		size_t frameStart = rest.find_last_not_of("1234567890") + 1;
+		if (frameStart == rest.size())
+		{
+			return false;
+		}
+		int frame = atoi(rest.c_str() + frameStart);
+		if (frameStart > 0 && rest[frameStart - 1] == '-')
+		{
+			frame = -frame;
+			--frameStart;
+		}
+
+		FrameSequenceIndex & index = Get(resolved.parent_path(), fileName.substr(0, star + 1) + rest.substr(0, frameStart), extension);
+		boost::filesystem::path merged;
+		if (!index.Lookup(frame, merged))
+		{
+			return false;
+		}
+
+		boost::lock_guard<boost::mutex> lock(index.mutex);
+		PartMap::const_iterator iter = index.parts.find(frame);
+		if (iter == index.parts.end())
+		{
+			return false;
+		}
+		files.clear();
+		for (std::vector<Part>::const_iterator part = iter->second.begin(); part != iter->second.end(); ++part)
+		{
+			files.push_back(part->second);
+		}
+		return true;
+	}
+
+private:
+	typedef boost::unordered_map<int, boost::filesystem::path> FrameMap;
+	typedef std::pair<int, boost::filesystem::path> Part;		//	partition number and file
+	typedef boost::unordered_map<int, std::vector<Part> > PartMap;
+	typedef std::map<std::string, FrameSequenceIndex *> IndexMap;
+
+	boost::filesystem::path directory;
+	std::string prefix, extension;
+
+	boost::mutex mutex;
+	FrameMap frames;
+	PartMap parts;		//	only for partitioned sequences
+	std::time_t dirTime;	//	directory modification time when frames was built
+	std::time_t checkTime;	//	wall clock time of last modification check
+	std::time_t scanTime;	//	wall clock time of last scan
+	bool scanned;
+
+	FrameSequenceIndex(const boost::filesystem::path & in_directory, const std::string & in_prefix, const std::string & in_extension)
+		: directory(in_directory), prefix(in_prefix), extension(in_extension), dirTime(0), checkTime(0), scanTime(0), scanned(false)
+	{}
+
+	static boost::mutex & IndexMutex()
+	{
+		static boost::mutex indexMutex;
+		return indexMutex;
+	}
+
+	static IndexMap & Indices()
+	{
+		static IndexMap indices;	//	never freed, lives as long as the plug-in
+		return indices;
+	}
+
+	static FrameSequenceIndex & Get(const boost::filesystem::path & directory, const std::string & prefix, const std::string & extension)
+	{
+		std::string key = (directory / (prefix + "#" + extension)).string();
+
+		boost::lock_guard<boost::mutex> lock(IndexMutex());
+		IndexMap::iterator iter = Indices().find(key);
+		if (iter == Indices().end())
+		{
+			iter = Indices().insert(IndexMap::value_type(key, new FrameSequenceIndex(directory, prefix, extension))).first;
+		}
+		return *iter->second;
+	}
+
+	bool Lookup(int frame, boost::filesystem::path & resolved)
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+
+		std::time_t now = std::time(NULL);
+		if (!scanned || now != checkTime)		//	stat the directory at most once a second while scrubbing
+		{
+			checkTime = now;
+
+			boost::system::error_code ec;
+			std::time_t modified = boost::filesystem::last_write_time(directory, ec);
+			if (ec)
+			{
+				frames.clear();
+				parts.clear();
+				scanned = false;
+				return false;
+			}
+			if (!scanned || modified != dirTime || modified >= scanTime)		//	mtimes are whole seconds, a change in the second of the scan may not be in it
+			{
+				Scan();
+				dirTime = modified;
+				scanTime = now;
+				scanned = true;
+			}
+		}
+
+		FrameMap::const_iterator iter = frames.find(frame);
+		if (iter == frames.end())
+		{
+			return false;
+		}
+		resolved = iter->second;
+		return true;
+	}
+
+	void Scan()
+	{
+		StageTimer timer(STAGE_SCAN);
+		frames.clear();
+		parts.clear();
+
+		boost::system::error_code ec;
+		boost::filesystem::directory_iterator end_iter; // Default ctor yields past-the-end
+		for (boost::filesystem::directory_iterator iter(directory, ec); !ec && iter != end_iter; iter.increment(ec))
+		{
+			if (boost::filesystem::is_regular_file(iter->status()))
+			{
+				Insert(iter->path());
+			}
+		}
+	}
+
+	void Insert(const boost::filesystem::path & file)		//	adds file if it belongs to the sequence
+	{
+		size_t star = prefix.find('*');
+		std::string fileName = file.filename().string();		//	<prefix>[-]<digits><extension>
+		int partition = 0;
+		std::string name = fileName;
+		if (star != prefix.npos)		//	<before *><digits><after *>[-]<digits><extension>
+		{
+			size_t digitsEnd = fileName.find_first_not_of("0123456789", star);
+			if (fileName.compare(0, star, prefix, 0, star) != 0 || digitsEnd == star || digitsEnd == fileName.npos ||
+				!boost::algorithm::iends_with(fileName, extension))
+			{
+				return;
+			}
+			partition = atoi(fileName.c_str() + star);
+			name = fileName.substr(0, star) + "*" + fileName.substr(digitsEnd, fileName.size() - digitsEnd - extension.size()) + extension;
+		}
+
+		if (name.size() <= prefix.size() + extension.size() ||
+			name.compare(0, prefix.size(), prefix) != 0 ||
+			name.compare(name.size() - extension.size(), extension.size(), extension) != 0)
+		{
+			return;
+		}
+
+		std::string frameString = name.substr(prefix.size(), name.size() - prefix.size() - extension.size());
+		size_t firstDigit = (frameString[0] == '-') ? 1 : 0;
+		if (firstDigit == frameString.size() || frameString.find_first_not_of("0123456789", firstDigit) != frameString.npos)
+		{
+			return;
+		}
+
+		int frame = atoi(frameString.c_str());
+		if (star == prefix.npos)
+		{
+			frames.insert(FrameMap::value_type(frame, directory / fileName));	//	first match in directory order wins
+		}
+		else
+		{
+			frames.insert(FrameMap::value_type(frame, directory / name));
+			std::vector<Part> & frameParts = parts[frame];		//	kept in partition order
+			std::vector<Part>::iterator part = std::lower_bound(frameParts.begin(), frameParts.end(), Part(partition, boost::filesystem::path()));
+			if (part == frameParts.end() || part->first != partition)
+			{
+				frameParts.insert(part, Part(partition, directory / fileName));
+			}
+		}
+	}
+};
+
+
+class WorkerPool	//	background threads shared by everything that reads or writes caches off the evaluation thread
+{
+public:
+	typedef boost::function<void ()> Task;
+
+	static WorkerPool & Get()
+	{
+		static WorkerPool * pool = new WorkerPool(std::max(2u, boost::thread::hardware_concurrency()) - 1);	//	never freed, threads idle until the plug-in is unloaded
+		return *pool;
+	}
+
+	void Post(const Task & task)
+	{
+		{
+			boost::lock_guard<boost::mutex> lock(mutex);
+			tasks.push_back(task);
+		}
+		wake.notify_one();
+	}
+
+	unsigned Size() const
+	{
+		return threadCount;
+	}
+
+	void ParallelFor(unsigned count, const boost::function<void (unsigned)> & body)	//	the caller takes part, so this is safe to call from a pool thread
+	{
+		boost::shared_ptr<Loop> loop(new Loop(count, body));
+		for (unsigned i = 1; i < std::min(count, threadCount + 1); ++i)
+		{
+			Post(boost::bind(&WorkerPool::RunLoop, loop));
+		}
+		RunLoop(loop);
+
+		boost::unique_lock<boost::mutex> lock(loop->mutex);
+		while (loop->finished < count)
+		{
+			loop->done.wait(lock);
+		}
+	}
+
+private:
+	struct Loop		//	helpers that start after the loop has finished find nothing left and return
+	{
+		boost::mutex mutex;
+		boost::condition_variable done;
+		unsigned count, next, finished;
+		boost::function<void (unsigned)> body;
+
+		Loop(unsigned count, const boost::function<void (unsigned)> & body) : count(count), next(0), finished(0), body(body)
+		{}
+	};
+
+	boost::mutex mutex;
+	boost::condition_variable wake;
+	std::deque<Task> tasks;
+	boost::thread_group threads;
+	unsigned threadCount;
+
+	static void RunLoop(boost::shared_ptr<Loop> loop)
+	{
+		for (;;)
+		{
+			unsigned index;
+			{
+				boost::lock_guard<boost::mutex> lock(loop->mutex);
+				if (loop->next == loop->count)
+				{
+					return;
+				}
+				index = loop->next++;
+			}
+			loop->body(index);
+
+			boost::lock_guard<boost::mutex> lock(loop->mutex);
+			if (++loop->finished == loop->count)
+			{
+				loop->done.notify_all();
+			}
+		}
+	}
+
+	WorkerPool(unsigned count) : threadCount(count)
+	{
+		for (unsigned i = 0; i < threadCount; ++i)
+		{
+			threads.create_thread(boost::bind(&WorkerPool::Run, this));
+		}
+	}
+
+	void Run()
+	{
+		for (;;)
+		{
+			Task task;
+			{
+				boost::unique_lock<boost::mutex> lock(mutex);
+				while (tasks.empty())
+				{
+					wake.wait(lock);
+				}
+				task = tasks.front();
+				tasks.pop_front();
+			}
+			task();
+		}
+	}
+};
+
+
+/*
+ * Scratch memory for the buffers of an evaluation, one arena per thread. Blocks
+ * are kept from one evaluation to the next, so taking a buffer is a pointer
+ * bump, and a Scope hands back everything taken inside it when it ends.
+ * Buffers must not outlive the scope they were taken in.
+ */
+class ScratchArena
+{
+public:
+	class Scope
+	{
+	public:
+		Scope() : arena(Local()), block(arena.current), used(arena.used)
+		{}
+
+		~Scope()
+		{
+			arena.current = block;
+			arena.used = used;
+		}
+
+		template <class T> T * Alloc(size_t count)		//	uninitialised
+		{
+			return (T *)arena.Take(count * sizeof(T));
+		}
+
+	private:
+		ScratchArena & arena;
+		size_t block, used;
+
+		Scope(const Scope &);
+		Scope & operator=(const Scope &);
+	};
+
+	~ScratchArena()
+	{
+		for (size_t i = 0; i < blocks.size(); ++i)
+		{
+			delete [] blocks[i].memory;
+		}
+	}
+
+private:
+	struct Block
+	{
+		char * memory;
+		size_t size;
+	};
+
+	static boost::thread_specific_ptr<ScratchArena> local;
+	static const size_t minBlockSize = 1 << 20;
+
+	std::vector<Block> blocks;
+	size_t current, used;		//	block being taken from and bytes taken from it
+
+	ScratchArena() : current(0), used(0)
+	{}
+
+	static ScratchArena & Local()
+	{
+		if (!local.get())
+		{
+			local.reset(new ScratchArena());
+		}
+		return *local;
+	}
+
+	void * Take(size_t bytes)
+	{
+		bytes = (bytes + 15) & ~(size_t)15;
+		while (current < blocks.size() && used + bytes > blocks[current].size)		//	blocks too small for this are left for smaller buffers
+		{
+			++current;
+			used = 0;
+		}
+		if (current == blocks.size())
+		{
+			Block block;
+			block.size = std::max(minBlockSize, bytes);
+			block.memory = new char[block.size];
+			blocks.push_back(block);
+		}
+		void * memory = blocks[current].memory + used;
+		used += bytes;
+		return memory;
+	}
+};
+
+boost::thread_specific_ptr<ScratchArena> ScratchArena::local;
+
+
+static size_t ParticleBytes(const Partio::ParticlesData * frameData)
+{
+	size_t particleBytes = 0;
+	Partio::ParticleAttribute attr;
+	for (int i = 0; i < frameData->numAttributes(); ++i)
+	{
+		frameData->attributeInfo(i, attr);
+		particleBytes += attr.count * sizeof(float);	//	every Partio type is 4 bytes wide
+	}
+	return particleBytes * frameData->numParticles();
+}
+
+
+static void ReleaseParticles(const Partio::ParticlesData * frameData)		//	deleter for frames held by shared_ptr
+{
+	frameData->release();
+}
+
+
+static bool FindAttribute(const Partio::ParticlesData * frameData, const char * const * names, int count, Partio::ParticleAttribute & attr)	//	first of names with count values, any numeric type
+{
+	for (; *names; ++names)
+	{
+		if (frameData->attributeInfo(*names, attr) && attr.count == count && (attr.type == Partio::FLOAT || attr.type == Partio::VECTOR || attr.type == Partio::INT))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+
+static unsigned ParticleId(const Partio::ParticlesData * frameData, const Partio::ParticleAttribute & idAttr, int particle)	//	key for joining particles by id
+{
+	if (idAttr.type == Partio::INT)
+	{
+		return (unsigned)*frameData->data<int>(idAttr, particle);
+	}
+	float value = *frameData->data<float>(idAttr, particle);
+	if (value == floorf(value) && fabsf(value) < 2147483648.0f)
+	{
+		return (unsigned)(int)value;		//	whole ids key the same in either type
+	}
+	unsigned bits;		//	Modo's own ids are fractions in [0, 1), which truncating would all make 0
+	memcpy(&bits, &value, 4);
+	return bits;
+}
+
+
+/*
+ * The native .mpc format, laid out so a frame reads back with a copy per column.
+ *
+ *	header		64 bytes: magic, version, particle count, column count, index offset and size
+ *	columns		one per attribute, each starting on a 4K boundary, count * 4 bytes per particle
+ *	index		per column: Partio attribute name, Modo feature name, type, count, file offset, size
+ *
+ * Integers are little endian and strings are a 16-bit length followed by the
+ * characters. The index is written last, so columns stream straight out.
+ *
+ * Version 2 starts the index with the name of a reference frame, empty if
+ * there is none, and ends each index entry with an encoding for the column.
+ *
+ * A delta frame stores a frame of a sequence against the keyframe before it.
+ * Particles are matched to the reference by index, when flag 1 at byte 40 is
+ * set, or else by id. A column may be raw as in version 1, the same as the
+ * reference's for every particle and take no space, or the differences from
+ * the matched particles' values. Differences are taken on the bits of each
+ * value, so they're exact, then split into byte planes and deflated.
+ * Unmatched particles keep their own values, and a frame matched by id has
+ * its id column raw.
+ *
+ * Frames of a sequence carry a stamp at byte 44 that is new every time the
+ * frame is written. A delta frame sets flag 2 and keeps its reference's
+ * stamp at byte 52, so a reference rewritten or left over from another bake
+ * fails the read instead of decoding against the wrong particles. A
+ * reference is never itself a delta, so reading a frame decodes at most one
+ * other.
+ *
+ * A quantized column stands alone. Fixed point columns start with a minimum
+ * and a step per component, as floats, then hold an 8 or 16-bit code per
+ * value; half columns hold 16-bit floats. The writer only quantizes a column
+ * when every decoded value is within the tolerance asked for.
+ */
+static const char mpcMagic[8] = {'M', 'O', 'D', 'O', 'P', 'R', 'T', 'C'};
+static const unsigned mpcVersion = 1;
+static const unsigned mpcEncodedVersion = 2;
+static const unsigned mpcMatchIndex = 1;
+static const unsigned mpcDelta = 2;
+static const int mpcMaxKeyframeInterval = 100;		//	bounds how far a delta drifts from its keyframe
+static const size_t mpcHeaderSize = 64;
+static const size_t mpcAlignment = 4096;
+
+enum MPCEncoding
+{
+	MPC_RAW,
+	MPC_SAME,
+	MPC_DELTA,
+	MPC_FIXED8,
+	MPC_FIXED16,
+	MPC_HALF
+};
+
+static unsigned long long NewFrameStamp()		//	distinct for each frame written, across bakes and sessions; called from the main thread
+{
+	static unsigned long long counter = 0;
+	unsigned long long stamp = (unsigned long long)boost::chrono::system_clock::now().time_since_epoch().count() + (++counter) * 0x9e3779b97f4a7c15ULL;
+	stamp = (stamp ^ (stamp >> 30)) * 0xbf58476d1ce4e5b9ULL;		//	splitmix64 finaliser
+	stamp = (stamp ^ (stamp >> 27)) * 0x94d049bb133111ebULL;
+	stamp ^= stamp >> 31;
+	return stamp ? stamp : 1;
+}
+
+static unsigned short FloatToHalf(float value)		//	rounded to nearest even, too large goes to infinity
+{
+	unsigned bits;
+	memcpy(&bits, &value, 4);
+	unsigned sign = (bits >> 16) & 0x8000;
+	unsigned mantissa = bits & 0x7fffff;
+	int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+	if (((bits >> 23) & 0xff) == 0xff)
+	{
+		return (unsigned short)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+	}
+	if (exponent >= 31)
+	{
+		return (unsigned short)(sign | 0x7c00);
+	}
+
+	unsigned shift = 13, half;
+	if (exponent <= 0)		//	subnormal, with the implicit bit shifted in
+	{
+		if (exponent < -10)
+		{
+			return (unsigned short)sign;
+		}
+		mantissa |= 0x800000;
+		shift = 14 - exponent;
+		half = mantissa >> shift;
+	}
+	else
+	{
+		half = (exponent << 10) | (mantissa >> shift);
+	}
+	unsigned rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+	if (rest > halfway || (rest == halfway && (half & 1)))
+	{
+		++half;		//	may carry into the exponent, which is still right
+	}
+	return (unsigned short)(sign | half);
+}
+
+static float HalfToFloat(unsigned short half)
+{
+	unsigned sign = (half & 0x8000) << 16, exponent = (half >> 10) & 0x1f, mantissa = half & 0x3ff;
+	if (exponent == 0)
+	{
+		float value = ldexpf((float)mantissa, -24);
+		return sign ? -value : value;
+	}
+	unsigned bits = sign | ((exponent == 31) ? 0x7f800000 : ((exponent + 112) << 23)) | (mantissa << 13);
+	float value;
+	memcpy(&value, &bits, 4);
+	return value;
+}
+
+static size_t QuantizedBytes(unsigned encoding, int count, size_t numParticles)		//	0 for encodings that aren't quantized
+{
+	switch (encoding)
+	{
+	case MPC_FIXED8:
+		return count * 8 + numParticles * count;
+	case MPC_FIXED16:
+		return count * 8 + numParticles * count * 2;
+	case MPC_HALF:
+		return numParticles * count * 2;
+	}
+	return 0;
+}
+
+static void Dequantize(const char * packed, unsigned encoding, int count, size_t numParticles, float * values)		//	packed holds QuantizedBytes of encoding, at any alignment
+{
+	size_t words = numParticles * count;
+	unsigned short code16;
+	if (encoding == MPC_HALF)
+	{
+		for (size_t w = 0; w < words; ++w)
+		{
+			memcpy(&code16, packed + w * 2, 2);
+			values[w] = HalfToFloat(code16);
+		}
+		return;
+	}
+
+	std::vector<float> minimum(count), step(count);
+	memcpy(&minimum[0], packed, count * 4);
+	memcpy(&step[0], packed + count * 4, count * 4);
+	const unsigned char * codes = (const unsigned char *)(packed + count * 8);
+	for (size_t p = 0, w = 0; p < numParticles; ++p)
+	{
+		for (int k = 0; k < count; ++k, ++w)
+		{
+			if (encoding == MPC_FIXED8)
+			{
+				values[w] = minimum[k] + (float)codes[w] * step[k];
+			}
+			else
+			{
+				memcpy(&code16, codes + w * 2, 2);
+				values[w] = minimum[k] + (float)code16 * step[k];
+			}
+		}
+	}
+}
+
+static Partio::ParticlesData * AcquireFrame(const std::string & fileName);		//	through the frame cache, defined after it
+static void ReleaseFrame(const Partio::ParticlesData * frameData);
+
+static void MatchIds(const unsigned * ids, int count, const Partio::ParticlesData * reference, const Partio::ParticleAttribute & refIdAttr, std::vector<int> & match)	//	by the bits of the id, the first reference particle with an id wins
+{
+	boost::unordered_map<unsigned, int> index;
+	for (int p = 0; p < reference->numParticles(); ++p)
+	{
+		index.insert(std::make_pair(*(const unsigned *)reference->data<float>(refIdAttr, p), p));
+	}
+	match.assign(count, -1);
+	for (int p = 0; p < count; ++p)
+	{
+		boost::unordered_map<unsigned, int>::const_iterator iter = index.find(ids[p]);
+		if (iter != index.end())
+		{
+			match[p] = iter->second;
+		}
+	}
+}
+
+struct FrameSchema		//	attribute layout of a cache file, enough to negotiate features with Modo
+{
+	std::vector<Partio::ParticleAttribute> attributes;
+	std::vector<std::string> features;		//	Modo feature of each attribute, only known for .mpc files
+	int numParticles;
+
+	FrameSchema() : numParticles(0)
+	{}
+
+	void Set(const Partio::ParticlesInfo * info, const std::vector<std::string> & frameFeatures = std::vector<std::string>())		//	frameFeatures as ReadFrame returns them, if any
+	{
+		attributes.resize(info->numAttributes());
+		for (int i = 0; i < info->numAttributes(); ++i)
+		{
+			info->attributeInfo(i, attributes[i]);
+		}
+		features = (frameFeatures.size() == attributes.size()) ? frameFeatures : std::vector<std::string>();
+		numParticles = info->numParticles();
+	}
+
+	size_t Hash() const
+	{
+		size_t seed = 0;
+		for (size_t i = 0; i < attributes.size(); ++i)
+		{
+			boost::hash_combine(seed, attributes[i].name);
+			boost::hash_combine(seed, (int)attributes[i].type);
+			boost::hash_combine(seed, attributes[i].count);
+			boost::hash_combine(seed, attributes[i].attributeIndex);
+		}
+		boost::hash_combine(seed, features);
+		return seed;
+	}
+
+	bool Same(const FrameSchema & other) const		//	same attributes and features, whatever the particle count
+	{
+		if (attributes.size() != other.attributes.size() || features != other.features)
+		{
+			return false;
+		}
+		for (size_t i = 0; i < attributes.size(); ++i)
+		{
+			const Partio::ParticleAttribute & a = attributes[i], & b = other.attributes[i];
+			if (a.name != b.name || a.type != b.type || a.count != b.count || a.attributeIndex != b.attributeIndex)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	size_t Bytes() const		//	estimated size of the decoded frame
+	{
+		size_t particleBytes = 0;
+		for (size_t i = 0; i < attributes.size(); ++i)
+		{
+			particleBytes += attributes[i].count * 4;
+		}
+		return particleBytes * numParticles;
+	}
+
+	bool FindFeature(const std::string & feature, Partio::ParticleAttribute & attr) const
+	{
+		for (size_t i = 0; i < features.size(); ++i)
+		{
+			if (features[i] == feature)
+			{
+				attr = attributes[i];
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool Find(const std::string & name, Partio::ParticleAttribute & attr) const
+	{
+		for (std::vector<Partio::ParticleAttribute>::const_iterator iter = attributes.begin(); iter != attributes.end(); ++iter)
+		{
+			if (iter->name == name)
+			{
+				attr = *iter;
+				return true;
+			}
+		}
+		for (std::vector<Partio::ParticleAttribute>::const_iterator iter = attributes.begin(); iter != attributes.end(); ++iter)
+		{
+			if (boost::algorithm::iequals(iter->name, name))		//	Partio reads some .prt channels back under other capitals
+			{
+				attr = *iter;
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+
+/*
+ * Reads .mpc frames into Partio frames. The file is mapped while it is read,
+ * columns are copied out as they are, and delta and quantized columns are
+ * decoded on the way. Headers can be read on their own, touching only the
+ * header and index pages.
+ */
+class MpcReader
+{
+public:
+	static Partio::ParticlesDataMutable * Read(const std::string & fileName, std::vector<std::string> * features = NULL)		//	NULL if the file is missing or malformed
+	{
+		boost::scoped_ptr<MpcReader> reader(Open(fileName, false));
+		if (!reader)
+		{
+			return NULL;
+		}
+		if (features)
+		{
+			*features = reader->features;
+		}
+		return reader->Build();
+	}
+
+	static bool Schema(const std::string & fileName, FrameSchema & schema)
+	{
+		boost::scoped_ptr<MpcReader> reader(Open(fileName, true));
+		if (!reader)
+		{
+			return false;
+		}
+		schema.attributes = reader->attributes;
+		schema.features = reader->features;
+		schema.numParticles = reader->particleCount;
+		return true;
+	}
+
+private:
+	boost::interprocess::file_mapping mapping;
+	boost::interprocess::mapped_region region;
+	int particleCount;
+	std::vector<Partio::ParticleAttribute> attributes;
+	std::vector<std::string> features;
+	std::vector<char *> columns;
+	std::vector< std::vector<char> > decoded;		//	columns of a delta frame that aren't in the file as they are
+
+	MpcReader(const std::string & fileName) : mapping(fileName.c_str(), boost::interprocess::read_only), region(mapping, boost::interprocess::read_only), particleCount(0)
+	{}
+
+	static MpcReader * Open(const std::string & fileName, bool headersOnly)		//	NULL if the file is missing or malformed, nothing decoded with headersOnly
+	{
+		MpcReader * reader = NULL;
+		try
+		{
+			reader = new MpcReader(fileName);
+		}
+		catch (...)
+		{
+			return NULL;
+		}
+		if (!reader->Parse(fileName, headersOnly))
+		{
+			delete reader;
+			return NULL;
+		}
+		return reader;
+	}
+
+	Partio::ParticlesDataMutable * Build() const
+	{
+		Partio::ParticlesDataMutable * frameData = Partio::create();
+		std::vector<Partio::ParticleAttribute> attrs;
+		for (size_t i = 0; i < attributes.size(); ++i)
+		{
+			attrs.push_back(frameData->addAttribute(attributes[i].name.c_str(), attributes[i].type, attributes[i].count));
+		}
+		frameData->addParticles(particleCount);
+		if (particleCount == 0)
+		{
+			return frameData;
+		}
+		for (size_t i = 0; i < attrs.size(); ++i)
+		{
+			size_t bytes = attrs[i].count * 4;
+			char * first = (char *)frameData->dataWrite<float>(attrs[i], 0);
+			char * last = (char *)frameData->dataWrite<float>(attrs[i], particleCount - 1);
+			if (last - first == (std::ptrdiff_t)((particleCount - 1) * bytes))		//	one block, as Partio::create keeps them
+			{
+				memcpy(first, columns[i], particleCount * bytes);
+				continue;
+			}
+			for (int p = 0; p < particleCount; ++p)
+			{
+				memcpy(frameData->dataWrite<float>(attrs[i], p), columns[i] + p * bytes, bytes);
+			}
+		}
+		return frameData;
+	}
+
+	bool FindColumn(const char * const * names, int count, Partio::ParticleAttribute & attr) const		//	as FindAttribute does for a frame
+	{
+		for (; *names; ++names)
+		{
+			for (size_t i = 0; i < attributes.size(); ++i)
+			{
+				if (attributes[i].name == *names && attributes[i].count == count)
+				{
+					attr = attributes[i];
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	bool Parse(const std::string & fileName, bool headersOnly)
+	{
+		const char * base = (const char *)region.get_address();
+		size_t size = region.get_size();
+		if (size < mpcHeaderSize || memcmp(base, mpcMagic, sizeof(mpcMagic)) != 0 || (Get(base + 8, 4) != mpcVersion && Get(base + 8, 4) != mpcEncodedVersion))
+		{
+			return false;
+		}
+		bool encoded = (Get(base + 8, 4) == mpcEncodedVersion);
+		unsigned long long numParticles = Get(base + 12, 8);
+		unsigned long long numColumns = Get(base + 20, 4);
+		unsigned long long indexOffset = Get(base + 24, 8);
+		unsigned long long indexSize = Get(base + 32, 8);
+		if (numParticles > 0x7fffffff || indexOffset > size || indexSize > size - indexOffset)
+		{
+			return false;
+		}
+		particleCount = (int)numParticles;
+
+		const char * cursor = base + indexOffset;
+		const char * end = cursor + indexSize;
+		std::string referenceName;
+		if (encoded && !GetString(cursor, end, referenceName))
+		{
+			return false;
+		}
+
+		std::vector<unsigned> encodings;
+		std::vector<unsigned long long> sizes;
+		bool referenced = false;
+		for (unsigned i = 0; i < numColumns; ++i)
+		{
+			Partio::ParticleAttribute attr;
+			std::string feature;
+			if (!GetString(cursor, end, attr.name) || !GetString(cursor, end, feature) || end - cursor < (encoded ? 28 : 24))
+			{
+				return false;
+			}
+			attr.type = (Partio::ParticleAttributeType)Get(cursor, 4);
+			attr.count = (int)Get(cursor + 4, 4);
+			attr.attributeIndex = (int)i;
+			unsigned long long offset = Get(cursor + 8, 8);
+			unsigned long long bytes = Get(cursor + 16, 8);
+			unsigned encoding = encoded ? (unsigned)Get(cursor + 24, 4) : (unsigned)MPC_RAW;
+			cursor += encoded ? 28 : 24;
+
+			if ((attr.type != Partio::FLOAT && attr.type != Partio::VECTOR && attr.type != Partio::INT) || attr.count <= 0 || encoding > MPC_HALF || offset > size || bytes > size - offset ||
+				(encoding == MPC_RAW && (bytes != numParticles * attr.count * 4 || offset % 4 != 0)) ||
+				(encoding >= MPC_FIXED8 && (attr.type == Partio::INT || bytes != QuantizedBytes(encoding, attr.count, (size_t)numParticles))))
+			{
+				return false;
+			}
+			referenced = referenced || encoding == MPC_SAME || encoding == MPC_DELTA;
+			attributes.push_back(attr);
+			features.push_back(feature);
+			columns.push_back((char *)base + offset);		//	encoded columns are replaced once decoded
+			encodings.push_back(encoding);
+			sizes.push_back(bytes);
+		}
+		if (!encoded || headersOnly)
+		{
+			return true;
+		}
+		if (!referenced)
+		{
+			return Decode(NULL, 0, encodings, sizes);
+		}
+
+		boost::filesystem::path referencePath = boost::filesystem::path(fileName).parent_path() / referenceName;
+		if (referenceName.empty() || boost::algorithm::iequals(referenceName, boost::filesystem::path(fileName).filename().string()))
+		{
+			return false;
+		}
+		unsigned long long stamp;
+		if (!ReferenceStamp(referencePath.string(), stamp) || stamp != Get(base + 52, 8))
+		{
+			return false;		//	not the frame this one was written against
+		}
+		const Partio::ParticlesData * reference = AcquireFrame(referencePath.string());		//	usually the frame just read
+		if (!reference)
+		{
+			return false;
+		}
+		bool ok = Decode(reference, (unsigned)Get(base + 40, 4), encodings, sizes);
+		ReleaseFrame(reference);
+		return ok;
+	}
+
+	static bool ReferenceStamp(const std::string & fileName, unsigned long long & stamp)		//	from the header alone, false unless fileName is a stamped keyframe
+	{
+		char header[mpcHeaderSize];
+		std::ifstream in(fileName.c_str(), std::ios::in | std::ios::binary);
+		if (!in.read(header, sizeof(header)) || memcmp(header, mpcMagic, sizeof(mpcMagic)) != 0 || Get(header + 8, 4) != mpcEncodedVersion ||
+			(Get(header + 40, 4) & mpcDelta))		//	checked before acquiring it, so references can't recurse
+		{
+			return false;
+		}
+		stamp = Get(header + 44, 8);
+		return stamp != 0;
+	}
+
+	bool Decode(const Partio::ParticlesData * reference, unsigned flags, const std::vector<unsigned> & encodings, const std::vector<unsigned long long> & sizes)		//	reference is NULL when no column needs it
+	{
+		std::vector<int> match;
+		if (reference && (flags & mpcMatchIndex))
+		{
+			if (reference->numParticles() != particleCount)
+			{
+				return false;
+			}
+			match.resize(particleCount);
+			for (int p = 0; p < particleCount; ++p)
+			{
+				match[p] = p;
+			}
+		}
+		else if (reference)
+		{
+			Partio::ParticleAttribute idAttr, refIdAttr;
+			if (!FindColumn(idNames, 1, idAttr) || encodings[idAttr.attributeIndex] != MPC_RAW ||
+				!reference->attributeInfo(idAttr.name.c_str(), refIdAttr) || refIdAttr.type != idAttr.type || refIdAttr.count != 1)
+			{
+				return false;
+			}
+			MatchIds((const unsigned *)columns[idAttr.attributeIndex], particleCount, reference, refIdAttr, match);
+		}
+
+		decoded.resize(attributes.size());
+		for (size_t i = 0; i < attributes.size(); ++i)
+		{
+			if (encodings[i] == MPC_RAW)
+			{
+				continue;
+			}
+			const Partio::ParticleAttribute & attr = attributes[i];
+			if (encodings[i] >= MPC_FIXED8)
+			{
+				decoded[i].assign(std::max((size_t)particleCount * attr.count, (size_t)1) * 4, 0);
+				Dequantize(columns[i], encodings[i], attr.count, particleCount, (float *)&decoded[i][0]);
+				columns[i] = &decoded[i][0];
+				continue;
+			}
+
+			Partio::ParticleAttribute refAttr;
+			if (!reference->attributeInfo(attr.name.c_str(), refAttr) || refAttr.type != attr.type || refAttr.count != attr.count)
+			{
+				return false;
+			}
+
+			size_t words = (size_t)particleCount * attr.count;
+			decoded[i].assign(std::max(words, (size_t)1) * 4, 0);
+			unsigned * values = (unsigned *)&decoded[i][0];
+			if (encodings[i] == MPC_DELTA && words > 0)
+			{
+				std::vector<unsigned char> planes(words * 4);
+				uLongf length = (uLongf)planes.size();
+				if (uncompress(&planes[0], &length, (const Bytef *)columns[i], (uLong)sizes[i]) != Z_OK || length != planes.size())
+				{
+					return false;
+				}
+				for (size_t w = 0; w < words; ++w)
+				{
+					values[w] = planes[w] | (planes[words + w] << 8) | (planes[2 * words + w] << 16) | ((unsigned)planes[3 * words + w] << 24);
+				}
+			}
+
+			for (int p = 0; p < particleCount; ++p)
+			{
+				if (match[p] < 0)
+				{
+					if (encodings[i] == MPC_SAME)
+					{
+						return false;
+					}
+					continue;
+				}
+				const unsigned * previous = (const unsigned *)reference->data<float>(refAttr, match[p]);
+				for (int k = 0; k < attr.count; ++k)
+				{
+					values[p * attr.count + k] += previous[k];
+				}
+			}
+			columns[i] = &decoded[i][0];
+		}
+		return true;
+	}
+
+	static unsigned long long Get(const char * source, int bytes)
+	{
+		unsigned long long value = 0;
+		for (int i = bytes - 1; i >= 0; --i)
+		{
+			value = (value << 8) | (unsigned char)source[i];
+		}
+		return value;
+	}
+
+	static bool GetString(const char *& cursor, const char * end, std::string & value)
+	{
+		if (end - cursor < 2)
+		{
+			return false;
+		}
+		size_t length = (size_t)Get(cursor, 2);
+		cursor += 2;
+		if ((size_t)(end - cursor) < length)
+		{
+			return false;
+		}
+		value.assign(cursor, length);
+		cursor += length;
+		return true;
+	}
+};
+
+
+static Partio::ParticlesData * ReadFrame(const std::string & fileName, std::vector<std::string> * features = NULL)		//	features of the attributes, for .mpc files
+{
+	if (boost::algorithm::iends_with(fileName, ".mpc"))
+	{
+		return MpcReader::Read(fileName, features);
+	}
+	return Partio::read(fileName.c_str());	//	readCached holds Partio's global lock while reading, which would serialise our workers
+}
+
+
+static bool ReadFrameSchema(const std::string & fileName, FrameSchema & schema)
+{
+	if (boost::algorithm::iends_with(fileName, ".mpc"))
+	{
+		return MpcReader::Schema(fileName, schema);
+	}
+	Partio::ParticlesInfo * info = Partio::readHeaders(fileName.c_str());
+	if (!info)
+	{
+		return false;
+	}
+	schema.Set(info);
+	info->release();
+	return true;
+}
+
+
+/*
+ * Uniform grid over the positions of one frame. Particles are sorted by cell,
+ * so the particles of a cell are contiguous and a box can be answered a cell
+ * at a time. Cells are sized for about 64 particles each, with at most 256
+ * cells along an axis.
+ */
+class ParticleGrid
+{
+public:
+	float bounds[6];		//	min xyz, max xyz, as LXtTableauBox
+	int dims[3];
+	std::vector<unsigned> cellStart;		//	first entry of each cell in particles, plus an end marker
+	std::vector<int> particles;
+	float speed[3];		//	largest velocity along each axis, for particles moved along their velocities
+
+	ParticleGrid(const Partio::ParticlesData * frameData)
+	{
+		Partio::ParticleAttribute positionAttr, velocityAttr;
+		int numParticles = frameData->numParticles();
+		bool havePositions = frameData->attributeInfo("position", positionAttr) && positionAttr.type == Partio::VECTOR && positionAttr.count == 3;
+
+		for (int i = 0; i < 3; ++i)
+		{
+			bounds[i] = 1.0e30f;
+			bounds[i + 3] = -1.0e30f;
+			dims[i] = 1;
+			scale[i] = 0.0f;
+			speed[i] = 0.0f;
+		}
+		if (FindAttribute(frameData, velocityNames, 3, velocityAttr) && velocityAttr.type != Partio::INT)
+		{
+			for (int p = 0; p < numParticles; ++p)
+			{
+				const float * velocity = frameData->data<float>(velocityAttr, p);
+				for (int i = 0; i < 3; ++i)
+				{
+					speed[i] = std::max(speed[i], fabsf(velocity[i]));
+				}
+			}
+		}
+		if (!havePositions || numParticles == 0)
+		{
+			bounds[0] = bounds[1] = bounds[2] = bounds[3] = bounds[4] = bounds[5] = 0.0f;
+			cellStart.assign(2, 0);
+			cellStart[1] = numParticles;
+			for (int p = 0; p < numParticles; ++p)
+			{
+				particles.push_back(p);
+			}
+			return;
+		}
+
+		for (int p = 0; p < numParticles; ++p)
+		{
+			const float * position = frameData->data<float>(positionAttr, p);
+			for (int i = 0; i < 3; ++i)
+			{
+				bounds[i] = std::min(bounds[i], position[i]);
+				bounds[i + 3] = std::max(bounds[i + 3], position[i]);
+			}
+		}
+
+		float extent[3];
+		float largest = std::max(bounds[3] - bounds[0], std::max(bounds[4] - bounds[1], bounds[5] - bounds[2]));
+		for (int i = 0; i < 3; ++i)
+		{
+			extent[i] = std::max(bounds[i + 3] - bounds[i], largest * 1.0e-3f);		//	flat emitters still get cells across
+		}
+		double density = (largest > 0.0f) ? pow((numParticles / 64.0) / ((double)extent[0] * extent[1] * extent[2]), 1.0 / 3.0) : 0.0;
+		for (int i = 0; i < 3; ++i)
+		{
+			dims[i] = std::max(1, std::min(256, (int)(extent[i] * density + 0.5)));
+			scale[i] = (bounds[i + 3] > bounds[i]) ? dims[i] / (bounds[i + 3] - bounds[i]) : 0.0f;
+		}
+
+		std::vector<unsigned> cellOf(numParticles);
+		cellStart.assign(Cells() + 1, 0);
+		for (int p = 0; p < numParticles; ++p)
+		{
+			cellOf[p] = Cell(frameData->data<float>(positionAttr, p));
+			++cellStart[cellOf[p] + 1];
+		}
+		for (unsigned c = 0; c < Cells(); ++c)
+		{
+			cellStart[c + 1] += cellStart[c];
+		}
+		std::vector<unsigned> fill(cellStart.begin(), cellStart.end() - 1);
+		particles.resize(numParticles);
+		for (int p = 0; p < numParticles; ++p)
+		{
+			particles[fill[cellOf[p]]++] = p;
+		}
+	}
+
+	unsigned Cells() const
+	{
+		return dims[0] * dims[1] * dims[2];
+	}
+
+	size_t Bytes() const
+	{
+		return cellStart.size() * sizeof(unsigned) + particles.size() * sizeof(int);
+	}
+
+	/*
+	 * The queries take the seconds particles are moved along their velocities,
+	 * 0 if they stay put, and widen the particle bounds by how far they can go.
+	 */
+	bool Within(const LXtTableauBox box, float seconds) const		//	every particle is inside box
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			float reach = speed[i] * fabsf(seconds);
+			if (!(box[i] <= bounds[i] - reach && box[i + 3] >= bounds[i + 3] + reach))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void CellBox(unsigned cell, float seconds, LXtTableauBox box) const
+	{
+		int index[3] = {(int)(cell % dims[0]), (int)((cell / dims[0]) % dims[1]), (int)(cell / (dims[0] * dims[1]))};
+		for (int i = 0; i < 3; ++i)
+		{
+			float size = (bounds[i + 3] - bounds[i]) / dims[i];
+			float reach = speed[i] * fabsf(seconds);
+			box[i] = bounds[i] + index[i] * size;
+			box[i + 3] = ((index[i] + 1 == dims[i]) ? bounds[i + 3] : box[i] + size) + reach;
+			box[i] -= reach;
+		}
+	}
+
+	void Overlapping(const LXtTableauBox box, float seconds, std::vector<unsigned> & cells) const		//	non-empty cells whose particles can touch box
+	{
+		int lo[3], hi[3];
+		for (int i = 0; i < 3; ++i)
+		{
+			float reach = speed[i] * fabsf(seconds);
+			if (box[i] - reach > bounds[i + 3] || box[i + 3] + reach < bounds[i])
+			{
+				return;
+			}
+			lo[i] = Clamp(box[i] - reach, i);
+			hi[i] = Clamp(box[i + 3] + reach, i);
+		}
+		for (int z = lo[2]; z <= hi[2]; ++z)
+		{
+			for (int y = lo[1]; y <= hi[1]; ++y)
+			{
+				for (int x = lo[0]; x <= hi[0]; ++x)
+				{
+					unsigned cell = (z * dims[1] + y) * dims[0] + x;
+					if (cellStart[cell + 1] > cellStart[cell])
+					{
+						cells.push_back(cell);
+					}
+				}
+			}
+		}
+	}
+
+private:
+	float scale[3];		//	cells per unit
+
+	int Clamp(float value, int axis) const
+	{
+		float cell = (value - bounds[axis]) * scale[axis];
+		return (cell >= 0.0f) ? std::min((int)cell, dims[axis] - 1) : 0;		//	NaN goes to the first cell
+	}
+
+	unsigned Cell(const float * position) const
+	{
+		return (Clamp(position[2], 2) * dims[1] + Clamp(position[1], 1)) * dims[0] + Clamp(position[0], 0);
+	}
+};
+
+
+/*
+ * Decodes a frame a chunk of particles at a time, for frames too large to hold
+ * whole. Only formats whose particles can be read in order without the rest of
+ * the file are streamed: Krakatoa .prt through its zlib stream, and
+ * uncompressed Maya .pdc and classic Houdini .bgeo. Gzipped files, RealFlow .bin,
+ * whose particle layout changes between RealFlow versions, and everything else
+ * are read whole. Values are written into the columns of the frame's schema,
+ * matched by attribute name, converted to float or int as the schema says.
+ */
+class ChunkReader
+{
+public:
+	static ChunkReader * Open(const std::string & fileName, const FrameSchema & schema);		//	NULL if the file can't be streamed
+
+	static bool Streams(const boost::filesystem::path & cacheFilePath, const FrameSchema & schema)		//	decides before anything is read
+	{
+		static const size_t threshold = BudgetBytes(BUDGET_STREAM);
+
+		return schema.Bytes() > threshold && FormatTraits::Get(cacheFilePath.extension().string()).streams && cacheFilePath.filename().string().find('*') == std::string::npos;	//	partitioned frames are merged whole
+	}
+
+	virtual ~ChunkReader()
+	{}
+
+	int Read(const std::vector<char *> & columns, int maxParticles)		//	particles read into the columns, 0 at the end, -1 on a damaged file
+	{
+		int count = std::min(maxParticles, remaining);
+		if (count > 0 && !ReadParticles(columns, count))
+		{
+			remaining = 0;
+			return -1;
+		}
+		remaining -= count;
+		return count;
+	}
+
+protected:
+	struct Field		//	where a schema attribute comes from in the file
+	{
+		int attr;
+		unsigned offset;	//	bytes into the particle or column
+		int type;			//	format type code
+		int count;
+	};
+
+	std::ifstream in;
+	FrameSchema schema;
+	std::vector<Field> fields;
+	int remaining;
+
+	ChunkReader() : remaining(0)
+	{}
+
+	virtual bool ReadHeader() = 0;
+	virtual bool ReadParticles(const std::vector<char *> & columns, int count) = 0;
+
+	int SchemaIndex(const std::string & name, bool capitalized) const		//	Partio changes the capitals of .prt channel names, "ID" among them
+	{
+		for (size_t i = 0; i < schema.attributes.size(); ++i)
+		{
+			const std::string & attrName = schema.attributes[i].name;
+			if (attrName == name || (capitalized && boost::algorithm::iequals(attrName, name)))
+			{
+				return schema.attributes[i].type == Partio::INDEXEDSTR ? -1 : (int)i;
+			}
+		}
+		return -1;
+	}
+
+	void Store(const std::vector<char *> & columns, const Field & field, int particle, int component, double value) const
+	{
+		const Partio::ParticleAttribute & attr = schema.attributes[field.attr];
+		if (component >= attr.count)
+		{
+			return;
+		}
+		char * out = columns[field.attr] + (particle * attr.count + component) * 4;
+		if (attr.type == Partio::INT)
+		{
+			*(int *)out = (int)value;
+		}
+		else
+		{
+			*(float *)out = (float)value;
+		}
+	}
+
+	static unsigned long long Bytes(const char * source, int count, bool bigEndian)
+	{
+		unsigned long long value = 0;
+		for (int i = 0; i < count; ++i)
+		{
+			value = (value << 8) | (unsigned char)source[bigEndian ? i : count - 1 - i];
+		}
+		return value;
+	}
+
+	static float Float(const char * source, bool bigEndian)
+	{
+		unsigned bits = (unsigned)Bytes(source, 4, bigEndian);
+		float value;
+		memcpy(&value, &bits, 4);
+		return value;
+	}
+
+	static double Double(const char * source, bool bigEndian)
+	{
+		unsigned long long bits = Bytes(source, 8, bigEndian);
+		double value;
+		memcpy(&value, &bits, 8);
+		return value;
+	}
+
+	bool ReadBytes(std::vector<char> & buffer, size_t count)
+	{
+		buffer.resize(count);
+		if (count > 0)
+		{
+			in.read(&buffer[0], count);
+		}
+		return in.good();
+	}
+
+	class PRTChunkReader;
+	class PDCChunkReader;
+	class BGEOChunkReader;
+};
+
+
+/*
+ * Krakatoa .prt: a little endian header and channel table, then the particles
+ * interleaved in one zlib stream, inflated as far as each chunk needs.
+ */
+class ChunkReader::PRTChunkReader : public ChunkReader
+{
+public:
+	PRTChunkReader() : particleSize(0), streamOpen(false)
+	{
+		memset(&stream, 0, sizeof(stream));
+	}
+
+	~PRTChunkReader()
+	{
+		if (streamOpen)
+		{
+			inflateEnd(&stream);
+		}
+	}
+
+protected:
+	unsigned particleSize;
+	z_stream stream;
+	bool streamOpen;
+	std::vector<char> input, particles;
+
+	bool ReadHeader()
+	{
+		std::vector<char> header;
+		if (!ReadBytes(header, 56) || (unsigned char)header[0] != 0xc0 || header[1] != 'P' || header[2] != 'R' || header[3] != 'T')
+		{
+			return false;
+		}
+		unsigned headerLength = (unsigned)Bytes(&header[8], 4, false);
+		remaining = (int)Bytes(&header[48], 8, false);
+		in.seekg(headerLength);
+
+		std::vector<char> table;
+		if (!ReadBytes(table, 12))
+		{
+			return false;
+		}
+		unsigned numChannels = (unsigned)Bytes(&table[4], 4, false);
+		unsigned channelLength = (unsigned)Bytes(&table[8], 4, false);
+		if (channelLength < 44 || numChannels > 4096 || !ReadBytes(table, numChannels * channelLength))
+		{
+			return false;
+		}
+		for (unsigned i = 0; i < numChannels; ++i)
+		{
+			const char * channel = &table[i * channelLength];
+			Field field;
+			field.type = (int)Bytes(channel + 32, 4, false);
+			field.count = (int)Bytes(channel + 36, 4, false);
+			field.offset = (unsigned)Bytes(channel + 40, 4, false);
+			if (field.type < 0 || field.type > 10)
+			{
+				return false;
+			}
+			particleSize = std::max(particleSize, field.offset + field.count * TypeSize(field.type));
+			field.attr = SchemaIndex(std::string(channel, strnlen(channel, 32)), true);
+			if (field.attr >= 0)
+			{
+				fields.push_back(field);
+			}
+		}
+
+		streamOpen = (inflateInit(&stream) == Z_OK);
+		input.resize(1 << 16);
+		return streamOpen;
+	}
+
+	bool ReadParticles(const std::vector<char *> & columns, int count)
+	{
+		particles.resize(count * particleSize);
+		stream.next_out = (Bytef *)&particles[0];
+		stream.avail_out = (uInt)particles.size();
+		while (stream.avail_out > 0)
+		{
+			if (stream.avail_in == 0)
+			{
+				in.read(&input[0], input.size());
+				stream.next_in = (Bytef *)&input[0];
+				stream.avail_in = (uInt)in.gcount();
+				if (stream.avail_in == 0)
+				{
+					return false;
+				}
+			}
+			int result = inflate(&stream, Z_NO_FLUSH);
+			if (result != Z_OK && !(result == Z_STREAM_END && stream.avail_out == 0))
+			{
+				return false;
+			}
+		}
+
+		for (std::vector<Field>::const_iterator field = fields.begin(); field != fields.end(); ++field)
+		{
+			int size = TypeSize(field->type);
+			for (int p = 0; p < count; ++p)
+			{
+				const char * value = &particles[p * particleSize + field->offset];
+				for (int k = 0; k < field->count; ++k, value += size)
+				{
+					Store(columns, *field, p, k, Value(value, field->type));
+				}
+			}
+		}
+		return true;
+	}
+
+	static int TypeSize(int type)		//	int16, int32, int64, float16, float32, float64, uint16, uint32, uint64, int8, uint8
+	{
+		static const int sizes[] = {2, 4, 8, 2, 4, 8, 2, 4, 8, 1, 1};
+		return sizes[type];
+	}
+
+	static double Value(const char * source, int type)
+	{
+		switch (type)
+		{
+			case 0: return (short)Bytes(source, 2, false);
+			case 1: return (int)Bytes(source, 4, false);
+			case 2: return (double)(long long)Bytes(source, 8, false);
+			case 3: return Half((unsigned short)Bytes(source, 2, false));
+			case 4: return Float(source, false);
+			case 5: return Double(source, false);
+			case 9: return (signed char)source[0];
+			case 10: return (unsigned char)source[0];
+			default: return (double)Bytes(source, TypeSize(type), false);
+		}
+	}
+
+	static float Half(unsigned short bits)
+	{
+		int exponent = (bits >> 10) & 0x1f;
+		float mantissa = (float)(bits & 0x3ff);
+		float value = (exponent == 0) ? ldexpf(mantissa, -24) : (exponent == 31 ? 1.0e30f : ldexpf(mantissa + 1024.0f, exponent - 25));
+		return (bits & 0x8000) ? -value : value;
+	}
+};
+
+
+/*
+ * Uncompressed Maya .pdc: a big endian header, then each attribute's values
+ * for every particle together, so a chunk is read from each column in turn.
+ */
+class ChunkReader::PDCChunkReader : public ChunkReader
+{
+public:
+	PDCChunkReader() : first(0)
+	{}
+
+protected:
+	std::vector<std::streamoff> columnStart;
+	int first;
+	std::vector<char> buffer;
+
+	bool ReadHeader()
+	{
+		std::vector<char> header;
+		if (!ReadBytes(header, 28) || memcmp(&header[0], "PDC ", 4) != 0)
+		{
+			return false;
+		}
+		remaining = (int)Bytes(&header[20], 4, true);
+		int numAttributes = (int)Bytes(&header[24], 4, true);
+
+		for (int i = 0; i < numAttributes; ++i)
+		{
+			std::vector<char> value;
+			if (!ReadBytes(value, 4))
+			{
+				return false;
+			}
+			size_t nameLength = (size_t)Bytes(&value[0], 4, true);
+			std::vector<char> name;
+			if (nameLength > 4096 || !ReadBytes(name, nameLength) || !ReadBytes(value, 4))
+			{
+				return false;
+			}
+			Field field;
+			field.type = (int)Bytes(&value[0], 4, true);
+			static const int valueSizes[] = {4, 4, 8, 8, 24, 24};		//	int, int array, double, double array, vector, vector array
+			if (field.type < 0 || field.type > 5)
+			{
+				return false;
+			}
+			bool perParticle = (field.type % 2) == 1;
+			field.count = (field.type >= 4) ? 3 : 1;
+			field.offset = (unsigned)columnStart.size();
+			field.attr = perParticle ? SchemaIndex(std::string(name.begin(), name.end()), false) : -1;
+			columnStart.push_back(in.tellg());
+			if (field.attr >= 0)
+			{
+				fields.push_back(field);
+			}
+			in.seekg((std::streamoff)valueSizes[field.type] * (perParticle ? remaining : 1), std::ios::cur);
+		}
+		return in.good();
+	}
+
+	bool ReadParticles(const std::vector<char *> & columns, int count)
+	{
+		for (std::vector<Field>::const_iterator field = fields.begin(); field != fields.end(); ++field)
+		{
+			int size = (field->type == 1) ? 4 : 8;
+			in.seekg(columnStart[field->offset] + (std::streamoff)first * size * field->count);
+			if (!ReadBytes(buffer, (size_t)count * size * field->count))
+			{
+				return false;
+			}
+			const char * value = &buffer[0];
+			for (int p = 0; p < count; ++p)
+			{
+				for (int k = 0; k < field->count; ++k, value += size)
+				{
+					Store(columns, *field, p, k, (size == 4) ? (double)(int)Bytes(value, 4, true) : Double(value, true));
+				}
+			}
+		}
+		first += count;
+		return true;
+	}
+};
+
+
+/*
+ * Uncompressed classic Houdini .bgeo: a big endian header and point attribute
+ * table, then each point's homogeneous position and attributes together.
+ */
+class ChunkReader::BGEOChunkReader : public ChunkReader
+{
+protected:
+	unsigned particleSize;		//	in 4 byte words
+	std::vector<char> buffer;
+
+	bool ReadHeader()
+	{
+		std::vector<char> header;
+		if (!ReadBytes(header, 41) || memcmp(&header[0], "BgeoV", 5) != 0)		//	gzipped files start with 0x1f8b and are read whole
+		{
+			return false;
+		}
+		remaining = (int)Bytes(&header[9], 4, true);
+		int numPointAttributes = (int)Bytes(&header[25], 4, true);
+
+		particleSize = 4;
+		Field position;
+		position.attr = SchemaIndex("position", false);
+		position.type = 0;
+		position.count = 3;
+		position.offset = 0;
+		if (position.attr >= 0)
+		{
+			fields.push_back(position);
+		}
+
+		for (int i = 0; i < numPointAttributes; ++i)
+		{
+			std::vector<char> value, name;
+			if (!ReadBytes(value, 2) || !ReadBytes(name, (size_t)Bytes(&value[0], 2, true)) || !ReadBytes(value, 6))
+			{
+				return false;
+			}
+			Field field;
+			field.count = (int)Bytes(&value[0], 2, true);
+			field.type = (int)Bytes(&value[2], 4, true);
+			field.offset = particleSize * 4;
+			if (field.type == 0 || field.type == 1 || field.type == 5)		//	float, int, vector
+			{
+				if (!ReadBytes(value, field.count * 4))		//	defaults
+				{
+					return false;
+				}
+				field.attr = SchemaIndex(std::string(name.begin(), name.end()), false);
+				if (field.attr >= 0)
+				{
+					fields.push_back(field);
+				}
+			}
+			else if (field.type == 4)		//	indexed strings are left to Partio
+			{
+				if (!ReadBytes(value, 4))
+				{
+					return false;
+				}
+				int numStrings = (int)Bytes(&value[0], 4, true);
+				for (int s = 0; s < numStrings; ++s)
+				{
+					if (!ReadBytes(value, 2) || !ReadBytes(name, (size_t)Bytes(&value[0], 2, true)))
+					{
+						return false;
+					}
+				}
+			}
+			else
+			{
+				return false;
+			}
+			particleSize += field.count;
+		}
+		return true;
+	}
+
+	bool ReadParticles(const std::vector<char *> & columns, int count)
+	{
+		if (!ReadBytes(buffer, (size_t)count * particleSize * 4))
+		{
+			return false;
+		}
+		for (std::vector<Field>::const_iterator field = fields.begin(); field != fields.end(); ++field)
+		{
+			for (int p = 0; p < count; ++p)
+			{
+				const char * value = &buffer[(p * particleSize) * 4 + field->offset];
+				for (int k = 0; k < field->count; ++k, value += 4)
+				{
+					Store(columns, *field, p, k, (field->type == 1) ? (double)(int)Bytes(value, 4, true) : (double)Float(value, true));
+				}
+			}
+		}
+		return true;
+	}
+};
+
+
+ChunkReader * ChunkReader::Open(const std::string & fileName, const FrameSchema & schema)
+{
+	std::string fileType = boost::filesystem::path(fileName).extension().string();
+	boost::algorithm::to_lower(fileType);
+
+	ChunkReader * reader = NULL;
+	if (fileType == ".prt")
+	{
+		reader = new PRTChunkReader();
+	}
+	else if (fileType == ".pdc")
+	{
+		reader = new PDCChunkReader();
+	}
+	else if (fileType == ".bgeo")
+	{
+		reader = new BGEOChunkReader();
+	}
+	if (reader)
+	{
+		reader->schema = schema;
+		reader->in.open(fileName.c_str(), std::ios::in | std::ios::binary);
+		if (!reader->in.good() || !reader->ReadHeader() || reader->remaining != schema.numParticles)
+		{
+			delete reader;
+			reader = NULL;
+		}
+	}
+	return reader;
+}
+
+
+/*
+ * A frame written as several partition files, read as one. The partitions are
+ * decoded together on the worker pool and concatenated in partition order.
+ * Attributes are the union of the partitions', in the order they are first
+ * seen, so headers alone give the same layout as the merged frame. Where a
+ * partition lacks an attribute, or has it with another type or size, its
+ * particles get zeros, except for ids, which are numbered on from the largest
+ * id in the frame so they stay unique. Indexed strings and the Modo feature
+ * names of .mpc files aren't carried over. A frame with a partition that can't
+ * be read isn't read at all, rather than coming back short.
+ */
+class PartitionedFrame
+{
+public:
+	static bool Is(const boost::filesystem::path & cacheFilePath)
+	{
+		return cacheFilePath.filename().string().find('*') != std::string::npos;
+	}
+
+	static Partio::ParticlesData * Read(const std::string & fileName)
+	{
+		std::vector<boost::filesystem::path> files;
+		if (!FrameSequenceIndex::Partitions(fileName, files))
+		{
+			return NULL;
+		}
+
+		std::vector<Partio::ParticlesData *> parts(files.size(), NULL);
+		WorkerPool::Get().ParallelFor((unsigned)files.size(), boost::bind(&PartitionedFrame::ReadPart, boost::cref(files), boost::ref(parts), _1));
+		if (std::find(parts.begin(), parts.end(), (Partio::ParticlesData *)NULL) != parts.end())
+		{
+			Release(parts);
+			return NULL;
+		}
+
+		std::vector<FrameSchema> schemas(parts.size());
+		for (size_t i = 0; i < parts.size(); ++i)
+		{
+			schemas[i].Set(parts[i]);
+		}
+		std::vector<Partio::ParticleAttribute> layout;
+		Layout(schemas, layout);
+
+		Merge merge;
+		merge.frameData = Partio::create();
+		merge.parts = &parts;
+		for (size_t i = 0; i < layout.size(); ++i)
+		{
+			merge.attrs.push_back(merge.frameData->addAttribute(layout[i].name.c_str(), layout[i].type, layout[i].count));
+		}
+		int total = 0;
+		for (size_t i = 0; i < parts.size(); ++i)
+		{
+			merge.starts.push_back(total);
+			total += parts[i]->numParticles();
+		}
+		merge.frameData->addParticles(total);
+		merge.missingIds.assign(parts.size(), 0);
+
+		WorkerPool::Get().ParallelFor((unsigned)parts.size(), boost::bind(&PartitionedFrame::CopyPart, boost::ref(merge), _1));
+		NumberIds(merge);
+
+		Release(parts);
+		return merge.frameData;
+	}
+
+	static bool Schema(const std::string & fileName, FrameSchema & schema)
+	{
+		std::vector<boost::filesystem::path> files;
+		if (!FrameSequenceIndex::Partitions(fileName, files))
+		{
+			return false;
+		}
+
+		std::vector<FrameSchema> schemas(files.size());
+		for (size_t i = 0; i < files.size(); ++i)
+		{
+			if (!ReadFrameSchema(PartName(files[i]), schemas[i]))
+			{
+				return false;
+			}
+		}
+
+		Layout(schemas, schema.attributes);
+		schema.features.clear();
+		schema.numParticles = 0;
+		for (size_t i = 0; i < schemas.size(); ++i)
+		{
+			schema.numParticles += schemas[i].numParticles;
+		}
+		return true;
+	}
+
+private:
+	struct Merge
+	{
+		Partio::ParticlesDataMutable * frameData;
+		const std::vector<Partio::ParticlesData *> * parts;
+		std::vector<Partio::ParticleAttribute> attrs;
+		std::vector<int> starts;		//	first particle of each partition in the merged frame
+		std::vector<char> missingIds;		//	partitions whose ids are left to NumberIds
+	};
+
+	static std::string PartName(boost::filesystem::path file)
+	{
+		std::string fileType = file.extension().string();
+		boost::algorithm::to_lower(fileType);	//	Partio readers expect lower case
+		file.replace_extension(boost::filesystem::path(fileType));
+		return file.string();
+	}
+
+	static void ReadPart(const std::vector<boost::filesystem::path> & files, std::vector<Partio::ParticlesData *> & parts, unsigned index)
+	{
+		parts[index] = ReadFrame(PartName(files[index]));
+	}
+
+	static void Release(std::vector<Partio::ParticlesData *> & parts)
+	{
+		for (size_t i = 0; i < parts.size(); ++i)
+		{
+			if (parts[i])
+			{
+				parts[i]->release();
+			}
+		}
+	}
+
+	static void Layout(const std::vector<FrameSchema> & schemas, std::vector<Partio::ParticleAttribute> & layout)
+	{
+		layout.clear();
+		for (size_t i = 0; i < schemas.size(); ++i)
+		{
+			for (size_t a = 0; a < schemas[i].attributes.size(); ++a)
+			{
+				Partio::ParticleAttribute attr = schemas[i].attributes[a];
+				if (attr.type == Partio::INDEXEDSTR)
+				{
+					continue;
+				}
+				size_t l = 0;
+				while (l < layout.size() && layout[l].name != attr.name)
+				{
+					++l;
+				}
+				if (l == layout.size())
+				{
+					attr.attributeIndex = (int)layout.size();		//	as Partio::create numbers them
+					layout.push_back(attr);
+				}
+			}
+		}
+	}
+
+	static void CopyPart(Merge & merge, unsigned index)		//	on a worker thread, each into its own range of the merged frame
+	{
+		const Partio::ParticlesData * part = (*merge.parts)[index];
+		int numParticles = part->numParticles();
+		if (numParticles == 0)
+		{
+			return;
+		}
+
+		Partio::ParticleAttribute idAttr;
+		bool haveIds = FindAttribute(merge.frameData, idNames, 1, idAttr);
+
+		for (size_t a = 0; a < merge.attrs.size(); ++a)
+		{
+			const Partio::ParticleAttribute & attr = merge.attrs[a];
+			size_t particleBytes = attr.count * sizeof(float);
+			char * column = (char *)merge.frameData->dataWrite<float>(attr, merge.starts[index]);
+
+			Partio::ParticleAttribute partAttr;
+			if (!part->attributeInfo(attr.name.c_str(), partAttr) || partAttr.type != attr.type || partAttr.count != attr.count)
+			{
+				memset(column, 0, numParticles * particleBytes);
+				if (haveIds && attr.name == idAttr.name)
+				{
+					merge.missingIds[index] = 1;
+				}
+				continue;
+			}
+
+			const char * source = (const char *)part->data<float>(partAttr, 0);
+			if ((const char *)part->data<float>(partAttr, numParticles - 1) == source + (numParticles - 1) * particleBytes)
+			{
+				memcpy(column, source, numParticles * particleBytes);
+			}
+			else
+			{
+				for (int p = 0; p < numParticles; ++p)
+				{
+					memcpy(column + p * particleBytes, part->data<float>(partAttr, p), particleBytes);
+				}
+			}
+		}
+	}
+
+	static void NumberIds(Merge & merge)
+	{
+		Partio::ParticleAttribute idAttr;
+		if (std::find(merge.missingIds.begin(), merge.missingIds.end(), 1) == merge.missingIds.end() || !FindAttribute(merge.frameData, idNames, 1, idAttr))
+		{
+			return;
+		}
+
+		double next = 0.0;
+		for (size_t i = 0; i < merge.missingIds.size(); ++i)
+		{
+			int end = (i + 1 < merge.starts.size()) ? merge.starts[i + 1] : merge.frameData->numParticles();
+			for (int p = merge.starts[i]; p < end && !merge.missingIds[i]; ++p)
+			{
+				double id = (idAttr.type == Partio::INT) ? merge.frameData->data<int>(idAttr, p)[0] : merge.frameData->data<float>(idAttr, p)[0];
+				next = std::max(next, id + 1.0);
+			}
+		}
+		for (size_t i = 0; i < merge.missingIds.size(); ++i)
+		{
+			int end = (i + 1 < merge.starts.size()) ? merge.starts[i + 1] : merge.frameData->numParticles();
+			for (int p = merge.starts[i]; p < end && merge.missingIds[i]; ++p, next += 1.0)
+			{
+				if (idAttr.type == Partio::INT)
+				{
+					merge.frameData->dataWrite<int>(idAttr, p)[0] = (int)next;
+				}
+				else
+				{
+					merge.frameData->dataWrite<float>(idAttr, p)[0] = (float)next;
+				}
+			}
+		}
+	}
+};
+
+
+/*
+ * Decoded frames shared by every item in the process. Frames are keyed by file
+ * path and reference counted; frames nobody holds stay resident until the total
+ * size passes the memory budget, then the least recently used are freed. The
+ * budget is read from the MODOPARTIO_CACHE_MB environment variable. A frame
+ * requested while another thread is reading it waits for that read, and a
+ * file rewritten during a read is dropped when the read finishes. File
+ * headers are kept separately, so features can be negotiated without reading
+ * any particle data.
+ */
+class FrameCache
+{
+public:
+	static FrameCache & Get()
+	{
+		static FrameCache * cache = new FrameCache();
+		return *cache;
+	}
+
+	Partio::ParticlesData * Acquire(const boost::filesystem::path & cacheFilePath)		//	adds a reference, NULL if the file can't be read
+	{
+		std::string key = Key(cacheFilePath);
+
+		boost::unique_lock<boost::mutex> lock(mutex);
+
+		EntryMap::iterator iter = entries.find(key);
+		while (iter != entries.end() && iter->second.loading)
+		{
+			loaded.wait(lock);
+			iter = entries.find(key);		//	gone if that read failed or went stale, then read it here
+		}
+		if (iter != entries.end())
+		{
+			++hits;
+			if (StageProfile::Current())
+			{
+				StageProfile::Current()->CountFrame(true);
+			}
+			++iter->second.refs;
+			lru.splice(lru.begin(), lru, iter->second.lru);
+			return iter->second.data;
+		}
+
+		++misses;
+		if (StageProfile::Current())
+		{
+			StageProfile::Current()->CountFrame(false);
+		}
+		Entry & entry = entries[key];
+		lru.push_front(key);
+		entry.lru = lru.begin();
+		lock.unlock();
+
+		Partio::ParticlesData * frameData;
+		std::vector<std::string> features;
+		{
+			StageTimer timer(STAGE_DECODE);
+			frameData = PartitionedFrame::Is(key) ? PartitionedFrame::Read(key) : ReadFrame(key, &features);
+			if (frameData)
+			{
+				timer.Count(frameData->numParticles(), ParticleBytes(frameData));
+			}
+		}
+
+		lock.lock();
+		iter = entries.find(key);
+		if (!frameData || iter->second.stale)
+		{
+			lru.erase(iter->second.lru);
+			entries.erase(iter);
+			if (frameData)
+			{
+				orphans[frameData] = 1;		//	rewritten while it was read, freed on release
+			}
+		}
+		else
+		{
+			iter->second.data = frameData;
+			iter->second.features.swap(features);
+			iter->second.bytes = ParticleBytes(frameData);
+			iter->second.loading = false;
+			iter->second.refs = 1;
+			owners[frameData] = key;
+			resident += iter->second.bytes;
+			peak = std::max(peak, resident);
+			Trim();
+		}
+		loaded.notify_all();
+
+		return frameData;
+	}
+
+	bool Schema(const boost::filesystem::path & cacheFilePath, FrameSchema & schema)
+	{
+		std::string key = Key(cacheFilePath);
+		{
+			boost::lock_guard<boost::mutex> lock(mutex);
+			EntryMap::const_iterator entry = entries.find(key);
+			if (entry != entries.end() && !entry->second.loading)
+			{
+				schema.Set(entry->second.data, entry->second.features);
+				return true;
+			}
+			SchemaMap::const_iterator iter = schemas.find(key);
+			if (iter != schemas.end())
+			{
+				schema = iter->second;
+				return true;
+			}
+		}
+
+		if (PartitionedFrame::Is(key))
+		{
+			if (!PartitionedFrame::Schema(key, schema))
+			{
+				return false;
+			}
+		}
+		else if (!ReadFrameSchema(key, schema))
+		{
+			return false;
+		}
+
+		boost::lock_guard<boost::mutex> lock(mutex);
+		if (schemas.size() > maxSchemas)
+		{
+			schemas.clear();
+		}
+		schemas[key] = schema;
+		return true;
+	}
+
+	std::vector<std::string> Features(const Partio::ParticlesData * frameData)		//	Modo features of a frame held from the cache, empty if unknown
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		OwnerMap::const_iterator owner = owners.find(frameData);
+		return (owner == owners.end()) ? std::vector<std::string>() : entries[owner->second].features;
+	}
+
+	void Release(const Partio::ParticlesData * frameData)
+	{
+		if (!frameData)
+		{
+			return;
+		}
+
+		boost::lock_guard<boost::mutex> lock(mutex);
+		OwnerMap::const_iterator owner = owners.find(frameData);
+		if (owner == owners.end())
+		{
+			OrphanMap::iterator orphan = orphans.find(frameData);		//	invalidated while held, freed by the last holder
+			if (orphan != orphans.end() && --orphan->second == 0)
+			{
+				frameData->release();
+				orphans.erase(orphan);
+			}
+			return;
+		}
+		EntryMap::iterator iter = entries.find(owner->second);
+		--iter->second.refs;
+		Trim();
+	}
+
+	boost::shared_ptr<const ParticleGrid> Grid(const Partio::ParticlesData * frameData)		//	built on first use and kept with the frame
+	{
+		{
+			boost::lock_guard<boost::mutex> lock(mutex);
+			OwnerMap::const_iterator owner = owners.find(frameData);
+			if (owner != owners.end() && entries[owner->second].grid)
+			{
+				return entries[owner->second].grid;
+			}
+		}
+
+		boost::shared_ptr<const ParticleGrid> grid(new ParticleGrid(frameData));
+
+		boost::lock_guard<boost::mutex> lock(mutex);
+		OwnerMap::const_iterator owner = owners.find(frameData);
+		if (owner == owners.end())
+		{
+			return grid;		//	invalidated meanwhile, the grid goes with the caller
+		}
+		Entry & entry = entries[owner->second];
+		if (!entry.grid)		//	another thread may have built it too
+		{
+			entry.grid = grid;
+			entry.bytes += grid->Bytes();
+			resident += grid->Bytes();
+			peak = std::max(peak, resident);
+		}
+		return entry.grid;
+	}
+
+	void Invalidate(const boost::filesystem::path & cacheFilePath)		//	drop a file that has been rewritten
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		schemas.erase(Key(cacheFilePath));
+		EntryMap::iterator iter = entries.find(Key(cacheFilePath));
+		if (iter == entries.end())
+		{
+			return;
+		}
+		if (iter->second.loading)
+		{
+			iter->second.stale = true;		//	the reader drops it when it finishes
+			return;
+		}
+		owners.erase(iter->second.data);
+		if (iter->second.refs == 0)
+		{
+			iter->second.data->release();
+		}
+		else
+		{
+			orphans[iter->second.data] = iter->second.refs;
+		}
+		resident -= iter->second.bytes;
+		lru.erase(iter->second.lru);
+		entries.erase(iter);
+	}
+
+	void Attach()		//	an item reading through the cache
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		++items;
+	}
+
+	void Detach()		//	the totals are logged once, when the last item goes, as its scene closes
+	{
+		{
+			boost::lock_guard<boost::mutex> lock(mutex);
+			if (items == 0 || --items > 0)
+			{
+				return;
+			}
+		}
+		Report();
+	}
+
+	void Report()		//	totals since the plug-in was loaded
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		CLxUser_LogService log;
+		log.DebugOut(LXi_DBLOG_NORMAL, "ModoPartio frame cache: %u hits, %u misses, %u evictions, %u frames, %.1f MB resident (peak %.1f MB, budget %.1f MB)",
+				hits, misses, evictions, (unsigned)entries.size(), resident / 1048576.0, peak / 1048576.0, budget / 1048576.0);
+	}
+
+private:
+	struct Entry
+	{
+		Partio::ParticlesData * data;
+		size_t bytes;
+		unsigned refs;
+		bool loading;
+		bool stale;		//	invalidated while loading
+		std::list<std::string>::iterator lru;
+		boost::shared_ptr<const ParticleGrid> grid;		//	for culling, built on first use
+		std::vector<std::string> features;		//	as ReadFrame returned them
+
+		Entry() : data(NULL), bytes(0), refs(0), loading(true), stale(false)
+		{}
+	};
+	typedef boost::unordered_map<std::string, Entry> EntryMap;
+	typedef boost::unordered_map<const Partio::ParticlesData *, std::string> OwnerMap;
+	typedef boost::unordered_map<const Partio::ParticlesData *, unsigned> OrphanMap;
+	typedef boost::unordered_map<std::string, FrameSchema> SchemaMap;
+	static const size_t maxSchemas = 4096;
+
+	boost::mutex mutex;
+	boost::condition_variable loaded;
+	EntryMap entries;
+	OwnerMap owners;
+	OrphanMap orphans;
+	SchemaMap schemas;
+	std::list<std::string> lru;		//	most recently used first
+	size_t budget, resident, peak;
+	unsigned hits, misses, evictions, items;
+	bool warned;
+
+	FrameCache() : resident(0), peak(0), hits(0), misses(0), evictions(0), items(0), warned(false)
+	{
+		budget = BudgetBytes(BUDGET_CACHE);
+	}
+
+	static std::string Key(boost::filesystem::path cacheFilePath)
+	{
+		std::string fileType = cacheFilePath.extension().string();
+		boost::algorithm::to_lower(fileType);	//	Partio readers expect lower case
+		cacheFilePath.replace_extension(boost::filesystem::path(fileType));
+		return cacheFilePath.string();
+	}
+
+	void Trim()		//	called with the mutex held
+	{
+		std::list<std::string>::iterator iter = lru.end();
+		while (resident > budget && iter != lru.begin())
+		{
+			--iter;
+			EntryMap::iterator entry = entries.find(*iter);
+			if (entry->second.refs > 0 || entry->second.loading)
+			{
+				continue;
+			}
+			entry->second.data->release();
+			owners.erase(entry->second.data);
+			resident -= entry->second.bytes;
+			++evictions;
+			iter = lru.erase(iter);
+			entries.erase(entry);
+		}
+
+		if (resident > budget && !warned)
+		{
+			warned = true;
+			CLxUser_LogService log;
+			log.DebugOut(LXi_DBLOG_NORMAL, "ModoPartio frame cache: frames in use exceed the %.1f MB budget, raise MODOPARTIO_CACHE_MB", budget / 1048576.0);
+		}
+		else if (resident <= budget)
+		{
+			warned = false;
+		}
+	}
+};
+
+
+static Partio::ParticlesData * AcquireFrame(const std::string & fileName)
+{
+	return FrameCache::Get().Acquire(fileName);
+}
+
+static void ReleaseFrame(const Partio::ParticlesData * frameData)
+{
+	FrameCache::Get().Release(frameData);
+}
+
+
+/*
+ * Features and copy steps resolved by tsrf_SetVertex. A plan depends only on
+ * the vertex description, the attributes of the file and its format, which
+ * seldom change over a frame sequence, so plans are kept for the process and
+ * shared by every evaluation that resolves the same one. Shared plans are never
+ * changed; a generator that has to rebind copies its plan first.
+ */
+struct FeaturePlan
+{
+	std::vector<ParticleFeature> features;		//	sorted by offset
+	std::vector<CopyStep> steps;				//	attr points into features
+	unsigned blockSteps;						//	steps converted a block of particles at a time
+	FrameSchema schema;							//	resolved against
+
+	FeaturePlan() : blockSteps(0)
+	{}
+};
+
+class PlanCache
+{
+public:
+	static PlanCache & Get()
+	{
+		static PlanCache * cache = new PlanCache();
+		return *cache;
+	}
+
+	boost::shared_ptr<const FeaturePlan> Empty() const		//	for generators that haven't resolved a plan
+	{
+		return empty;
+	}
+
+	boost::shared_ptr<const FeaturePlan> Find(const std::string & signature, const FrameSchema & schema) const		//	NULL if not resolved yet
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		PlanMap::const_iterator iter = plans.find(std::make_pair(signature, schema.Hash()));
+		if (iter != plans.end() && iter->second->schema.Same(schema))
+		{
+			return iter->second;
+		}
+		return boost::shared_ptr<const FeaturePlan>();
+	}
+
+	void Insert(const std::string & signature, const boost::shared_ptr<const FeaturePlan> & plan)
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		if (plans.size() > maxPlans)
+		{
+			plans.clear();
+		}
+		plans[std::make_pair(signature, plan->schema.Hash())] = plan;
+	}
+
+private:
+	typedef boost::unordered_map<std::pair<std::string, size_t>, boost::shared_ptr<const FeaturePlan> > PlanMap;
+	static const size_t maxPlans = 1024;
+
+	mutable boost::mutex mutex;
+	PlanMap plans;
+	boost::shared_ptr<const FeaturePlan> empty;
+
+	PlanCache() : empty(new FeaturePlan())
+	{}
+};
+
+
+/*
+ * Reads the frames following the one being evaluated on worker threads, so that
+ * during playback the next frame is usually decoded before Modo asks for it.
+ * Direction and step are taken from the last two frames requested. The
+ * prefetcher holds a frame cache reference on each frame in the read-ahead
+ * window, and hands it over when that frame is evaluated.
+ */
+class FramePrefetcher
+{
+public:
+	FramePrefetcher() : state(new State)
+	{}
+
+	~FramePrefetcher()
+	{
+		boost::lock_guard<boost::mutex> lock(state->mutex);
+		state->Flush();
+	}
+
+	Partio::ParticlesData * Acquire(const boost::filesystem::path & pattern, int frame, int ahead, bool partitioned)	//	returns NULL if frame has not been read ahead yet
+	{
+		Partio::ParticlesData * frameData = NULL;
+		boost::lock_guard<boost::mutex> lock(state->mutex);
+
+		if (pattern != state->pattern || partitioned != state->partitioned)
+		{
+			state->Flush();
+			state->pattern = pattern;
+			state->partitioned = partitioned;
+			state->lastFrame = frame;
+			state->step = 1;
+		}
+
+		int delta = frame - state->lastFrame;
+		if (delta != 0 && abs(delta) <= maxStep)		//	larger jumps are scrubbing, keep the playback step
+		{
+			state->step = delta;
+		}
+		state->lastFrame = frame;
+
+		FrameMap::iterator iter = state->frames.find(frame);
+		if (iter != state->frames.end())
+		{
+			frameData = iter->second.data;		//	an unfinished read is left to the frame cache, which waits for it
+			state->frames.erase(iter);
+		}
+
+		std::set<int> window;
+		for (int i = 1; i <= ahead; ++i)
+		{
+			window.insert(frame + i * state->step);
+		}
+
+		for (iter = state->frames.begin(); iter != state->frames.end(); )
+		{
+			if (window.find(iter->first) == window.end())
+			{
+				FrameCache::Get().Release(iter->second.data);
+				iter = state->frames.erase(iter);		//	a pending read finds its entry gone and releases its own reference
+			}
+			else
+			{
+				++iter;
+			}
+		}
+
+		for (std::set<int>::const_iterator windowIter = window.begin(); windowIter != window.end(); ++windowIter)
+		{
+			if (state->frames.find(*windowIter) == state->frames.end())
+			{
+				Entry & entry = state->frames[*windowIter];
+				entry.ticket = ++state->tickets;
+				WorkerPool::Get().Post(boost::bind(&FramePrefetcher::Read, state, pattern, partitioned, *windowIter, entry.ticket, StageProfile::Shared()));
+			}
+		}
+
+		return frameData;
+	}
+
+private:
+	static const int maxStep = 8;
+
+	struct Entry
+	{
+		unsigned ticket;
+		Partio::ParticlesData * data;
+
+		Entry() : ticket(0), data(NULL)
+		{}
+	};
+	typedef std::map<int, Entry> FrameMap;
+
+	struct State		//	shared with queued reads, which may finish after the item is gone
+	{
+		boost::mutex mutex;
+		boost::filesystem::path pattern;
+		bool partitioned;
+		FrameMap frames;
+		int lastFrame, step;
+		unsigned tickets;
+
+		State() : partitioned(false), lastFrame(0), step(1), tickets(0)
+		{}
+
+		void Flush()
+		{
+			for (FrameMap::iterator iter = frames.begin(); iter != frames.end(); ++iter)
+			{
+				FrameCache::Get().Release(iter->second.data);
+			}
+			frames.clear();
+		}
+	};
+
+	boost::shared_ptr<State> state;
+
+	static void Read(boost::shared_ptr<State> state, boost::filesystem::path pattern, bool partitioned, int frame, unsigned ticket, boost::shared_ptr<StageProfile> profile)
+	{
+		StageProfile::Bind bind(profile);
+		{
+			boost::lock_guard<boost::mutex> lock(state->mutex);		//	skip reads that were cancelled while queued
+			FrameMap::iterator iter = state->frames.find(frame);
+			if (iter == state->frames.end() || iter->second.ticket != ticket)
+			{
+				return;
+			}
+		}
+
+		Partio::ParticlesData * frameData = NULL;
+		boost::filesystem::path cacheFilePath;
+		FrameSchema schema;
+		if (FrameSequenceIndex::Resolve(pattern, frame, cacheFilePath, partitioned) && !(FrameCache::Get().Schema(cacheFilePath, schema) && ChunkReader::Streams(cacheFilePath, schema)))		//	frames that are streamed aren't read ahead
+		{
+			frameData = FrameCache::Get().Acquire(cacheFilePath);
+		}
+
+		boost::lock_guard<boost::mutex> lock(state->mutex);
+		FrameMap::iterator iter = state->frames.find(frame);
+		if (iter != state->frames.end() && iter->second.ticket == ticket)
+		{
+			iter->second.data = frameData;
+		}
+		else
+		{
+			FrameCache::Get().Release(frameData);
+		}
+	}
+};
+
+
+/*
+ * Deflates a buffer in independent 1MB blocks on the worker pool, the way pigz
+ * does. Each block is primed with the 32K of input before it and ends with a
+ * sync flush, so the compressed blocks join into one deflate stream that any
+ * gzip or zlib reader accepts. The checksums of the blocks are combined.
+ * A Stream takes its input a piece at a time and starts on each block as soon
+ * as it is full, so only the blocks still waiting are held uncompressed.
+ */
+class BlockCompressor
+{
+public:
+	enum Wrapper
+	{
+		WRAP_GZIP,
+		WRAP_ZLIB
+	};
+
+private:
+	static const size_t blockSize = 1 << 20;
+	static const size_t windowSize = 1 << 15;
+
+	struct Block
+	{
+		std::vector<char> data;
+		uLong check;
+		size_t length;
+		bool last, ok;
+
+		Block() : check(0), length(0), last(false), ok(false)
+		{}
+	};
+
+public:
+	static bool Compress(const char * input, size_t size, Wrapper wrapper, std::vector<char> & output)
+	{
+		std::vector<Block> blocks((size + blockSize - 1) / blockSize + (size == 0 ? 1 : 0));
+		WorkerPool::Get().ParallelFor((unsigned)blocks.size(), boost::bind(&BlockCompressor::CompressBlock, input, size, wrapper, boost::ref(blocks), _1));
+		return Assemble(blocks, wrapper, size, output);
+	}
+
+	class Stream
+	{
+	public:
+		Stream(Wrapper wrapper) : state(new State(wrapper))
+		{}
+
+		~Stream()
+		{
+			boost::lock_guard<boost::mutex> lock(state->mutex);
+			state->next = state->blocks.size();		//	an abandoned stream leaves its queued blocks alone
+		}
+
+		void Append(const char * input, size_t size)	//	called from one thread only
+		{
+			State & s = *state;
+			s.pending.insert(s.pending.end(), input, input + size);
+			s.size += size;
+			while (s.pending.size() - s.dictionary >= blockSize)
+			{
+				size_t end = s.dictionary + blockSize;
+				std::vector<char> input(s.pending.begin(), s.pending.begin() + end);
+				Queue(input, false);
+				s.pending.erase(s.pending.begin(), s.pending.begin() + (end - windowSize));
+				s.dictionary = windowSize;
+			}
+		}
+
+		bool Finish(std::vector<char> & output)
+		{
+			State & s = *state;
+			Queue(s.pending, true);
+			Drain();
+			return Assemble(s.blocks, s.wrapper, s.size, output);
+		}
+
+	private:
+		struct State
+		{
+			boost::mutex mutex;
+			boost::condition_variable done;
+			Wrapper wrapper;
+			std::deque<Block> blocks;		//	a deque, so blocks being compressed stay put as more are queued
+			std::deque<std::vector<char> > inputs;		//	each with the dictionary it starts with, freed once compressed
+			std::vector<size_t> dictionaries;
+			size_t next, running;
+			std::vector<char> pending;
+			size_t dictionary, size;
+
+			State(Wrapper wrapper) : wrapper(wrapper), next(0), running(0), dictionary(0), size(0)
+			{}
+		};
+
+		boost::shared_ptr<State> state;
+
+		void Queue(std::vector<char> & input, bool last)	//	takes the input
+		{
+			size_t waiting;
+			{
+				boost::lock_guard<boost::mutex> lock(state->mutex);
+				state->blocks.push_back(Block());
+				state->blocks.back().length = input.size() - state->dictionary;
+				state->blocks.back().last = last;
+				state->inputs.push_back(std::vector<char>());
+				state->inputs.back().swap(input);
+				state->dictionaries.push_back(state->dictionary);
+				waiting = state->blocks.size() - state->next;
+			}
+			if (waiting > 2 * (size_t)WorkerPool::Get().Size())
+			{
+				Run(state);		//	keep up with the writer rather than queue the whole frame, the pool may be busy writing other frames
+			}
+			else
+			{
+				WorkerPool::Get().Post(boost::bind(&Stream::Run, state));
+			}
+		}
+
+		void Drain()	//	the caller compresses whatever hasn't started, so this can't wait on a pool that is busy with the writer
+		{
+			while (Run(state))
+			{}
+			boost::unique_lock<boost::mutex> lock(state->mutex);
+			while (state->running > 0)
+			{
+				state->done.wait(lock);
+			}
+		}
+
+		static bool Run(boost::shared_ptr<State> state)
+		{
+			std::vector<char> * input;
+			Block * block;
+			size_t dictionary;
+			{
+				boost::lock_guard<boost::mutex> lock(state->mutex);		//	the deques may be growing
+				if (state->next == state->blocks.size())
+				{
+					return false;
+				}
+				input = &state->inputs[state->next];
+				block = &state->blocks[state->next];
+				dictionary = state->dictionaries[state->next];
+				++state->next;
+				++state->running;
+			}
+			const char * start = input->empty() ? NULL : &(*input)[0];
+			Deflate(start, dictionary, start + dictionary, block->length, block->last, state->wrapper, *block);
+			std::vector<char>().swap(*input);
+
+			boost::lock_guard<boost::mutex> lock(state->mutex);
+			--state->running;
+			state->done.notify_all();
+			return true;
+		}
+	};
+
+private:
+	static void CompressBlock(const char * input, size_t size, Wrapper wrapper, std::vector<Block> & blocks, unsigned index)
+	{
+		Block & block = blocks[index];
+		size_t start = index * blockSize;
+		size_t dictionary = std::min(windowSize, start);
+		block.length = std::min(blockSize, size - start);
+		block.last = (index + 1 == blocks.size());
+		Deflate(input + start - dictionary, dictionary, input + start, block.length, block.last, wrapper, block);
+	}
+
+	static void Deflate(const char * dictionary, size_t dictionarySize, const char * input, size_t length, bool last, Wrapper wrapper, Block & block)
+	{
+		z_stream stream;
+		memset(&stream, 0, sizeof(stream));
+		if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)	//	raw deflate, the wrapper is written once for the whole stream
+		{
+			return;
+		}
+		if (dictionarySize > 0)
+		{
+			deflateSetDictionary(&stream, (const Bytef *)dictionary, (uInt)dictionarySize);
+		}
+
+		block.data.resize(deflateBound(&stream, (uLong)length) + 16);	//	room for the flush marker
+		stream.next_in = (Bytef *)input;
+		stream.avail_in = (uInt)length;
+		stream.next_out = (Bytef *)&block.data[0];
+		stream.avail_out = (uInt)block.data.size();
+
+		int result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+		block.ok = (result == (last ? Z_STREAM_END : Z_OK)) && stream.avail_in == 0;
+		block.data.resize(block.data.size() - stream.avail_out);
+		block.check = (wrapper == WRAP_GZIP) ? crc32(0, (const Bytef *)input, (uInt)length) : adler32(1, (const Bytef *)input, (uInt)length);
+		deflateEnd(&stream);
+	}
+
+	template <class Blocks>
+	static bool Assemble(const Blocks & blocks, Wrapper wrapper, size_t size, std::vector<char> & output)
+	{
+		uLong check = (wrapper == WRAP_GZIP) ? crc32(0, Z_NULL, 0) : adler32(0, Z_NULL, 0);
+		size_t compressed = 0;
+		for (size_t i = 0; i < blocks.size(); ++i)
+		{
+			if (!blocks[i].ok)
+			{
+				return false;
+			}
+			check = (wrapper == WRAP_GZIP) ? crc32_combine(check, blocks[i].check, (z_off_t)blocks[i].length) : adler32_combine(check, blocks[i].check, (z_off_t)blocks[i].length);
+			compressed += blocks[i].data.size();
+		}
+
+		output.clear();
+		output.reserve(compressed + 18);
+		if (wrapper == WRAP_GZIP)
+		{
+			static const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff};	//	deflate, no name or time, unknown OS
+			output.insert(output.end(), header, header + sizeof(header));
+		}
+		else
+		{
+			output.push_back((char)0x78);	//	32K window, default level
+			output.push_back((char)0x9c);
+		}
+		for (size_t i = 0; i < blocks.size(); ++i)
+		{
+			output.insert(output.end(), blocks[i].data.begin(), blocks[i].data.end());
+		}
+		if (wrapper == WRAP_GZIP)
+		{
+			PutLittleEndian(output, check);
+			PutLittleEndian(output, (uLong)(size & 0xffffffff));
+		}
+		else
+		{
+			for (int shift = 24; shift >= 0; shift -= 8)
+			{
+				output.push_back((char)((check >> shift) & 0xff));
+			}
+		}
+		return true;
+	}
+
+	static void PutLittleEndian(std::vector<char> & output, uLong value)
+	{
+		for (int shift = 0; shift < 32; shift += 8)
+		{
+			output.push_back((char)((value >> shift) & 0xff));
+		}
+	}
+};
+
+/*
+ * A named pipe that Partio writes a frame into as if it were a file, so a
+ * frame can be compressed as it is written rather than read back from disk.
+ * The pipe is read on a thread of its own and every piece is handed to the
+ * sink as it arrives. A FIFO in the temp directory on OS X and Linux, a local
+ * pipe server on Windows. The name ends with the frame's extension, which is
+ * how Partio picks its writer.
+ */
+class FramePipe
+{
+public:
+	typedef boost::function<void (const char *, size_t)> Sink;
+
+	FramePipe(const Sink & sink) : sink(sink), bytes(0), finished(false), failed(false)
+#ifdef _WIN32
+		, pipe(INVALID_HANDLE_VALUE)
+#endif
+	{}
+
+	~FramePipe()
+	{
+		Close();
+	}
+
+	bool Open(const std::string & fileType)
+	{
+		std::string unique = boost::filesystem::unique_path("modopartio-%%%%-%%%%-%%%%-%%%%" + fileType).string();
+#ifdef _WIN32
+		name = "\\\\.\\pipe\\" + unique;
+		pipe = CreateNamedPipeA(name.c_str(), PIPE_ACCESS_INBOUND, PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 1, 0, pipeBuffer, 0, NULL);
+		if (pipe == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+#else
+		boost::system::error_code ec;
+		boost::filesystem::path tempDir = boost::filesystem::temp_directory_path(ec);
+		name = (tempDir / unique).string();
+		if (ec || mkfifo(name.c_str(), 0600) != 0)
+		{
+			return false;
+		}
+#endif
+		thread.reset(new boost::thread(boost::bind(&FramePipe::Drain, this)));
+		return true;
+	}
+
+	const std::string & Name() const
+	{
+		return name;
+	}
+
+	size_t Close()		//	once the writer is done, returns what came through or 0 if the sink failed
+	{
+		if (!thread)
+		{
+			return 0;
+		}
+		for (;;)		//	the thread is still waiting for a writer if Partio never opened the pipe
+		{
+			{
+				boost::lock_guard<boost::mutex> lock(mutex);
+				if (finished)
+				{
+					break;
+				}
+			}
+#ifdef _WIN32
+			HANDLE handle = CreateFileA(name.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+			if (handle != INVALID_HANDLE_VALUE)
+			{
+				CloseHandle(handle);
+			}
+#else
+			int fd = open(name.c_str(), O_WRONLY | O_NONBLOCK);		//	fails harmlessly once the reader is gone
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+#endif
+			boost::this_thread::sleep_for(boost::chrono::milliseconds(1));
+		}
+		thread->join();
+		thread.reset();
+#ifdef _WIN32
+		CloseHandle(pipe);
+		pipe = INVALID_HANDLE_VALUE;
+#else
+		unlink(name.c_str());
+#endif
+		return failed ? 0 : bytes;
+	}
+
+private:
+	static const size_t pipeBuffer = 1 << 20;
+
+	Sink sink;
+	std::string name;
+	boost::scoped_ptr<boost::thread> thread;
+	boost::mutex mutex;
+	size_t bytes;
+	bool finished, failed;
+#ifdef _WIN32
+	HANDLE pipe;
+#endif
+
+	void Drain()
+	{
+		std::vector<char> buffer(pipeBuffer);
+#ifdef _WIN32
+		DWORD count = 0;
+		if (ConnectNamedPipe(pipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED)
+		{
+			while (ReadFile(pipe, &buffer[0], (DWORD)buffer.size(), &count, NULL))		//	fails with a broken pipe once the writer closes
+			{
+				Consume(&buffer[0], count);
+			}
+			DisconnectNamedPipe(pipe);
+		}
+#else
+		int fd = open(name.c_str(), O_RDONLY);		//	blocks until Partio opens the other end
+		if (fd >= 0)
+		{
+			ssize_t count;
+			while ((count = read(fd, &buffer[0], buffer.size())) != 0)
+			{
+				if (count > 0)
+				{
+					Consume(&buffer[0], (size_t)count);
+				}
+				else if (errno != EINTR)
+				{
+					failed = true;
+					break;
+				}
+			}
+			close(fd);
+		}
+#endif
+		boost::lock_guard<boost::mutex> lock(mutex);
+		finished = true;
+	}
+
+	void Consume(const char * data, size_t size)
+	{
+		if (failed)
+		{
+			return;		//	keep reading, a writer left blocked or without a reader would never return
+		}
+		try
+		{
+			sink(data, size);
+			bytes += size;
+		}
+		catch (...)
+		{
+			failed = true;
+		}
+	}
+};
+
+
+/*
+ * Writes baked frames on worker threads so the bake can move on to the next
+ * frame while the last one is compressed and written. Submit blocks while the
+ * frames waiting to be written would exceed MODOPARTIO_WRITE_QUEUE_MB (default
+ * 1024), and Finish waits for everything submitted and returns the files that
+ * could not be written. In parallel mode .prt files and the gzipped formats
+ * are compressed with BlockCompressor instead of Partio's single zlib stream,
+ * the gzipped ones as Partio writes them into a FramePipe.
+ * The native .mpc format is written here too, as Partio doesn't know it.
+ */
+class FrameWriter
+{
+public:
+	FrameWriter() : state(new State)
+	{
+		state->limit = BudgetBytes(BUDGET_WRITE_QUEUE);
+	}
+
+	typedef boost::shared_ptr<const Partio::ParticlesData> Frame;
+
+	struct Link		//	where an .mpc frame sits in its sequence
+	{
+		unsigned long long stamp;			//	from NewFrameStamp, 0 for a frame outside a sequence
+		Frame reference;					//	written as a delta from this frame when set
+		std::string referenceName;
+		unsigned long long referenceStamp;
+
+		Link() : stamp(0), referenceStamp(0)
+		{}
+	};
+
+	void Submit(const Frame & frameData, const std::string & writeName, bool parallel, const std::vector<std::string> & featureNames, const std::vector<float> & tolerances, const Link & link = Link())	//	featureNames are the Modo names of its attributes and tolerances how far .mpc may quantize each
+	{
+		size_t bytes = ParticleBytes(frameData.get());
+		{
+			boost::unique_lock<boost::mutex> lock(state->mutex);
+			while (state->pending > 0 && state->queued + bytes > state->limit)
+			{
+				state->done.wait(lock);
+			}
+			state->queued += bytes;
+			++state->pending;
+		}
+		WorkerPool::Get().Post(boost::bind(&FrameWriter::Write, state, frameData, writeName, parallel, featureNames, tolerances, link, StageProfile::Shared()));
+	}
+
+	unsigned Finish(std::vector<std::string> & failed)		//	returns the number of frames written
+	{
+		boost::unique_lock<boost::mutex> lock(state->mutex);
+		while (state->pending > 0)
+		{
+			state->done.wait(lock);
+		}
+		unsigned written = state->written;
+		failed.swap(state->failed);
+		state->written = 0;
+		state->failed.clear();
+		return written;
+	}
+
+private:
+	struct State		//	shared with queued writes, which may finish after the item is gone
+	{
+		boost::mutex mutex;
+		boost::condition_variable done;
+		size_t limit, queued;
+		unsigned pending, written;
+		std::vector<std::string> failed;
+
+		State() : limit(0), queued(0), pending(0), written(0)
+		{}
+	};
+
+	boost::shared_ptr<State> state;
+
+	static void Write(boost::shared_ptr<State> state, Frame frameData, std::string writeName, bool parallel, std::vector<std::string> featureNames, std::vector<float> tolerances, Link link, boost::shared_ptr<StageProfile> profile)
+	{
+		StageProfile::Bind bind(profile);
+		size_t bytes = ParticleBytes(frameData.get());		//	as Submit queued it
+		bool ok = false;
+		try
+		{
+			StageTimer timer(STAGE_WRITE);
+
+			std::string fileType = boost::filesystem::path(writeName).extension().string();
+			boost::algorithm::to_lower(fileType);
+
+			if (fileType == ".mpc")
+			{
+				ok = WriteMPC(writeName, *frameData, featureNames, tolerances, link);
+			}
+			else if (parallel && fileType == ".prt")
+			{
+				ok = WritePRT(writeName, *frameData);
+			}
+			else if (parallel && (fileType == ".bgeo" || fileType == ".geo" || fileType == ".pdb"))
+			{
+				ok = WriteGzipped(writeName, fileType, *frameData);
+			}
+			else
+			{
+				ok = WritePartio(writeName, *frameData);
+			}
+
+			boost::system::error_code ec;
+			boost::uintmax_t fileSize = ok ? boost::filesystem::file_size(writeName, ec) : 0;
+			timer.Count(frameData->numParticles(), ec ? 0 : fileSize);
+		}
+		catch (...)
+		{
+			ok = false;
+		}
+		frameData.reset();		//	the next frame may still hold it as its reference
+		link.reference.reset();
+		FrameCache::Get().Invalidate(writeName);		//	items reading this sequence must not see the previous bake
+		if (ok)
+		{
+			FrameSequenceIndex::Written(writeName);
+		}
+
+		boost::lock_guard<boost::mutex> lock(state->mutex);
+		state->queued -= bytes;
+		--state->pending;
+		if (ok)
+		{
+			++state->written;
+		}
+		else
+		{
+			state->failed.push_back(writeName);
+		}
+		state->done.notify_all();
+	}
+
+	static bool WritePartio(const std::string & writeName, const Partio::ParticlesData & frameData)
+	{
+		boost::system::error_code ec;
+		boost::filesystem::remove(writeName, ec);		//	Partio::write reports nothing, so tell success from a fresh file
+
+		Partio::write(writeName.c_str(), frameData, true);
+		return boost::filesystem::exists(writeName, ec) && boost::filesystem::file_size(writeName, ec) > 0 && !ec;
+	}
+
+	static bool WriteGzipped(const std::string & writeName, const std::string & fileType, const Partio::ParticlesData & frameData)	//	Partio's readers accept any gzip stream
+	{
+		BlockCompressor::Stream stream(BlockCompressor::WRAP_GZIP);
+		FramePipe pipe(boost::bind(&BlockCompressor::Stream::Append, &stream, _1, _2));
+		if (!pipe.Open(fileType))
+		{
+			return WritePartio(writeName, frameData);		//	Partio's own single zlib stream
+		}
+		Partio::write(pipe.Name().c_str(), frameData, false);
+
+		std::vector<char> compressed;
+		return pipe.Close() > 0 && stream.Finish(compressed) && WriteFile(writeName, std::vector<char>(), compressed);
+	}
+
+	static bool WritePRT(const std::string & writeName, const Partio::ParticlesData & frameData)	//	Krakatoa PRT version 1, with the particle table deflated in parallel
+	{
+		static const unsigned char magic[8] = {0xc0, 'P', 'R', 'T', '\r', '\n', 0x1a, '\n'};
+		static const char signature[32] = "Extensible Particle Format";
+
+		std::vector<Partio::ParticleAttribute> attrs(frameData.numAttributes());
+		std::vector<int> offsets(attrs.size());
+		int particleSize = 0;
+		for (size_t i = 0; i < attrs.size(); ++i)
+		{
+			frameData.attributeInfo((int)i, attrs[i]);
+			if (attrs[i].type == Partio::INDEXEDSTR || attrs[i].name.size() >= 32)
+			{
+				return WritePartio(writeName, frameData);		//	no PRT channel for these, let Partio decide
+			}
+			offsets[i] = particleSize;
+			particleSize += attrs[i].count * 4;
+		}
+
+		std::vector<char> header(magic, magic + sizeof(magic));
+		PutInt(header, 56, 4);		//	header length
+		header.insert(header.end(), signature, signature + sizeof(signature));
+		PutInt(header, 1, 4);		//	version
+		PutInt(header, frameData.numParticles(), 8);
+		PutInt(header, 4, 4);		//	reserved
+		PutInt(header, (long long)attrs.size(), 4);
+		PutInt(header, 44, 4);		//	channel definition length
+		for (size_t i = 0; i < attrs.size(); ++i)
+		{
+			char name[32] = {0};
+			std::string channel = ChannelName(attrs[i].name);
+			memcpy(name, channel.c_str(), channel.size());
+			header.insert(header.end(), name, name + sizeof(name));
+			PutInt(header, attrs[i].type == Partio::INT ? 1 : 4, 4);	//	int32 or float32
+			PutInt(header, attrs[i].count, 4);
+			PutInt(header, offsets[i], 4);
+		}
+
+		size_t numParticles = frameData.numParticles();
+		std::vector<char> table(numParticles * particleSize);
+		for (size_t i = 0; i < attrs.size(); ++i)
+		{
+			size_t bytes = attrs[i].count * 4;
+			for (size_t p = 0; p < numParticles; ++p)
+			{
+				memcpy(&table[p * particleSize + offsets[i]], frameData.data<float>(attrs[i], (Partio::ParticleIndex)p), bytes);
+			}
+		}
+
+		std::vector<char> compressed;
+		return BlockCompressor::Compress(table.empty() ? NULL : &table[0], table.size(), BlockCompressor::WRAP_ZLIB, compressed) && WriteFile(writeName, header, compressed);
+	}
+
+	static std::string ChannelName(const std::string & attrName)		//	Krakatoa's names for Partio's own terms, the way Partio's writer renames them
+	{
+		if (attrName == "position")
+		{
+			return "Position";
+		}
+		if (attrName == "velocity")
+		{
+			return "Velocity";
+		}
+		if (attrName == LXsTBLX_PARTICLE_ID)
+		{
+			return "ID";
+		}
+		return attrName;
+	}
+
+	static bool WriteMPC(const std::string & writeName, const Partio::ParticlesData & frameData, const std::vector<std::string> & featureNames, const std::vector<float> & tolerances, const Link & link)
+	{
+		std::string partialName = writeName.substr(0, writeName.size() - 4) + ".partial.mpc";		//	renamed over the old frame once it is complete
+		static const char padding[mpcAlignment] = {0};
+		size_t numParticles = frameData.numParticles();
+
+		std::vector<int> match;
+		Partio::ParticleAttribute idAttr;
+		bool byIndex = false;
+		const Partio::ParticlesData * reference = link.reference.get();
+		bool delta = reference && link.referenceStamp != 0 && MatchReference(frameData, *reference, match, byIndex);
+		bool haveIds = FindAttribute(&frameData, idNames, 1, idAttr);
+		bool encoded = delta || link.stamp != 0 || std::find_if(tolerances.begin(), tolerances.end(), boost::bind(std::greater<float>(), _1, 0.0f)) != tolerances.end();
+
+		std::ofstream out(partialName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		std::vector<char> header(mpcHeaderSize, 0), index;
+		out.write(&header[0], header.size());
+		if (encoded)
+		{
+			std::string name = delta ? boost::filesystem::path(link.referenceName).filename().string() : std::string();
+			PutInt(index, name.size(), 2);
+			index.insert(index.end(), name.begin(), name.end());
+		}
+
+		size_t position = mpcHeaderSize;
+		unsigned numColumns = 0;
+		for (int i = 0; i < frameData.numAttributes(); ++i)
+		{
+			Partio::ParticleAttribute attr;
+			frameData.attributeInfo(i, attr);
+			if (attr.type == Partio::INDEXEDSTR)
+			{
+				continue;
+			}
+
+			size_t particleBytes = attr.count * 4;
+			float tolerance = (i < (int)tolerances.size() && attr.type != Partio::INT) ? tolerances[i] : 0.0f;
+			MPCEncoding encoding = MPC_RAW;
+			std::vector<char> packed;
+			Partio::ParticleAttribute refAttr;
+			bool referenced = delta && !(haveIds && !byIndex && attr.name == idAttr.name) &&		//	ids matched on have to be read before anything else
+				reference->attributeInfo(attr.name.c_str(), refAttr) && refAttr.type == attr.type && refAttr.count == attr.count;
+			if (referenced && Unchanged(frameData, attr, *reference, refAttr, match))
+			{
+				encoding = MPC_SAME;		//	a quantized reference column is still within the tolerance
+			}
+			else if (tolerance > 0.0f)
+			{
+				encoding = Quantize(frameData, attr, tolerance, packed);		//	never a delta, the reference may only have been stored to within the tolerance
+			}
+			else if (referenced)
+			{
+				encoding = EncodeDelta(frameData, attr, *reference, refAttr, match, packed);
+			}
+
+			if (encoding != MPC_RAW)
+			{
+				out.write(packed.empty() ? padding : &packed[0], packed.size());
+				PutColumn(index, attr, (i < (int)featureNames.size()) ? featureNames[i] : std::string(), packed.empty() ? 0 : position, packed.size());
+				PutInt(index, encoding, 4);
+				position += packed.size();
+				++numColumns;
+				continue;
+			}
+
+			size_t offset = (position + mpcAlignment - 1) / mpcAlignment * mpcAlignment;
+			out.write(padding, offset - position);
+			if (numParticles > 0)
+			{
+				const char * column = (const char *)frameData.data<float>(attr, 0);
+				if ((const char *)frameData.data<float>(attr, numParticles - 1) == column + (numParticles - 1) * particleBytes)
+				{
+					out.write(column, numParticles * particleBytes);
+				}
+				else
+				{
+					for (size_t p = 0; p < numParticles; ++p)
+					{
+						out.write((const char *)frameData.data<float>(attr, p), particleBytes);
+					}
+				}
+			}
+			position = offset + numParticles * particleBytes;
+
+			PutColumn(index, attr, (i < (int)featureNames.size()) ? featureNames[i] : std::string(), offset, numParticles * particleBytes);
+			if (encoded)
+			{
+				PutInt(index, MPC_RAW, 4);
+			}
+			++numColumns;
+		}
+		if (!index.empty())
+		{
+			out.write(&index[0], index.size());
+		}
+
+		header.clear();
+		header.insert(header.end(), mpcMagic, mpcMagic + sizeof(mpcMagic));
+		PutInt(header, encoded ? mpcEncodedVersion : mpcVersion, 4);
+		PutInt(header, numParticles, 8);
+		PutInt(header, numColumns, 4);
+		PutInt(header, position, 8);
+		PutInt(header, index.size(), 8);
+		if (encoded)
+		{
+			PutInt(header, (delta ? mpcDelta : 0) | ((delta && byIndex) ? mpcMatchIndex : 0), 4);
+			PutInt(header, link.stamp, 8);
+			PutInt(header, delta ? link.referenceStamp : 0, 8);
+		}
+		out.seekp(0);
+		out.write(&header[0], header.size());
+		out.close();
+
+		boost::system::error_code ec;
+		if (out.fail())
+		{
+			boost::filesystem::remove(partialName, ec);
+			return false;
+		}
+		boost::filesystem::rename(partialName, writeName, ec);
+		for (int attempt = 0; ec && attempt < 20; ++attempt)		//	a reader maps the old frame while it reads it, and Windows won't replace a mapped file
+		{
+			boost::this_thread::sleep_for(boost::chrono::milliseconds(50));
+			boost::filesystem::rename(partialName, writeName, ec);
+		}
+		if (ec)
+		{
+			boost::filesystem::remove(partialName, ec);
+			return false;
+		}
+		return true;
+	}
+
+	static bool MatchReference(const Partio::ParticlesData & frameData, const Partio::ParticlesData & reference, std::vector<int> & match, bool & byIndex)	//	false if the frames can't be matched
+	{
+		int numParticles = frameData.numParticles();
+		Partio::ParticleAttribute idAttr, refIdAttr;
+		bool ids = FindAttribute(&frameData, idNames, 1, idAttr) && reference.attributeInfo(idAttr.name.c_str(), refIdAttr) && refIdAttr.type == idAttr.type && refIdAttr.count == 1;
+
+		std::vector<unsigned> frameIds(ids ? numParticles : 0);
+		byIndex = (numParticles == reference.numParticles());
+		for (int p = 0; p < (int)frameIds.size(); ++p)
+		{
+			frameIds[p] = *(const unsigned *)frameData.data<float>(idAttr, p);
+			byIndex = byIndex && frameIds[p] == *(const unsigned *)reference.data<float>(refIdAttr, p);
+		}
+
+		if (byIndex)
+		{
+			match.resize(numParticles);
+			for (int p = 0; p < numParticles; ++p)
+			{
+				match[p] = p;
+			}
+			return true;
+		}
+		if (!ids)
+		{
+			return false;
+		}
+		MatchIds(frameIds.empty() ? NULL : &frameIds[0], numParticles, &reference, refIdAttr, match);
+		return true;
+	}
+
+	static MPCEncoding EncodeDelta(const Partio::ParticlesData & frameData, const Partio::ParticleAttribute & attr, const Partio::ParticlesData & reference, const Partio::ParticleAttribute & refAttr, const std::vector<int> & match, std::vector<char> & packed)
+	{
+		size_t numParticles = frameData.numParticles(), words = numParticles * attr.count;
+		std::vector<unsigned> differences(words);
+		for (size_t p = 0; p < numParticles; ++p)
+		{
+			const unsigned * values = (const unsigned *)frameData.data<float>(attr, (Partio::ParticleIndex)p);
+			const unsigned * previous = (match[p] >= 0) ? (const unsigned *)reference.data<float>(refAttr, match[p]) : NULL;
+			for (int k = 0; k < attr.count; ++k)
+			{
+				differences[p * attr.count + k] = previous ? values[k] - previous[k] : values[k];
+			}
+		}
+
+		std::vector<char> planes(words * 4);		//	the high bytes of small differences deflate to almost nothing
+		for (size_t w = 0; w < words; ++w)
+		{
+			for (size_t b = 0; b < 4; ++b)
+			{
+				planes[b * words + w] = (char)(differences[w] >> (b * 8));
+			}
+		}
+		if (!BlockCompressor::Compress(&planes[0], planes.size(), BlockCompressor::WRAP_ZLIB, packed) || packed.size() >= planes.size())
+		{
+			return MPC_RAW;
+		}
+		return MPC_DELTA;
+	}
+
+	static bool Unchanged(const Partio::ParticlesData & frameData, const Partio::ParticleAttribute & attr, const Partio::ParticlesData & reference, const Partio::ParticleAttribute & refAttr, const std::vector<int> & match)		//	every particle matched, with the same bits
+	{
+		for (size_t p = 0; p < match.size(); ++p)
+		{
+			if (match[p] < 0 || memcmp(frameData.data<float>(attr, (Partio::ParticleIndex)p), reference.data<float>(refAttr, match[p]), attr.count * 4) != 0)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/*
+	 * Tries the quantized encodings from smallest up and keeps the first whose
+	 * decoded values are all within tolerance, by decoding it as the reader
+	 * will. Fixed point spans each component's range in the frame, so positions
+	 * are relative to the frame's bounding box.
+	 */
+	static MPCEncoding Quantize(const Partio::ParticlesData & frameData, const Partio::ParticleAttribute & attr, float tolerance, std::vector<char> & packed)
+	{
+		size_t numParticles = frameData.numParticles(), words = numParticles * attr.count;
+		if (words == 0)
+		{
+			return MPC_RAW;
+		}
+		std::vector<float> values(words), decodedValues(words);
+		for (size_t p = 0; p < numParticles; ++p)
+		{
+			memcpy(&values[p * attr.count], frameData.data<float>(attr, (Partio::ParticleIndex)p), attr.count * 4);
+		}
+
+		std::vector<float> minimum(attr.count, std::numeric_limits<float>::max()), maximum(attr.count, -std::numeric_limits<float>::max());
+		float largest = 0.0f;
+		for (size_t p = 0, w = 0; p < numParticles; ++p)
+		{
+			for (int k = 0; k < attr.count; ++k, ++w)
+			{
+				if (!(fabs(values[w]) <= std::numeric_limits<float>::max()))
+				{
+					return MPC_RAW;		//	infinities and NaNs are kept as they are
+				}
+				minimum[k] = std::min(minimum[k], values[w]);
+				maximum[k] = std::max(maximum[k], values[w]);
+				largest = std::max(largest, fabsf(values[w]));
+			}
+		}
+
+		static const MPCEncoding candidates[] = {MPC_FIXED8, MPC_FIXED16, MPC_HALF};
+		for (int c = 0; c < 3; ++c)
+		{
+			MPCEncoding encoding = candidates[c];
+			int exponent;
+			frexp(largest, &exponent);
+			float worst = (encoding == MPC_HALF) ? ((largest > 65504.0f) ? largest : ldexpf(1.0f, std::max(exponent, -13) - 12)) : 0.0f;		//	half a step at the largest value, which some values are likely near
+			for (int k = 0; k < attr.count && encoding != MPC_HALF; ++k)
+			{
+				worst = std::max(worst, (maximum[k] - minimum[k]) / ((encoding == MPC_FIXED8) ? 510 : 131070));
+			}
+			if (worst > tolerance)
+			{
+				continue;		//	not worth encoding to find out
+			}
+
+			packed.assign(QuantizedBytes(encoding, attr.count, numParticles), 0);
+			if (encoding == MPC_HALF)
+			{
+				for (size_t w = 0; w < words; ++w)
+				{
+					unsigned short half = FloatToHalf(values[w]);
+					memcpy(&packed[w * 2], &half, 2);
+				}
+			}
+			else
+			{
+				unsigned levels = (encoding == MPC_FIXED8) ? 0xff : 0xffff;
+				std::vector<float> step(attr.count);
+				for (int k = 0; k < attr.count; ++k)
+				{
+					step[k] = (maximum[k] - minimum[k]) / levels;
+				}
+				memcpy(&packed[0], &minimum[0], attr.count * 4);
+				memcpy(&packed[attr.count * 4], &step[0], attr.count * 4);
+				char * codes = &packed[attr.count * 8];
+				for (size_t p = 0, w = 0; p < numParticles; ++p)
+				{
+					for (int k = 0; k < attr.count; ++k, ++w)
+					{
+						float scaled = (step[k] > 0.0f) ? (values[w] - minimum[k]) / step[k] : 0.0f;
+						unsigned code = (unsigned)std::max(0.0f, std::min((float)levels, floorf(scaled + 0.5f)));
+						if (encoding == MPC_FIXED8)
+						{
+							codes[w] = (char)code;
+						}
+						else
+						{
+							unsigned short code16 = (unsigned short)code;
+							memcpy(codes + w * 2, &code16, 2);
+						}
+					}
+				}
+			}
+
+			Dequantize(&packed[0], encoding, attr.count, numParticles, &decodedValues[0]);
+			size_t w = 0;
+			while (w < words && fabs(decodedValues[w] - values[w]) <= tolerance)
+			{
+				++w;
+			}
+			if (w == words)
+			{
+				return encoding;
+			}
+		}
+		packed.clear();
+		return MPC_RAW;
+	}
+
+	static void PutColumn(std::vector<char> & index, const Partio::ParticleAttribute & attr, const std::string & feature, size_t offset, size_t bytes)
+	{
+		PutInt(index, attr.name.size(), 2);
+		index.insert(index.end(), attr.name.begin(), attr.name.end());
+		PutInt(index, feature.size(), 2);
+		index.insert(index.end(), feature.begin(), feature.end());
+		PutInt(index, attr.type, 4);
+		PutInt(index, attr.count, 4);
+		PutInt(index, offset, 8);
+		PutInt(index, bytes, 8);
+	}
+
+	static void PutInt(std::vector<char> & output, long long value, int bytes)		//	PRT and MPC are little endian
+	{
+		for (int i = 0; i < bytes; ++i)
+		{
+			output.push_back((char)((value >> (i * 8)) & 0xff));
+		}
+	}
+
+	static bool WriteFile(const std::string & writeName, const std::vector<char> & header, const std::vector<char> & body)
+	{
+		std::ofstream out(writeName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!header.empty())
+		{
+			out.write(&header[0], header.size());
+		}
+		if (!body.empty())
+		{
+			out.write(&body[0], body.size());
+		}
+		out.close();
+		return !out.fail();
+	}
+};
+
+#define SRVNAME_PACKAGE		"ModoPartio"
+#define SPNNAME_INSTANCE	"ModoPartio.inst"
+#define SPNNAME_GENERATOR	"ModoPartio.gen"
+
+
+/*
+ * Class Declarations
+ *
+ * These have to come before their implementations because they reference each
+ * other. Descriptions are attached to the implementations.
+ */
+class CModoPartioPackage;
+
+class CModoPartioGenerator :
+                public CLxImpl_TableauSurface
+//                public CLxDynamicAttributes
+{
+    public:
+                static void
+        initialize ()
+        {
+                CLxGenericPolymorph	*srv;
+
+                srv = new CLxPolymorph<CModoPartioGenerator>;
+                srv->AddInterface (new CLxIfc_TableauSurface<CModoPartioGenerator>);
+ //               srv->AddInterface (new CLxIfc_Attributes    <CModoPartioGenerator>);
+                lx::AddSpawner (SPNNAME_GENERATOR, srv);
+        }
+
+
+        CLxUser_Matrix		 w_matrix;
+		int		frame;
+		int		prefetchFrames;
+		bool	partitioned;	//	each frame is several partition files, merged on reading
+		int		subFrameMode;
+		float	subFrame;		//	fraction of the way to the next cached frame
+		float	shutterOffset;	//	seconds to move particles along their velocities
+		float	previewDensity;	//	fraction of particles drawn in the GL preview
+		float	density;		//	fraction of particles this sample emits
+
+		FramePrefetcher * prefetcher;
+
+		std::string		s_path, fileType, cacheFileName;
+		CLxUser_Item pins_item;
+        CLxUser_TriangleSoup	 tri_soup;
+        CLxPseudoRandom		 rand_seq;
+        int			 vrt_size;
+        float			*vrt_vec;
+
+		boost::shared_ptr<const FeaturePlan> plan;		//	shared with other evaluations
+		static const unsigned convertRangeSize = 2048;		//	particles converted by one task of tsrf_Sample
+
+		Partio::ParticlesData * data;		//	NULL until tsrf_Sample needs the particles, unless already read ahead
+		Partio::ParticlesData * nextData;	//	frame after data when interpolating
+		std::vector<int> match;			//	particle of nextData each particle of data blends with, or -1, kept for the other buckets
+		std::vector<bool> matched;		//	particles of nextData that blend with one of data
+		float matchTime;				//	fitted time from data to nextData in the units of the velocities
+		std::vector<float> cellBounds[2];	//	bounds of where the particles of each grid cell of either frame are emitted, 6 floats a cell
+		bool matchReady;
+		FrameSchema schema;
+		std::vector<std::string> particleAttributeNames;
+
+		const FormatTraits * traits;
+		boost::shared_ptr<StageProfile> profile;		//	the item's
+
+
+        CModoPartioGenerator ();
+        ~CModoPartioGenerator ();
+
+        unsigned int	 tsrf_FeatureCount (LXtID4 type) LXx_OVERRIDE;
+        LxResult	 tsrf_FeatureByIndex (LXtID4 type, unsigned int index, const char **name) LXx_OVERRIDE;
+        LxResult	 tsrf_SetVertex (ILxUnknownID vdesc) LXx_OVERRIDE;
+        LxResult	 tsrf_Sample (const LXtTableauBox bbox, float scale, ILxUnknownID trisoup) LXx_OVERRIDE;
+
+	private:
+		void		ReadModoPartio();
+		void		CompilePlan(FeaturePlan & target) const;
+		LxResult	SampleInterpolated(const LXtTableauBox bbox, ILxUnknownID trisoup);
+		LxResult	SampleSubset(const ParticleGrid * grid, const LXtTableauBox bbox, ILxUnknownID trisoup);
+		bool		Keeps(const Partio::ParticlesData * frameData, const Partio::ParticleAttribute * idAttr, int particle) const;
+		LxResult	SampleStream(ChunkReader * reader, const LXtTableauBox bbox, ILxUnknownID trisoup);
+		void		ConvertRange(unsigned first, unsigned count, float * vertices, const CopyStep * shiftStep, const Partio::ParticleAttribute * velocityAttr, unsigned range);
+		const CopyStep * ShiftStep(const Partio::ParticlesData * frameData, Partio::ParticleAttribute & velocityAttr);
+		void		FillVertex(const Partio::ParticlesData * frameData, const std::vector<Partio::ParticleAttribute> & stepAttrs, int particle, float * vertex);
+		static void	NoteThinning(const std::string & item, float density);
+		void		BlendedPosition(const Partio::ParticlesData * const frames[2], const Partio::ParticleAttribute positionAttr[2], const Partio::ParticleAttribute * velocityAttr, int frame, int particle, float * position) const;
+};
+
+class CModoPartioInstance :
+        public CLxImpl_PackageInstance,
+        public CLxImpl_ParticleItem,
+		public CLxImpl_TableauSource,
+		public CLxImpl_PointCacheItem,
+		public CLxImpl_SceneItemListener,
+		public CLxImpl_ChannelUI
+{
+	friend class CLxTriSoup;
+
+    public:
+                static void
+        initialize ()
+        {
+                CLxGenericPolymorph	*srv;
+
+                srv = new CLxPolymorph<CModoPartioInstance>;
+                srv->AddInterface (new CLxIfc_PackageInstance<CModoPartioInstance>);
+                srv->AddInterface (new CLxIfc_ParticleItem   <CModoPartioInstance>);
+                srv->AddInterface (new CLxIfc_TableauSource  <CModoPartioInstance>);
+				srv->AddInterface(new CLxIfc_PointCacheItem <CModoPartioInstance>);
+				srv->AddInterface(new CLxIfc_SceneItemListener <CModoPartioInstance>);
+				srv->AddInterface(new CLxIfc_ChannelUI <CModoPartioInstance>);
+                lx::AddSpawner (SPNNAME_INSTANCE, srv);
+        }
+
+        CLxSpawner<CModoPartioGenerator>	 gen_spawn;
+        CLxUser_Item			 m_item;
+		ILxUnknownID	 self_obj;
+
+		Partio::ParticlesDataMutable * pData;
+		std::string fileName;
+		std::string fileType;
+		Partio::ParticleIndex particleIndex;
+		unsigned int padding;
+		std::string paddingString;
+		bool parallelCompress;
+		int keyframeInterval;		//	.mpc frames from one full frame to the next, the rest are deltas
+		int framesSinceKey;
+		FrameWriter::Link lastFrame;		//	the keyframe delta frames are written against, with its stamp
+
+		FramePrefetcher prefetcher;
+		FrameWriter writer;
+		boost::shared_ptr<StageProfile> profile;
+
+        CModoPartioInstance ()
+                : gen_spawn (SPNNAME_GENERATOR), pData(NULL), paddingString("0000"), parallelCompress(true), keyframeInterval(0), framesSinceKey(0), profile(new StageProfile("ModoPartio")), vertexSize(0), exportCount(0)
+        {}
+
+        /*
+         * PackageInstance interface.
+         */
+        LxResult	 pins_Initialize (ILxUnknownID item, ILxUnknownID super) LXx_OVERRIDE;
+        void		 pins_Cleanup (void) LXx_OVERRIDE;
+
+        /*
+         * ParticleItem interface.
+         */
+        LxResult	 prti_Prepare  (ILxUnknownID eval, unsigned *index) LXx_OVERRIDE;
+        LxResult	 prti_Evaluate (ILxUnknownID attr, unsigned index, void **ppvObj) LXx_OVERRIDE;
+
+        /*
+         * TableauSource interface.
+         */
+        LxResult	 tsrc_PreviewUpdate (int chanIndex, int *update) LXx_OVERRIDE;
+
+		/*
+         * PointCacheItem interface.
+         */
+		std::vector<ParticleFeature> particleFeatures;		//	kept between frames, like the staging chunks
+		std::vector<ExportStep> exportSteps;
+
+		static const unsigned exportChunkSize = 65536;	//	vertices per staging chunk
+		unsigned vertexSize;
+		std::vector< std::vector<float> > exportChunks;	//	every vertex of the frame, staged until sampling is done; reused by the next frame
+		std::vector<float> exportConverted;
+		unsigned exportCount;
+
+		LxResult pcache_Prepare(ILxUnknownID eval, unsigned *index) LXx_OVERRIDE;
+		LxResult pcache_Initialize(ILxUnknownID vdesc, ILxUnknownID attr, unsigned index, double time, double sample) LXx_OVERRIDE;
+		LxResult pcache_SaveFrame(ILxUnknownID pobj, double time) LXx_OVERRIDE;
+		LxResult pcache_Cleanup() LXx_OVERRIDE;
+
+        /*
+         * SceneItemListener interface.
+         */
+		void sil_LinkAdd(const char *graph, ILxUnknownID itemFrom, ILxUnknownID itemTo) LXx_OVERRIDE;
+
+
+
+	private:
+		void AddVertex(const float *vertex,	unsigned int *index);
+		void FlushVertices();
+		bool StagedWholeNumbers(unsigned offset) const;
+};
+
+class CModoPartioPackage :
+	public CLxImpl_Package,
+	public CLxImpl_ChannelUI
+				
+{
+    public:
+        static LXtTagInfoDesc		 descInfo[];
+
+                static void
+        initialize ()
+        {
+                CLxGenericPolymorph	*srv;
+
+                srv = new CLxPolymorph<CModoPartioPackage>;
+                srv->AddInterface (new CLxIfc_Package   <CModoPartioPackage>);
+                srv->AddInterface (new CLxIfc_StaticDesc<CModoPartioPackage>);
+				srv->AddInterface(new CLxIfc_ChannelUI<CModoPartioPackage>);
+                lx::AddServer (SRVNAME_PACKAGE, srv);
+        }
+
+        CLxSpawner<CModoPartioInstance>	 inst_spawn;
+
+        CModoPartioPackage ()
+                : inst_spawn (SPNNAME_INSTANCE)
+        {}
+
+
+        LxResult		pkg_SetupChannels (ILxUnknownID addChan) LXx_OVERRIDE;
+        LxResult		pkg_TestInterface (const LXtGUID *guid) LXx_OVERRIDE;
+        LxResult		pkg_Attach (void **ppvObj) LXx_OVERRIDE;
+
+		LxResult		cui_UIHints(const char *channelName, ILxUnknownID hints) LXx_OVERRIDE; 
+		LxResult		cui_Enabled(const char *channelName, ILxUnknownID msg, ILxUnknownID item, ILxUnknownID chanRead) LXx_OVERRIDE;
+};
+
+
+
+/*
+ * ----------------------------------------------------------------
+ * Package Class
+ *
+ * Packages implement item types, or simple item extensions. They are
+ * like the metatype object for the item type.
+ *
+ * The ModoPartio package is a locator.
+ */
+LXtTagInfoDesc	 CModoPartioPackage::descInfo[] = {
+        { LXsPKG_SUPERTYPE,	LXsITYPE_LOCATOR	},
+        { 0 }
+};
+
+
+/*
+ * The package has a set of standard channels with default values. These
+ * are setup at the start using the AddChannel interface.
+ */
+
+
+        LxResult
+CModoPartioPackage::pkg_SetupChannels (
+        ILxUnknownID		 addChan)
+{
+        CLxUser_AddChannel	 ac (addChan);
+
+
+		// Create a new LXtObjectID. This will be used for storing the default value.
+		LXtObjectID	obj;
+
+		// CLxUser_Value SetString() method will be used to set the value of the string channel.
+		CLxUser_Value	val;
+
+		// Add the new channel. Define it as a string channel.
+		ac.NewChannel("cacheFileName", LXsTYPE_STRING);
+
+		// Next, set the storage type as a string. This is the type of value
+		// that will be stored in the action layer.
+		ac.SetStorage(LXsTYPE_STRING);
+
+		// Finally we set the default object to be the LXtObjectID (obj).
+		// This returns an object which we can use to store the value.
+		ac.SetDefaultObj(&obj);
+
+		// Localize the LXtObjectID.
+		val.take(obj);
+
+		// Finally, the SetString method is called to set the default
+
+		val.SetString("*.*");
+
+		ac.NewChannel("padding", LXsTYPE_INTEGER);
+		ac.SetDefault(0.0, 0);
+
+		ac.NewChannel("frame", LXsTYPE_INTEGER);
+
+		ac.NewChannel("frameTime", LXsTYPE_FLOAT);	//	added to frame, fractional for retimes and motion blur samples
+		ac.SetDefault(0.0, 0);
+
+		ac.NewChannel("subFrameMode", LXsTYPE_INTEGER);
+		ac.SetDefault(0.0, SUBFRAME_SNAP);
+
+		ac.NewChannel("previewDensity", LXsTYPE_PERCENT);	//	renders and bakes always get every particle
+		ac.SetDefault(1.0, 0);
+
+		ac.NewChannel("partioMode", LXsTYPE_INTEGER);
+		ac.SetDefault(0.0, 0);
+
+		ac.NewChannel("prefetchFrames", LXsTYPE_INTEGER);	//	frames read ahead during playback, 0 disables
+		ac.SetDefault(0.0, 2);
+
+		ac.NewChannel("parallelCompress", LXsTYPE_BOOLEAN);	//	compress written caches on all cores
+		ac.SetDefault(0.0, 1);
+
+		ac.NewChannel("keyframeInterval", LXsTYPE_INTEGER);	//	0 writes every .mpc frame in full
+		ac.SetDefault(0.0, 0);
+
+		ac.NewChannel("exportPrecision", LXsTYPE_INTEGER);
+		ac.SetDefault(0.0, PRECISION_FULL);
+
+		ac.NewChannel("positionTolerance", LXsTYPE_DISTANCE);	//	largest error in a quantized .mpc position
+		ac.SetDefault(0.0001, 0);
+
+		ac.NewChannel("valueTolerance", LXsTYPE_FLOAT);		//	largest error in a quantized .mpc color, normal or orientation
+		ac.SetDefault(0.002, 0);
+
+		ac.NewChannel("mergePartitions", LXsTYPE_BOOLEAN);	//	read every partition file of a frame as one
+		ac.SetDefault(0.0, 0);
+
+        return LXe_OK;
+}
+
+
+/*
+ * TestInterface() is required so that nexus knows what interfaces instance
+ * of this package support. Necessary to prevent query loops.
+ */
+        LxResult
+CModoPartioPackage::pkg_TestInterface (
+        const LXtGUID		*guid)
+{
+        return inst_spawn.TestInterfaceRC (guid);
+}
+
+
+/*
+ * Attach is called to create a new instance of this item. The returned
+ * object implements a specific item of this type in the scene.
+ */
+        LxResult
+CModoPartioPackage::pkg_Attach (
+        void		       **ppvObj)
+{
+        CModoPartioInstance * inst = inst_spawn.Alloc (ppvObj);
+		inst->self_obj = (ILxUnknownID)ppvObj[0];
+
+        return LXe_OK;
+}
+
+
+		LxResult
+CModoPartioPackage::cui_UIHints(const char *channelName, ILxUnknownID hints)
+		{
+			std::string nameString(channelName);
+
+			CLxUser_UIHints phints(hints);
+
+			if (nameString.compare("padding") == 0)
+			{
+				phints.Class("iPopChoice");
+				phints.Label("Output Padding");
+				phints.StringList(paddingStringList);
+			}
+			else if (nameString == "subFrameMode")
+			{
+				phints.Class("iPopChoice");
+				phints.Label("Sub-frame");
+				phints.StringList(subFrameModeList);
+			}
+			else if (nameString == "keyframeInterval")
+			{
+				phints.Label("Keyframe Interval");
+				phints.MinInt(0);
+				phints.MaxInt(mpcMaxKeyframeInterval);
+			}
+			else if (nameString == "exportPrecision")
+			{
+				phints.Class("iPopChoice");
+				phints.Label("Precision");
+				phints.StringList(exportPrecisionList);
+			}
+			else if (nameString == "positionTolerance")
+			{
+				phints.Label("Position Tolerance");
+				phints.MinFloat(0.0);
+			}
+			else if (nameString == "valueTolerance")
+			{
+				phints.Label("Value Tolerance");
+				phints.MinFloat(0.0);
+			}
+			else if (nameString == "previewDensity")
+			{
+				phints.Label("Preview Density");
+				phints.MinFloat(0.01);
+				phints.MaxFloat(1.0);
+			}
+
+
+			return LXe_OK;
+		}
+
+LxResult CModoPartioPackage::cui_Enabled(const char *channelName, ILxUnknownID msg, ILxUnknownID item, ILxUnknownID chanRead)
+		{
+			LxResult result = LXe_OK;
+			std::string channelNameString(channelName);
+
+			if (channelNameString == "padding" || channelNameString == "parallelCompress" || channelNameString == "keyframeInterval" ||
+				channelNameString == "exportPrecision" || channelNameString == "positionTolerance" || channelNameString == "valueTolerance")
+			{
+				CLxUser_Item userItem(item);
+				std::string ident = userItem.GetIdentity();
+
+				CLxUser_ChannelRead chan(chanRead);
+				CLxUser_Message res(msg);
+
+				int partioMode = chan.IValue(userItem, "partioMode");
+				if (partioMode == 2)
+				{
+					res.SetCode(LXe_OK);
+				}
+				else
+				{
+					res.SetCode(LXe_CMD_DISABLED);
+					result = LXe_CMD_DISABLED;
+				}
+			}
+			else if (channelNameString == "frame" || channelNameString == "frameTime" || channelNameString == "prefetchFrames" || channelNameString == "subFrameMode" || channelNameString == "previewDensity" || channelNameString == "mergePartitions")
+			{
+				CLxUser_Item userItem(item);
+				std::string ident = userItem.GetIdentity();
+
+				CLxUser_ChannelRead chan(chanRead);
+				CLxUser_Message res(msg);
+
+				int partioMode = chan.IValue(userItem, "partioMode");
+				if (partioMode != 2)
+				{
+					res.SetCode(LXe_OK);
+				}
+				else
+				{
+					res.SetCode(LXe_CMD_DISABLED);
+					result = LXe_CMD_DISABLED;
+				}
+			}
+
+			return result;
+		}
+
+
+/*
+ * ----------------------------------------------------------------
+ * ModoPartio Item Instance
+ *
+ * The instance is the implementation of the item, and there will be one
+ * allocated for each item in the scene. It can respond to a set of
+ * events. Initialization typically stores the item it's attached to.
+ */
+
+void CModoPartioInstance::sil_LinkAdd(const char *graph, ILxUnknownID itemFrom, ILxUnknownID itemTo)
+{
+	CLxUser_Item userItemTo(itemTo);
+	CLxUser_Item userItemFrom(itemFrom);
+	std::string graphName(graph);
+
+	if (userItemFrom == m_item)		//	instance connected to something new
+	{
+		std::map<std::string, int>::const_iterator graphIter;
+		graphIter = graphTypes.find(graphName);
+		if (graphIter != graphTypes.end())
+		{
+			CLxUser_ChannelWrite chan;
+			chan.from(m_item);
+			chan.Set(m_item, "partioMode", graphIter->second);
+
+			CLxUser_Scene scn;
+			scn.from(m_item);
+			CLxUser_ItemGraph iGraph;
+			unsigned link_count;
+			CLxUser_Item dest;
+			for (graphIter = graphTypes.begin(); graphIter != graphTypes.end(); ++graphIter)
+			{
+				if (scn.GetGraph(graphIter->first.c_str(), iGraph))
+				{
+					iGraph.FwdCount(m_item, &link_count);
+					for (unsigned i=0; i < link_count; ++i)
+					{
+						if (iGraph.Forward(m_item, i, dest))
+						{
+							if (dest != userItemTo || graphIter->first != graph)
+							{
+								iGraph.DeleteLink(m_item, dest);
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+
+	return;
+}
+
+
+        LxResult
+CModoPartioInstance::pins_Initialize (
+        ILxUnknownID		 item,
+        ILxUnknownID		 super)
+{
+        m_item.set (item);
+
+		std::string name;
+		if (m_item.GetUniqueName(name) && !name.empty())
+		{
+			profile.reset(new StageProfile(name));		//	nothing has been evaluated yet
+		}
+
+		CLxUser_Scene		 scene (m_item);
+		CLxUser_ListenerPort	 port (scene);
+
+		port.AddListener (self_obj);
+
+		FrameCache::Get().Attach();
+
+        return LXe_OK;
+}
+
+        void
+CModoPartioInstance::pins_Cleanup (void)
+{
+	CLxUser_Scene		 scene (m_item);
+	CLxUser_ListenerPort	 port (scene);
+
+	port.RemoveListener (self_obj);
+
+	FrameCache::Get().Detach();
+	profile->Report();
+
+    m_item.clear ();
+}
+
+
+/*
+ * The particle interface initializes and returns a particle object, which is then
+ * used to access particle data. This first method is passed an evaluation object
+ * which selects the channels it wants and returns a key index.
+ */
+        LxResult
+CModoPartioInstance::prti_Prepare (
+        ILxUnknownID		 evalObj,
+        unsigned		*index)
+{
+        CLxUser_Evaluation	 eval (evalObj);
+
+        index[0] =
+            eval.AddChan (m_item, "cacheFileName");
+            eval.AddChan (m_item, LXsICHAN_XFRMCORE_WORLDMATRIX);
+			eval.AddChan(m_item, "frame");
+			eval.AddChan(m_item, "prefetchFrames");
+			eval.AddChan(m_item, "subFrameMode");
+
+			CLxUser_SceneService ssvc;
+			CLxUser_Scene scn;
+			scn.from(m_item);
+			CLxUser_Item sceneItem;
+			LXtObjectID obj;
+			scn.ItemByIndex(ssvc.ItemType(LXsITYPE_SCENE), 0, &obj);
+			sceneItem.set(obj);
+			eval.AddChan(sceneItem, LXsICHAN_SCENE_FPS);		//	to turn frame offsets into the seconds velocities are given in
+			eval.AddChan(m_item, "previewDensity");
+			eval.AddChan(m_item, "mergePartitions");
+			eval.AddChan(m_item, "frameTime");
 
-		port.AddListener (self_obj);
 
         return LXe_OK;
 }
 
-        void
-CModoPartioInstance::pins_Cleanup (void)
+/*
+ * Once prepared, the second method is called to actually create the object and
+ * initialize its state from the channel values.
+ */
+        LxResult
+CModoPartioInstance::prti_Evaluate (
+        ILxUnknownID		 attr,
+        unsigned		 index,
+        void		       **ppvObj)
+{
+        CLxUser_Attributes	 ai (attr);
+        CModoPartioGenerator	*gen = gen_spawn.Alloc (ppvObj);
+		gen->pins_item = m_item;
+
+		ai.String(index + 0, gen->s_path);
+
+        ai.ObjectRO            (index + 1, gen->w_matrix);		//	world matrix of locator
+
+		double frameTime = ai.Int(index + 2) + ai.Float(index + 8);
+		gen->subFrameMode = ai.Int(index + 4);
+		gen->frame = (int)floor(frameTime + 0.5);
+		gen->subFrame = 0.0f;
+		gen->shutterOffset = 0.0f;
+		if (gen->subFrameMode == SUBFRAME_INTERPOLATE && fabs(frameTime - gen->frame) > 1.0e-4)		//	whole frames need nothing from the next one
+		{
+			gen->frame = (int)floor(frameTime);
+			gen->subFrame = (float)(frameTime - gen->frame);
+		}
+		else if (gen->subFrameMode == SUBFRAME_VELOCITY)
+		{
+			double fps = ai.Float(index + 5);
+			gen->shutterOffset = (fps > 0.0) ? (float)((frameTime - gen->frame) / fps) : 0.0f;
+		}
+		gen->prefetchFrames = std::max(0, ai.Int(index + 3));
+		gen->previewDensity = (float)ai.Float(index + 6);
+		gen->partitioned = ai.Int(index + 7) != 0;
+		gen->prefetcher = &prefetcher;
+		gen->profile = profile;
+
+        return LXe_OK;
+}
+
+        LxResult
+CModoPartioInstance::tsrc_PreviewUpdate (
+        int			 chanIndex,
+        int			*update)
+{
+	static const char * bakeChannels[] = {"padding", "parallelCompress", "keyframeInterval", "exportPrecision", "positionTolerance", "valueTolerance", NULL};	//	only read when a cache is written
+
+        *update = LXfTBLX_PREVIEW_UPDATE_GEOMETRY;
+	for (const char * const * name = bakeChannels; *name; ++name)
+	{
+		unsigned index;
+		if (LXx_OK(m_item.ChannelLookup(*name, &index)) && (int)index == chanIndex)
+		{
+			*update = LXfTBLX_PREVIEW_UPDATE_NONE;		//	how a cache is written doesn't change what is drawn
+		}
+	}
+
+        return LXe_OK;
+}
+
+
+
+
+class CLxTriSoup :		//	Singleton COM object to pass to tableauSurface Sample method to collect particle data
+	public CLxImpl_TriangleSoup,
+	public CLxSingletonPolymorph
+{
+public:
+	CModoPartioInstance * partioInstance;
+
+	LXxSINGLETON_METHOD;
+
+	CLxTriSoup ()
+	{
+		AddInterface (new CLxIfc_TriangleSoup<CLxTriSoup>);
+	}
+
+	unsigned int	 soup_TestBox (const LXtTableauBox bbox);
+	LxResult	 soup_Segment (unsigned int segID, unsigned int type);
+	LxResult	 soup_Vertex  (const float *vertex, unsigned int *index);
+	LxResult	 soup_Polygon (unsigned int v0, unsigned int v1, unsigned int v2);
+	void		 soup_Connect (unsigned int type);
+};
+
+unsigned int
+	CLxTriSoup::soup_TestBox (
+	const LXtTableauBox	 bbox)
+{
+	return 1;		//	a bake wants every particle
+}
+
+LxResult
+	CLxTriSoup::soup_Segment (
+	unsigned int		 segID,
+	unsigned int		 type)
 {
-	CLxUser_Scene		 scene (m_item);
-	CLxUser_ListenerPort	 port (scene);
+	return LXe_TRUE;
+}
+
+LxResult
+	CLxTriSoup::soup_Vertex  (
+	const float		*vertex,
+	unsigned int		*index)
+{
+	partioInstance->AddVertex(vertex, index);
+	return LXe_OK;
+}
+
+LxResult
+	CLxTriSoup::soup_Polygon (
+	unsigned int		 v0,
+	unsigned int		 v1,
+	unsigned int		 v2)
+{
+	return LXe_OK;
+}
+
+void
+	CLxTriSoup::soup_Connect (unsigned int type)
+{
+}
+
+
+LxResult CModoPartioInstance::pcache_Prepare(ILxUnknownID evalObj, unsigned *index)
+{
+	CLxUser_Evaluation	 eval (evalObj);
+	index[0] = eval.AddChan (m_item, "cacheFileName");
+	eval.AddChan (m_item, "padding");
+	eval.AddChan (m_item, "parallelCompress");
+	eval.AddChan (m_item, "keyframeInterval");
+	eval.AddChan (m_item, "exportPrecision");
+	eval.AddChan (m_item, "positionTolerance");
+	eval.AddChan (m_item, "valueTolerance");
+
+	return LXe_OK;
+}
+
+LxResult CModoPartioInstance::pcache_Initialize(ILxUnknownID vdesc, ILxUnknownID attr, unsigned index, double time, double sample)
+{
+	CLxUser_TableauVertex	 vrx (vdesc);	//	vdesc has particle features to be saved
+	
+	CLxUser_Attributes ai(attr);
+
+	ai.String(index + 0, fileName);
+
+	size_t last_period = fileName.find_last_of('.');
+	if (last_period != fileName.npos)
+	{
+		fileType = fileName.substr(last_period);
+		boost::algorithm::to_lower(fileType);
+		fileName = fileName.substr(0, last_period);
+	} 
+	else
+	{
+		fileType = "";
+	}
+
+	size_t numbers = fileName.find_last_not_of("#1234567890");
+	fileName = fileName.substr(0, numbers + 1);
+
+	padding = ai.Int(index + 1) + 1;
+	parallelCompress = ai.Int(index + 2) != 0;
+	keyframeInterval = std::min(std::max(0, ai.Int(index + 3)), mpcMaxKeyframeInterval);
+	lastFrame = FrameWriter::Link();
+	framesSinceKey = 0;
+	bool compact = (ai.Int(index + 4) == PRECISION_COMPACT);
+	bool quantize = compact && fileType == ".mpc";		//	Partio writes every other format as 32-bit values
+	float positionTolerance = (float)std::max(0.0, ai.Float(index + 5));
+	float valueTolerance = (float)std::max(0.0, ai.Float(index + 6));
+
+	unsigned size = vrx.Size ();
+	unsigned count = vrx.Count();
+
+	LXtID4 type;
+	const char * name = NULL;
+	unsigned offset;
+	unsigned next_offset = 0;
+
+	particleFeatures.clear();
+
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		if (i == count - 1)
+		{
+			next_offset = size;
+		} 
+		else
+		{
+			vrx.ByIndex(i + 1, &type, &name, &next_offset);
+		}
+		vrx.ByIndex(i, &type, &name, &offset);
+		particleFeatures.push_back(ParticleFeature(name, offset, next_offset - offset));
+	}
+
+	const FormatTraits & traits = FormatTraits::Get(fileType);
+
+	vertexSize = size;
+	exportSteps.resize(particleFeatures.size());
+	for (unsigned int i = 0; i < particleFeatures.size(); ++i)
+	{
+		ExportStep & step = exportSteps[i];
+
+		ModoParticleFeatureID feature = FeatureID(particleFeatures[i].name);
+		const FeatureMapping * mapping = traits.Find(feature);
+		step.attrName = traits.AttributeName(particleFeatures[i].name);
+		step.attrSize = (mapping && mapping->attrSize) ? mapping->attrSize : particleFeatures[i].size;
+		step.convert = mapping ? mapping->convert : NULL;
+		step.integer = false;
+		step.tolerance = 0.0f;
+
+		if (compact && feature == FEATURE_ID && particleFeatures[i].size == 1)
+		{
+			step.attrSize = 1;
+			step.convert = ExportToInt;
+			step.integer = true;
+		}
+		else if (compact && fileType == ".mpc" && feature == FEATURE_XFRM && particleFeatures[i].size == 9)
+		{
+			step.attrSize = 4;		//	other formats keep the matrix their readers expect under this name
+			step.convert = ExportMatrixToQuat;
+		}
+
+		const char * const * normal = normalNames;
+		while (*normal && particleFeatures[i].name != *normal)
+		{
+			++normal;
+		}
+		if (quantize && (feature == FEATURE_POS || feature == FEATURE_PPREV))
+		{
+			step.tolerance = positionTolerance;
+		}
+		else if (quantize && (feature == FEATURE_RGB || feature == FEATURE_XFRM || *normal))
+		{
+			step.tolerance = valueTolerance;
+		}
+	}
+
+	return LXe_OK;
+}
+
+LxResult CModoPartioInstance::pcache_SaveFrame(ILxUnknownID pobj, double time)
+{
+	CLxUser_SceneService ssvc;
+
+	CLxUser_Scene scn;
+	scn.from(m_item);
+
+	CLxUser_Item sceneItem;
+	LXtObjectID obj;
+	scn.ItemByIndex(ssvc.ItemType(LXsITYPE_SCENE), 0, &obj);
+	sceneItem.set(obj);
+	unsigned index;
+	sceneItem.ChannelLookup(LXsICHAN_SCENE_FPS, &index);
+
+	CLxUser_ChannelRead	 rchan;
+	scn.GetChannels(rchan, time);
+
+	double fps;
+	rchan.Double(sceneItem, index, &fps);
+	
+	unsigned int frame = (unsigned int)floor(time * fps + 0.5);
+
+
+	CLxUser_TableauSurface tsrf(pobj);
+
+	CLxUser_TableauVertex tvrt;
+	CLxUser_TableauService tsrv;
+	tsrv.NewVertex(tvrt);
+
+	unsigned offset;
+
+	pData = Partio::create();
+	
+	std::vector<ParticleFeature>::iterator particleFeature_Iter = particleFeatures.begin();
+
+	Partio::ParticleAttributeType attrType;
+
+	for (; particleFeature_Iter != particleFeatures.end(); ++particleFeature_Iter)
+	{									
+		tvrt.AddFeature(LXiTBLX_PARTICLES, particleFeature_Iter->name.c_str(), &offset);	//	first set up vertex description to ask for data to be sent to triangle soup
+	}																						//	apparently order matters, but not offset. Just returns index to address of offset					
+
+	LxResult rc = tsrf.SetVertex(tvrt);
+
+
+	particleIndex = 0;
+	exportCount = 0;
+	
+	CLxTriSoup trisoup;
+	trisoup.partioInstance = this;
+	LXtTableauBox bbox;
+	bbox[0] = bbox[1] = bbox[2] = -1.0e30f;
+	bbox[3] = bbox[4] = bbox[5] = 1.0e30f;
+	tsrf.Sample(bbox, -1.0f, trisoup);
+
+	for (unsigned int i = 0; i < particleFeatures.size(); ++i)		//	next add corresponding attributes to Partio data object, once the staged values are known
+	{
+		const ExportStep & step = exportSteps[i];
+		if (step.integer && StagedWholeNumbers(particleFeatures[i].offset))		//	Modo's own ids are fractions, which stay floats
+		{
+			attrType = Partio::INT;
+		}
+		else if (step.attrSize == 1)
+		{
+			attrType = Partio::FLOAT;
+		}
+		else
+		{
+			attrType = Partio::VECTOR;
+		}
+
+		particleFeatures[i].attr = Partio::ParticleAttribute(pData->addAttribute(step.attrName.c_str(), attrType, step.attrSize));	//	in Modo all of the particle features are floats
+	}
+	FlushVertices();
+
+	std::string writeName = fileName;
+	std::string frameString = std::to_string((_ULONGLONG)frame);
+	if (frameString.size() < padding)
+	{
+		writeName += paddingString.substr(0, padding - frameString.size());
+	}
+	writeName = writeName + frameString + fileType;
+
+	std::vector<std::string> featureNames;		//	kept by .mpc files so features come back under the same names
+	std::vector<float> tolerances;
+	for (unsigned int i = 0; i < particleFeatures.size(); ++i)
+	{
+		featureNames.push_back(particleFeatures[i].name);
+		tolerances.push_back(exportSteps[i].tolerance);
+	}
+
+	FrameWriter::Frame frameData(pData, ReleaseParticles);		//	written and released in the background
+	pData = NULL;
+
+	bool sequence = (fileType == ".mpc" && keyframeInterval > 1);
+	bool delta = sequence && lastFrame.reference && ++framesSinceKey < keyframeInterval;
+	if (!delta)
+	{
+		framesSinceKey = 0;
+	}
+
+	FrameWriter::Link link = delta ? lastFrame : FrameWriter::Link();
+	link.stamp = sequence ? NewFrameStamp() : 0;
+
+	StageProfile::Bind bind(profile);
+	writer.Submit(frameData, writeName, parallelCompress, featureNames, tolerances, link);
+	if (!sequence)
+	{
+		lastFrame = FrameWriter::Link();
+	}
+	else if (!delta)
+	{
+		lastFrame.reference = frameData;		//	held until the next keyframe, so every delta decodes against it alone
+		lastFrame.referenceName = writeName;
+		lastFrame.referenceStamp = link.stamp;
+	}
+
+	return LXe_OK;
+}
+
+LxResult CModoPartioInstance::pcache_Cleanup()
+{
+	std::vector<std::string> failed;
+	unsigned written = writer.Finish(failed);
+
+	std::vector< std::vector<float> >().swap(exportChunks);		//	staging is only kept while frames are being saved
+	lastFrame = FrameWriter::Link();
+
+	CLxUser_LogService log;
+	log.DebugOut(LXi_DBLOG_NORMAL, "ModoPartio: wrote %u cache frames, %u failed", written, (unsigned)failed.size());
+	for (std::vector<std::string>::const_iterator iter = failed.begin(); iter != failed.end(); ++iter)
+	{
+		log.DebugOut(LXi_DBLOG_ERROR, "ModoPartio: could not write %s", iter->c_str());
+	}
+	profile->Report();
+
+	return failed.empty() ? LXe_OK : LXe_FAILED;
+}
+
+void CModoPartioInstance::AddVertex(const float *vertex, unsigned int *index)
+{
+	std::vector<float> * chunk;
+	if (exportCount % exportChunkSize == 0)
+	{
+		if (exportCount / exportChunkSize == exportChunks.size())
+		{
+			exportChunks.push_back(std::vector<float>());
+		}
+		chunk = &exportChunks[exportCount / exportChunkSize];
+		chunk->clear();		//	may be left from an earlier frame, and keeps its memory
+		chunk->reserve(exportChunkSize * vertexSize);		//	chunks are never reallocated once started
+	}
+	else
+	{
+		chunk = &exportChunks[exportCount / exportChunkSize];
+	}
+	chunk->insert(chunk->end(), vertex, vertex + vertexSize);
+	*index  = exportCount++;	//	not sure this is needed
+}
+
+/*
+ * Add all of the staged vertices to the Partio data at once, then fill each
+ * attribute a chunk of particles at a time. Partio::create() keeps each
+ * attribute in one array, so attributes are written as whole columns; the
+ * per particle path is only a fallback for other layouts.
+ */
+bool CModoPartioInstance::StagedWholeNumbers(unsigned offset) const		//	the staged feature at offset is an int for every vertex
+{
+	for (unsigned int c = 0; c < (exportCount + exportChunkSize - 1) / exportChunkSize; ++c)
+	{
+		for (size_t v = offset; v < exportChunks[c].size(); v += vertexSize)
+		{
+			float value = exportChunks[c][v];
+			if (value != floorf(value) || fabsf(value) >= 2147483648.0f)
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void CModoPartioInstance::FlushVertices()
+{
+	if (exportCount == 0)
+	{
+		return;
+	}
+
+	particleIndex = pData->numParticles();
+	pData->addParticles(exportCount);
+
+	for (unsigned int i = 0; i < particleFeatures.size(); ++i)
+	{
+		const ParticleFeature & particleFeature = particleFeatures[i];
+		const ExportStep & step = exportSteps[i];
+
+		float * column = pData->dataWrite<float>(particleFeature.attr, particleIndex);
+		bool contiguous = (pData->dataWrite<float>(particleFeature.attr, particleIndex + exportCount - 1) == column + (exportCount - 1) * step.attrSize);
+
+		for (unsigned int c = 0; c < (exportCount + exportChunkSize - 1) / exportChunkSize; ++c)
+		{
+			unsigned int chunkCount = (unsigned int)(exportChunks[c].size() / vertexSize);
+			Partio::ParticleIndex chunkStart = particleIndex + c * exportChunkSize;
+			const float * input = &exportChunks[c][particleFeature.offset];
+
+			float * output = column + (size_t)c * exportChunkSize * step.attrSize;
+			if (!contiguous)
+			{
+				exportConverted.resize(chunkCount * step.attrSize);
+				output = &exportConverted[0];
+			}
+
+			ExportKernelFunc convert = (step.integer && particleFeature.attr.type != Partio::INT) ? NULL : step.convert;
+			if (convert)
+			{
+				convert(input, vertexSize, chunkCount, output, step.attrSize);
+			}
+			else
+			{
+				for (unsigned int p = 0; p < chunkCount; ++p)
+				{
+					memcpy(output + p * step.attrSize, input + p * vertexSize, step.attrSize * sizeof(float));
+				}
+			}
 
-	port.RemoveListener (self_obj);
+			if (!contiguous)
+			{
+				for (unsigned int p = 0; p < chunkCount; ++p)
+				{
+					memcpy(pData->dataWrite<float>(particleFeature.attr, chunkStart + p), output + p * step.attrSize, step.attrSize * sizeof(float));
+				}
+			}
+		}
+	}
 
-    m_item.clear ();
+	particleIndex += exportCount;
+	exportCount = 0;
 }
 
 
 /*
- * The particle interface initializes and returns a particle object, which is then
- * used to access particle data. This first method is passed an evaluation object
- * which selects the channels it wants and returns a key index.
+ * ----------------------------------------------------------------
+ * Particle Object
+ *
+ * The particle object can be enumerated by a client to get the data for
+ * all particles. It also can preset an attributes interface to allow the
+ * client to set hints, in this case the random seed.
  */
-        LxResult
-CModoPartioInstance::prti_Prepare (
-        ILxUnknownID		 evalObj,
-        unsigned		*index)
+CModoPartioGenerator::CModoPartioGenerator ()
 {
-        CLxUser_Evaluation	 eval (evalObj);
-
-        index[0] =
-            eval.AddChan (m_item, "cacheFileName");
-            eval.AddChan (m_item, LXsICHAN_XFRMCORE_WORLDMATRIX);
-			eval.AddChan(m_item, "frame");
-
+	data = NULL;
+	nextData = NULL;
+	matchTime = 0.0f;
+	matchReady = false;
+	prefetcher = NULL;
+	prefetchFrames = 0;
+	partitioned = false;
+	subFrameMode = SUBFRAME_SNAP;
+	subFrame = 0.0f;
+	shutterOffset = 0.0f;
+	previewDensity = 1.0f;
+	density = 1.0f;
+	plan = PlanCache::Get().Empty();
+	traits = &FormatTraits::Get("");
+        //dyna_Add (LXsPARTICLEATTR_SEED, "integer");
+        //attr_SetInt (0, 137);
+}
 
-        return LXe_OK;
+CModoPartioGenerator::~CModoPartioGenerator ()
+{
+	FrameCache::Get().Release(data);	//	particle data is shared with other items through the frame cache
+	FrameCache::Get().Release(nextData);
 }
 
 /*
- * Once prepared, the second method is called to actually create the object and
- * initialize its state from the channel values.
+ * Like tableau surfaces, particle sources have features. These are the
+ * properties of each particle as a vector of floats. We provide the standard
+ * 3 particle features: position, transform, and ID.
  */
-        LxResult
-CModoPartioInstance::prti_Evaluate (
-        ILxUnknownID		 attr,
-        unsigned		 index,
-        void		       **ppvObj)
+        unsigned int
+CModoPartioGenerator::tsrf_FeatureCount (
+        LXtID4			 type)
 {
-        CLxUser_Attributes	 ai (attr);
-        CModoPartioGenerator	*gen = gen_spawn.Alloc (ppvObj);
-		gen->pins_item = m_item;
-
-		ai.String(index + 0, gen->s_path);
-
-        ai.ObjectRO            (index + 1, gen->w_matrix);		//	world matrix of locator
+	StageProfile::Bind bind(profile);
+	StageTimer timer(STAGE_RESOLVE);
 
-		gen->frame = ai.Int(index + 2);
+	FrameCache::Get().Release(data);
+	FrameCache::Get().Release(nextData);
+	data = NULL;
+	nextData = NULL;
 
-        return LXe_OK;
-}
+	boost::filesystem::path filePath(s_path);
+	fileType = filePath.extension().string();
 
-        LxResult
-CModoPartioInstance::tsrc_PreviewUpdate (
-        int			 chanIndex,
-        int			*update)
-{
-        *update = LXfTBLX_PREVIEW_UPDATE_GEOMETRY;
+	particleAttributeNames.clear();
+	cacheFileName.clear();
 
-        return LXe_OK;
-}
+	boost::filesystem::path cacheFilePath;
+	if (!FrameSequenceIndex::Resolve(filePath, frame, cacheFilePath, partitioned))
+	{
+		return 0;
+	}
 
+	boost::algorithm::to_lower(fileType);
 
+	traits = &FormatTraits::Get(fileType);
 
+	data = prefetcher ? prefetcher->Acquire(filePath, frame, prefetchFrames, partitioned) : NULL;
+	if (data)
+	{
+		schema.Set(data, FrameCache::Get().Features(data));
+	}
+	else if (!FrameCache::Get().Schema(cacheFilePath, schema))
+	{
+		data = FrameCache::Get().Acquire(cacheFilePath);		//	no header reader for this format, read it all
+		if (!data)
+		{
+			return 0;
+		}
+		schema.Set(data, FrameCache::Get().Features(data));
+	}
 
-class CLxTriSoup :		//	Singleton COM object to pass to tableauSurface Sample method to collect particle data
-	public CLxImpl_TriangleSoup,
-	public CLxSingletonPolymorph
-{
-public:
-	CModoPartioInstance * partioInstance;
+	Partio::ParticleAttribute attr;
 
-	LXxSINGLETON_METHOD;
+	if (!schema.Find("position",attr) || attr.type != Partio::VECTOR || attr.count != 3) 
+	{
+		FrameCache::Get().Release(data);
+		data = NULL;
+		return 0;							//	always need particle position data
+	}
+	cacheFileName = cacheFilePath.string();		//	particles are read from here once tsrf_Sample runs
 
-	CLxTriSoup ()
+	particleAttributeNames.push_back(LXsTBLX_PARTICLE_POS);
+	for (size_t i=0; i < schema.attributes.size(); ++i)
 	{
-		AddInterface (new CLxIfc_TriangleSoup<CLxTriSoup>);
+		attr = schema.attributes[i];
+		if (attr.name != "position")
+		{
+			if (i < schema.features.size() && !schema.features[i].empty())
+			{
+				particleAttributeNames.push_back(schema.features[i]);		//	native files remember the feature
+			}
+			else if (modoParticleFeaturesSet.find(attr.name) != modoParticleFeaturesSet.end())
+			{
+				particleAttributeNames.push_back(attr.name);	//	if attribute has same name as a standard modo particle feature use it
+			}
+			else if (traits->FeatureName(attr.name))
+			{
+				particleAttributeNames.push_back(traits->FeatureName(attr.name));	//	conversion available
+			}
+		}
 	}
 
-	unsigned int	 soup_TestBox (const LXtTableauBox bbox);
-	LxResult	 soup_Segment (unsigned int segID, unsigned int type);
-	LxResult	 soup_Vertex  (const float *vertex, unsigned int *index);
-	LxResult	 soup_Polygon (unsigned int v0, unsigned int v1, unsigned int v2);
-	void		 soup_Connect (unsigned int type);
-};
+	if (std::find(particleAttributeNames.begin(), particleAttributeNames.end(), LXsTBLX_PARTICLE_ID) == particleAttributeNames.end())
+	{
+		particleAttributeNames.push_back(LXsTBLX_PARTICLE_ID);					//	always set particle id
+	}
+	if (std::find(particleAttributeNames.begin(), particleAttributeNames.end(), LXsTBLX_PARTICLE_XFRM) == particleAttributeNames.end())
+	{
+		particleAttributeNames.push_back(LXsTBLX_PARTICLE_XFRM);							//	always set particle xfrm
+	}
 
-unsigned int
-	CLxTriSoup::soup_TestBox (
-	const LXtTableauBox	 bbox)
-{
-	return 1;
+    return (type == LXiTBLX_PARTICLES ? (unsigned int)particleAttributeNames.size() : 0);
 }
 
-LxResult
-	CLxTriSoup::soup_Segment (
-	unsigned int		 segID,
-	unsigned int		 type)
+        LxResult
+CModoPartioGenerator::tsrf_FeatureByIndex (
+        LXtID4			 type,
+        unsigned int		 index,
+        const char	       **name)
 {
-	return LXe_TRUE;
-}
+        if (type != LXiTBLX_PARTICLES || index > (unsigned int)(particleAttributeNames.size()))
+                return LXe_OUTOFBOUNDS;
 
-LxResult
-	CLxTriSoup::soup_Vertex  (
-	const float		*vertex,
-	unsigned int		*index)
-{
-	partioInstance->AddVertex(vertex, index);
-	return LXe_OK;
-}
+		name[0] = particleAttributeNames[index].c_str();
 
-LxResult
-	CLxTriSoup::soup_Polygon (
-	unsigned int		 v0,
-	unsigned int		 v1,
-	unsigned int		 v2)
-{
-	return LXe_OK;
+        return LXe_OK;
 }
 
-void
-	CLxTriSoup::soup_Connect (unsigned int type)
+
+/*
+ * Given a tableau vertex allocated by the client, we need to determine the
+ * features they want and their offsets into the vertex vector.
+ */
+        LxResult
+CModoPartioGenerator::tsrf_SetVertex (
+        ILxUnknownID		 vdesc)
 {
-}
+    CLxUser_TableauVertex	 vrx (vdesc);
 
+	StageProfile::Bind bind(profile);
+	StageTimer timer(STAGE_NEGOTIATE);
 
-LxResult CModoPartioInstance::pcache_Prepare(ILxUnknownID evalObj, unsigned *index)
-{
-	CLxUser_Evaluation	 eval (evalObj);
-	index[0] = eval.AddChan (m_item, "cacheFileName");
-	eval.AddChan (m_item, "padding");
+    vrt_size = vrx.Size ();
+    if (vrt_size == 0)
+            return LXe_OK;
 
-	return LXe_OK;
-}
+    unsigned		 offset;
+	const char * featureName;		//	name of modo particle feature
+	LXtID4 type;
+	unsigned int featureCount = vrx.Count();
 
-LxResult CModoPartioInstance::pcache_Initialize(ILxUnknownID vdesc, ILxUnknownID attr, unsigned index, double time, double sample)
-{
-	CLxUser_TableauVertex	 vrx (vdesc);	//	vdesc has particle features to be saved
-	
-	CLxUser_Attributes ai(attr);
+	std::string signature = cacheFileName.empty() ? std::string("-") : std::string(traits->fileType);		//	unbound when there's no file
+	char number[16];
+	sprintf(number, "/%d", vrt_size);
+	signature += number;
+	for (unsigned int i=0; i < featureCount; ++i)
+	{
+		vrx.ByIndex(i, &type, &featureName, &offset);
+		sprintf(number, "@%u;", offset);
+		signature += featureName;
+		signature += number;
+	}
 
-	ai.String(index + 0, fileName);
+	plan = PlanCache::Get().Find(signature, schema);
+	if (StageProfile::Current())
+	{
+		StageProfile::Current()->CountPlan(plan != NULL);
+	}
+	if (plan)
+	{
+		return LXe_OK;
+	}
 
-	size_t last_period = fileName.find_last_of('.');
-	if (last_period != fileName.npos)
+	boost::shared_ptr<FeaturePlan> resolved(new FeaturePlan());
+	resolved->schema = schema;
+	std::vector<ParticleFeature> & particleFeatures = resolved->features;
+
+	std::string attrName;			//	Partio attribute name
+	Partio::ParticleAttribute partioAttr;
+	for (unsigned int i=0; i < featureCount; ++i)
 	{
-		fileType = fileName.substr(last_period);
-		boost::algorithm::to_lower(fileType);
-		fileName = fileName.substr(0, last_period);
-	} 
-	else
+		vrx.ByIndex(i, &type, &featureName, &offset);
+
+		if (strcmp(featureName, LXsTBLX_PARTICLE_POS) != 0 && schema.FindFeature(featureName, partioAttr))
+		{
+			attrName = partioAttr.name;
+		}
+		else
+		{
+			attrName = traits->AttributeName(featureName);
+		}
+
+
+		if(!cacheFileName.empty() && schema.Find(attrName, partioAttr))		//	when feeding into a particle modifier, the modifier node still asks for data even after we tell it we have zero particle features, so check for data here
+		{
+			particleFeatures.push_back(ParticleFeature(featureName, offset, 0, partioAttr));
+		}
+		else
+		{
+			particleFeatures.push_back(ParticleFeature(featureName, offset, 0));
+		}
+	}
+
+	Compare cmp;
+	std::sort(particleFeatures.begin(), particleFeatures.end(), cmp);	//	sorting probably not necessary since features already seem to be in this order
+
+	int prev_offset = vrt_size;
+	std::vector<ParticleFeature>::reverse_iterator particleFeatures_Iter = particleFeatures.rbegin();	//	calculate size of features (# floats)
+	for (; particleFeatures_Iter != particleFeatures.rend(); ++particleFeatures_Iter)
 	{
-		fileType = "";
+		if (particleFeatures_Iter->bound)
+		{
+			particleFeatures_Iter->size = std::min((int)(prev_offset - particleFeatures_Iter->offset), particleFeatures_Iter->attr.count);	//	make sure not trying to read more data than present in Partio
+		} 
+		else
+		{
+			particleFeatures_Iter->size = 0;
+		}
+		prev_offset = particleFeatures_Iter->offset;
 	}
 
-	size_t numbers = fileName.find_last_not_of("#1234567890");
-	fileName = fileName.substr(0, numbers + 1);
+	CompilePlan(*resolved);
+	PlanCache::Get().Insert(signature, resolved);
+	plan = resolved;
 
-	padding = ai.Int(index + 1) + 1;
+    return LXe_OK;
+}
 
-	unsigned size = vrx.Size ();
-	unsigned count = vrx.Count();
 
-	LXtID4 type;
-	const char * name = NULL;
-	unsigned offset;
-	unsigned next_offset = 0;
+/*
+ * Turn the features into copy steps. Features with no data in the file and no
+ * default are left at zero, so they get no step.
+ */
+        void
+CModoPartioGenerator::CompilePlan (
+        FeaturePlan		&target) const
+{
+	target.steps.clear();
+	target.blockSteps = 0;
+
+	std::vector<ParticleFeature>::const_iterator particleFeature_Iter = target.features.begin();
+	for (; particleFeature_Iter != target.features.end(); ++particleFeature_Iter)
+	{
+		if (particleFeature_Iter->offset < 0)
+		{
+			continue;
+		}
 
-	particleFeatures.clear();
+		ModoParticleFeatureID featureID = FeatureID(particleFeature_Iter->name);
+		CopyStep step;
+		step.offset = particleFeature_Iter->offset;
+		step.size = particleFeature_Iter->size;
+		step.bound = particleFeature_Iter->bound;
+		step.attr = &particleFeature_Iter->attr;
+		step.staging = 0;
+		step.feature = featureID;
 
-	for (unsigned int i = 0; i < count; ++i)
-	{
-		if (i == count - 1)
+		if (!step.bound)
 		{
-			next_offset = size;
-		} 
+			if (featureID == FEATURE_ID)
+			{
+				step.kernel = KERNEL_RANDOM_ID;		//	use random values for particle id
+			}
+			else if (featureID == FEATURE_XFRM)
+			{
+				step.kernel = KERNEL_IDENTITY_XFRM;
+			}
+			else
+			{
+				continue;
+			}
+		}
+		else if (particleFeature_Iter->attr.type == Partio::FLOAT || particleFeature_Iter->attr.type == Partio::VECTOR)
+		{
+			if (featureID == FEATURE_XFRM && (traits->quatOrientation ? particleFeature_Iter->attr.count >= 4 : particleFeature_Iter->attr.count == 4))		//	four values can only be a quaternion
+			{
+				step.kernel = KERNEL_QUAT_XFRM;
+				step.staging = target.blockSteps++;
+			}
+			else if (featureID == FEATURE_XFRM && step.size != 9)
+			{
+				step.kernel = KERNEL_IDENTITY_XFRM;		//	set identity rotation if we don't have the right number of matrix elements
+			}
+			else
+			{
+				step.kernel = KERNEL_FLOAT;
+			}
+		}
+		else if (particleFeature_Iter->attr.type == Partio::INT)
+		{
+			step.kernel = KERNEL_INT;
+		}
 		else
 		{
-			vrx.ByIndex(i + 1, &type, &name, &next_offset);
+			continue;
 		}
-		vrx.ByIndex(i, &type, &name, &offset);
-		particleFeatures.push_back(new ParticleFeature(name, offset, next_offset - offset));
-	}
 
-	conversion.SetFormat(fileType);
-
-	return LXe_OK;
+		target.steps.push_back(step);
+	}
 }
 
-LxResult CModoPartioInstance::pcache_SaveFrame(ILxUnknownID pobj, double time)
+
+/*
+ * Sampling walks the particles.
+ */
+        LxResult
+CModoPartioGenerator::tsrf_Sample (
+        const LXtTableauBox	 bbox,
+        float			 scale,
+        ILxUnknownID		 trisoup)
 {
-	CLxUser_SceneService ssvc;
+        int			 i;
+        LxResult		 result;
 
-	CLxUser_Scene scn;
-	scn.from(m_item);
+		if (cacheFileName.empty())
+		{
+			return LXe_OK;	//	when feeding into a particle modifier, the modifier node still asks for data even after we tell it we have zero particle features, so check for data here
+		}
 
-	CLxUser_Item sceneItem;
-	LXtObjectID obj;
-	scn.ItemByIndex(ssvc.ItemType(LXsITYPE_SCENE), 0, &obj);
-	sceneItem.set(obj);
-	unsigned index;
-	sceneItem.ChannelLookup(LXsICHAN_SCENE_FPS, &index);
+		StageProfile::Bind bind(profile);
+		StageTimer timer(STAGE_SAMPLE);
 
-	CLxUser_ChannelRead	 rchan;
-	scn.GetChannels(rchan, time);
+		density = (scale == 0.0f) ? std::max(0.0f, std::min(1.0f, previewDensity)) : 1.0f;		//	the GL preview samples with no pixel scale, renders pass one and the bake passes -1
+		if (density < 1.0f)
+		{
+			NoteThinning(profile ? profile->Name() : cacheFileName, density);
+		}
 
-	double fps;
-	rchan.Double(sceneItem, index, &fps);
-	
-	unsigned int frame = (unsigned int)floor(time * fps + 0.5);
+		if (!data)
+		{
+			if (ChunkReader::Streams(cacheFileName, schema))		//	too large to hold, features are already bound to the schema it's read with
+			{
+				boost::shared_ptr<ChunkReader> reader(ChunkReader::Open(cacheFileName, schema));
+				if (reader)
+				{
+					timer.Count(schema.numParticles);
+					return SampleStream(reader.get(), bbox, trisoup);
+				}
+			}
+			data = FrameCache::Get().Acquire(cacheFileName);
+			if (!data)
+			{
+				return LXe_OK;
+			}
+		}
+		timer.Count(data->numParticles());
 
+		boost::shared_ptr<FeaturePlan> rebound;		//	features were matched against the file header, bind them to the particle data
+		for (size_t i = 0; i < plan->features.size(); ++i)
+		{
+			const ParticleFeature & feature = plan->features[i];
+			Partio::ParticleAttribute partioAttr;
+			if (!feature.bound)
+			{
+				continue;
+			}
+			bool found = data->attributeInfo(feature.attr.name.c_str(), partioAttr) && partioAttr.type == feature.attr.type;
+			if (found && partioAttr.attributeIndex == feature.attr.attributeIndex && partioAttr.count == feature.attr.count)
+			{
+				continue;
+			}
+			if (!rebound)
+			{
+				rebound.reset(new FeaturePlan(*plan));		//	the shared plan stays as it is
+			}
+			ParticleFeature & bind = rebound->features[i];
+			if (!found)
+			{
+				bind.bound = false;
+				bind.size = 0;
+			}
+			else
+			{
+				bind.size = std::min(bind.size, (unsigned)partioAttr.count);
+				bind.attr = partioAttr;
+			}
+		}
+		if (rebound)
+		{
+			CompilePlan(*rebound);
+			plan = rebound;
+		}
 
-	CLxUser_TableauSurface tsrf(pobj);
+		if (subFrame > 0.0f && !nextData)
+		{
+			boost::filesystem::path nextFilePath;
+			if (FrameSequenceIndex::Resolve(boost::filesystem::path(s_path), frame + 1, nextFilePath, partitioned))
+			{
+				nextData = FrameCache::Get().Acquire(nextFilePath);		//	usually already read ahead
+			}
+		}
+		if (nextData)
+		{
+			return SampleInterpolated(bbox, trisoup);
+		}
+		Partio::ParticleAttribute velocityAttr;
+		const CopyStep * shiftStep = ShiftStep(data, velocityAttr);
 
-	CLxUser_TableauVertex tvrt;
-	CLxUser_TableauService tsrv;
-	tsrv.NewVertex(tvrt);
+		if (bbox[0] > -1.0e29f || bbox[1] > -1.0e29f || bbox[2] > -1.0e29f || bbox[3] < 1.0e29f || bbox[4] < 1.0e29f || bbox[5] < 1.0e29f)
+		{
+			boost::shared_ptr<const ParticleGrid> grid = FrameCache::Get().Grid(data);
+			if (!grid->Within(bbox, shiftStep ? shutterOffset : 0.0f))
+			{
+				return SampleSubset(grid.get(), bbox, trisoup);
+			}
+		}
+		if (density < 1.0f)
+		{
+			return SampleSubset(NULL, bbox, trisoup);
+		}
 
-	unsigned offset;
+		std::vector<int> randomOffsets;		//	drawn in order as the vertices are emitted
+		for (size_t s = 0; s < plan->steps.size(); ++s)
+		{
+			if (plan->steps[s].kernel == KERNEL_RANDOM_ID)
+			{
+				randomOffsets.push_back(plan->steps[s].offset);
+			}
+		}
 
-	pData = Partio::create();
-	
-	boost::ptr_vector<ParticleFeature>::iterator particleFeature_Iter = particleFeatures.begin();
+		/*
+		 * Particles are converted a batch at a time into a packed staging buffer,
+		 * split into ranges that the worker pool hands out to whichever thread is
+		 * free, then emitted to the soup in order by this thread.
+		 */
+		const unsigned batchSize = 65536;
+		unsigned numParticles = data->numParticles();
+		ScratchArena::Scope scratch;
+		size_t stagingSize = (size_t)std::min(batchSize, numParticles) * vrt_size;
+		float * vertices = scratch.Alloc<float>(stagingSize);
+		std::fill(vertices, vertices + stagingSize, 0.0f);
+
+		result = LXe_OK;
+		try
+		{
+			tri_soup.set (trisoup);
+			tri_soup.Segment (1, LXiTBLX_SEG_POINT);
 
-	Partio::ParticleAttributeType attrType;
-	std::string attrName;
-	unsigned attrSize;
+			for (unsigned first = 0; first < numParticles; first += batchSize)
+			{
+				unsigned count = std::min(batchSize, numParticles - first);
+				{
+					StageTimer convert(STAGE_CONVERT);
+					convert.Count(count);
+					WorkerPool::Get().ParallelFor((count + convertRangeSize - 1) / convertRangeSize, boost::bind(&CModoPartioGenerator::ConvertRange, this, first, count, vertices, shiftStep, &velocityAttr, _1));
+				}
 
-	for (; particleFeature_Iter != particleFeatures.end(); ++particleFeature_Iter)
-	{									
-		tvrt.AddFeature(LXiTBLX_PARTICLES, particleFeature_Iter->name.c_str(), &offset);	//	first set up vertex description to ask for data to be sent to triangle soup
-	}																						//	apparently order matters, but not offset. Just returns index to address of offset					
+				StageTimer emit(STAGE_EMIT);
+				emit.Count(count);
+				for (unsigned p = 0; p < count; ++p)
+				{
+					float * vertex = vertices + (size_t)p * vrt_size;
+					for (i = 0; i < (int)randomOffsets.size(); ++i)
+					{
+						vertex[randomOffsets[i]] = rand_seq.uniform ();
+					}
 
-	particleFeature_Iter = particleFeatures.begin();
-	for (; particleFeature_Iter != particleFeatures.end(); ++particleFeature_Iter)		//	next add corresponding attributes to Partio data object
-	{
-		attrSize = 0;
+					LxResult rc;
+					unsigned index;
+					rc = tri_soup.Vertex  (vertex, &index);
+					if (LXx_FAIL (rc))
+						throw (rc);
 
-		ConversionBimap::left_const_iterator conversionIter = conversion.bimap.left.find(particleFeature_Iter->name);
-		if (conversionIter != conversion.bimap.left.end())
-		{
-			attrName = conversionIter->second;
-		} 
-		else
+					rc = tri_soup.Polygon (index, 0, 0);
+					if (LXx_FAIL (rc))
+						throw (rc);
+				}
+			}
+		} catch (LxResult rc)
 		{
-			attrName = particleFeature_Iter->name;
+			result = rc;
 		}
 
-		if (fileType.compare(".icecache") == 0)
+		return result;
+}
+
+
+/*
+ * Converts one range of a batch of particles into the staging buffer, on a
+ * worker thread. Vertices are packed vrt_size floats apart from the start of
+ * the batch. Quaternions are gathered and expanded for the whole range at
+ * once. Random ids are left for the emitting thread, so the sequence doesn't
+ * depend on the scheduling.
+ */
+        void
+CModoPartioGenerator::ConvertRange (
+        unsigned		 first,
+        unsigned		 count,
+        float			*vertices,
+        const CopyStep		*shiftStep,
+        const Partio::ParticleAttribute *velocityAttr,
+        unsigned		 range)
+{
+	unsigned begin = range * convertRangeSize;
+	unsigned rangeCount = std::min(convertRangeSize, count - begin);
+
+	ScratchArena::Scope scratch;		//	this worker's own arena
+	float * matrices = NULL;
+	if (plan->blockSteps)
+	{
+		Partio::ParticleIndex * indices = scratch.Alloc<Partio::ParticleIndex>(rangeCount);
+		for (unsigned i = 0; i < rangeCount; ++i)
 		{
-			if (attrName == "Orientation" || attrName == "AngularVelocity")
-			{
-				attrSize = 4;	//	quaternion rotation in icecache
-			}
-			else if (attrName == "Color")	//	RGBA in Softimage
+			indices[i] = first + begin + i;
+		}
+		matrices = scratch.Alloc<float>(plan->blockSteps * 9 * rangeCount);
+		for (size_t s = 0; s < plan->steps.size(); ++s)
+		{
+			const CopyStep & step = plan->steps[s];
+			if (step.kernel == KERNEL_QUAT_XFRM)
 			{
-				attrSize = 4;
+				float * quats = scratch.Alloc<float>(rangeCount * step.attr->count);
+				data->data<float>(*step.attr, rangeCount, indices, true, quats);
+				QuatToMatrix(quats, step.attr->count, rangeCount, &matrices[step.staging * 9 * rangeCount], rangeCount);
 			}
 		}
+	}
+
+	const CopyStep * planBegin = plan->steps.empty() ? NULL : &plan->steps[0];
+	const CopyStep * planEnd = planBegin + plan->steps.size();
 
-		if(attrSize == 0)
+	for (unsigned slot = 0; slot < rangeCount; ++slot)
+	{
+		Partio::ParticleIndex particle = first + begin + slot;
+		float * vertex = vertices + (size_t)(begin + slot) * vrt_size;
+
+		for (const CopyStep * step = planBegin; step != planEnd; ++step)
 		{
-			attrSize = particleFeature_Iter->size;
+			float * out = vertex + step->offset;
+			switch (step->kernel)
+			{
+				case KERNEL_FLOAT:
+				{
+					const float * featureData = data->data<float>(*step->attr, particle);
+					for (unsigned int i=0; i < step->size; ++i)
+					{
+						out[i] = featureData[i];
+					}
+					break;
+				}
+				case KERNEL_INT:
+				{
+					const int * featureData = data->data<int>(*step->attr, particle);
+					for (unsigned int i=0; i < step->size; ++i)
+					{
+						out[i] = (float)featureData[i];
+					}
+					break;
+				}
+				case KERNEL_QUAT_XFRM:		//	icecache quaternion already converted to a rotation matrix for this range
+				{
+					const float * matrix = &matrices[step->staging * 9 * rangeCount + slot];
+					for (unsigned int i=0; i < 9; ++i)
+					{
+						out[i] = matrix[i * rangeCount];
+					}
+					break;
+				}
+				case KERNEL_IDENTITY_XFRM:
+				{
+					out[0] = 1.0f;
+					out[4] = 1.0f;
+					out[8] = 1.0f;
+					break;
+				}
+				case KERNEL_RANDOM_ID:
+				{
+					break;
+				}
+			}
 		}
 
-		if (attrSize == 1)
+		if (shiftStep)
 		{
-			attrType = Partio::FLOAT;
+			const float * velocity = data->data<float>(*velocityAttr, particle);
+			for (unsigned int i=0; i < 3; ++i)
+			{
+				vertex[shiftStep->offset + i] += velocity[i] * shutterOffset;
+			}
 		}
-		else
+	}
+}
+
+
+/*
+ * The position step to move along the velocities for a motion blur sample, or
+ * NULL if the sample is on the frame or the frame has no velocities.
+ */
+        const CopyStep *
+CModoPartioGenerator::ShiftStep (
+        const Partio::ParticlesData	*frameData,
+        Partio::ParticleAttribute	&velocityAttr)
+{
+	if (shutterOffset == 0.0f || !FindAttribute(frameData, velocityNames, 3, velocityAttr) || velocityAttr.type == Partio::INT)
+	{
+		return NULL;
+	}
+	for (size_t s = 0; s < plan->steps.size(); ++s)
+	{
+		if (plan->steps[s].feature == FEATURE_POS && plan->steps[s].size == 3)
 		{
-			attrType = Partio::VECTOR;
+			return &plan->steps[s];
 		}
-
-		particleFeature_Iter->attr = Partio::ParticleAttribute(pData->addAttribute(attrName.c_str(), attrType, attrSize));	//	in Modo all of the particle features are floats
 	}
-	LxResult rc = tsrf.SetVertex(tvrt);
+	return NULL;
+}
 
 
-	particleIndex = 0;
-	
-	CLxTriSoup trisoup;
-	trisoup.partioInstance = this;
-	LXtTableauBox bbox;
-	bbox[0] = bbox[1] = bbox[2] = -1.0e30f;
-	bbox[3] = bbox[4] = bbox[5] = 1.0e30f;
-	tsrf.Sample(bbox, -1.0f, trisoup);
+/*
+ * Logs the first sample an item thins at each density. Only a sample with no
+ * pixel scale is thinned, taken to be the GL preview, so a thinned render
+ * would show up here.
+ */
+        void
+CModoPartioGenerator::NoteThinning (
+        const std::string	&item,
+        float			 density)
+{
+	static boost::mutex mutex;
+	static std::map<std::string, float> logged;
 
-	std::string writeName = fileName;
-	std::string frameString = std::to_string((_ULONGLONG)frame);
-	if (frameString.size() < padding)
+	boost::lock_guard<boost::mutex> lock(mutex);
+	std::map<std::string, float>::iterator iter = logged.find(item);
+	if (iter != logged.end() && iter->second == density)
 	{
-		writeName += paddingString.substr(0, padding - frameString.size());
+		return;
 	}
-	writeName = writeName + frameString + fileType;
-	Partio::write(writeName.c_str(), *pData, true);
-
-	pData->release();
-
-	return LXe_OK;
+	logged[item] = density;
+	CLxUser_LogService log;
+	log.DebugOut(LXi_DBLOG_NORMAL, "ModoPartio %s: sampling %.0f%% of the particles, for a preview sample with no pixel scale", item.c_str(), density * 100.0f);
 }
 
-LxResult CModoPartioInstance::pcache_Cleanup()
+
+/*
+ * Whether a particle is in the preview subset. The choice hashes the particle
+ * id, so the same particles stay visible from frame to frame; frames without
+ * ids hash the particle index instead.
+ */
+        bool
+CModoPartioGenerator::Keeps (
+        const Partio::ParticlesData	*frameData,
+        const Partio::ParticleAttribute	*idAttr,
+        int			 particle) const
 {
-	return LXe_OK;
+	if (density >= 1.0f)
+	{
+		return true;
+	}
+	unsigned id = idAttr ? ParticleId(frameData, *idAttr, particle) : (unsigned)particle;
+	return PreviewHash(id) < density;
 }
 
-void CModoPartioInstance::CalculateRotation( float * q, const float * xfrm )
+
+/*
+ * Sampling that leaves particles out, for a box that doesn't cover the frame or
+ * a preview below full density. With a grid, the cells touching the box are
+ * visited and each becomes a segment that is emitted only if the soup accepts
+ * its bounds, so buckets and region renders skip the particles they can't see.
+ * Only the particles kept are converted.
+ */
+        LxResult
+CModoPartioGenerator::SampleSubset (
+        const ParticleGrid	*grid,
+        const LXtTableauBox	 bbox,
+        ILxUnknownID		 trisoup)
 {
-	float trace = xfrm[0] + xfrm[4] + xfrm[8]; 
-	if( trace > 0 ) {
-		float s = 0.5f / sqrtf(trace+ 1.0f);
-		q[0] = 0.25f / s;
-		q[1] = ( xfrm[5] - xfrm[7] ) * s;
-		q[2] = ( xfrm[6] - xfrm[2] ) * s;
-		q[3] = ( xfrm[1] - xfrm[3] ) * s;
-	} 
-	else {
-		if ( xfrm[0] > xfrm[4] && xfrm[0] > xfrm[8] ) {
-			float s = 2.0f * sqrtf( 1.0f + xfrm[0] - xfrm[4] - xfrm[8]);
-			q[0] = (xfrm[5] - xfrm[7] ) / s;
-			q[1] = 0.25f * s;
-			q[2] = (xfrm[3] + xfrm[1] ) / s;
-			q[3] = (xfrm[6] + xfrm[2] ) / s;
-		} else if (xfrm[4] > xfrm[8]) {
-			float s = 2.0f * sqrtf( 1.0f + xfrm[4] - xfrm[0] - xfrm[8]);
-			q[0] = (xfrm[6] - xfrm[2] ) / s;
-			q[1] = (xfrm[3] + xfrm[1] ) / s;
-			q[2] = 0.25f * s;
-			q[3] = (xfrm[7] + xfrm[5] ) / s;
-		} else {
-			float s = 2.0f * sqrtf( 1.0f + xfrm[8] - xfrm[0] - xfrm[4] );
-			q[0] = (xfrm[1] - xfrm[3] ) / s;
-			q[1] = (xfrm[6] + xfrm[2] ) / s;
-			q[2] = (xfrm[7] + xfrm[5] ) / s;
-			q[3] = 0.25f * s;
+	Partio::ParticleAttribute velocityAttr;
+	const CopyStep * shiftStep = ShiftStep(data, velocityAttr);
+	float seconds = shiftStep ? shutterOffset : 0.0f;		//	cells are widened by how far their particles move
+
+	std::vector<unsigned> cells;
+	if (grid)
+	{
+		grid->Overlapping(bbox, seconds, cells);
+	}
+	else
+	{
+		cells.push_back(0);		//	one segment holding every particle
+	}
+
+	Partio::ParticleAttribute idAttr;
+	bool haveIds = FindAttribute(data, idNames, 1, idAttr);
+
+	std::vector<Partio::ParticleAttribute> stepAttrs(plan->steps.size());
+	for (size_t s = 0; s < plan->steps.size(); ++s)
+	{
+		stepAttrs[s].count = 0;
+		if (plan->steps[s].bound)
+		{
+			stepAttrs[s] = *plan->steps[s].attr;
 		}
 	}
-}
 
-void CModoPartioInstance::AddVertex(const float *vertex, unsigned int *index)
-{
-	particleIndex = pData->addParticle();
+	ScratchArena::Scope scratch;
+	vrt_vec = scratch.Alloc<float>(vrt_size);
+	for (int i = 0; i < vrt_size; i++)
+		vrt_vec[i] = 0.0f;
 
-	boost::ptr_vector<ParticleFeature>::iterator particleFeature_Iter = particleFeatures.begin();
-	for (; particleFeature_Iter != particleFeatures.end(); ++particleFeature_Iter)
+	StageTimer emit(STAGE_EMIT);		//	converted as they're emitted
+	LxResult result = LXe_OK;
+	try
 	{
-		float * pFloatData = pData->dataWrite<float>(particleFeature_Iter->attr, particleIndex);
-		if (fileType.compare(".icecache") == 0)
+		tri_soup.set (trisoup);
+
+		for (std::vector<unsigned>::const_iterator cell = cells.begin(); cell != cells.end(); ++cell)
 		{
-			if (particleFeature_Iter->attr.name.compare("Orientation") == 0)	//	convert matrix to quaternion
-			{
-				const float * xfrm = vertex + particleFeature_Iter->offset;
-				float quat[4];
-				CalculateRotation(quat, xfrm);
-				for (unsigned i=0; i < 4; ++i)
-				{
-					pFloatData[i] = quat[i];
-				}
-			} 
-			else if (particleFeature_Iter->attr.name.compare("Color") == 0)
+			unsigned first = 0, last = data->numParticles();
+			if (grid)
 			{
-				for (unsigned i=0; i < 3; ++i)
+				LXtTableauBox cellBox;
+				grid->CellBox(*cell, seconds, cellBox);
+				if (!tri_soup.TestBox(cellBox))
 				{
-					pFloatData[i] = vertex[particleFeature_Iter->offset + i];
+					continue;
 				}
-				pFloatData[3] = 1.0f;	//	Add alpha value
+				first = grid->cellStart[*cell];
+				last = grid->cellStart[*cell + 1];
 			}
-			else if (particleFeature_Iter->attr.name.compare("AngularVelocity") == 0)
+			tri_soup.Segment (*cell + 1, LXiTBLX_SEG_POINT);
+
+			for (unsigned i = first; i < last; ++i)
 			{
-				for (unsigned i=0; i < 3; ++i)
+				int p = grid ? grid->particles[i] : (int)i;
+				if (!Keeps(data, haveIds ? &idAttr : NULL, p))
 				{
-					pFloatData[i] = vertex[particleFeature_Iter->offset + i];
+					continue;
 				}
-				float vect_length = sqrtf(pFloatData[0] * pFloatData[0] + pFloatData[1] * pFloatData[1] + pFloatData[2] * pFloatData[2]);
-				pFloatData[3] = vect_length;			//		probably not the correct conversion
-			}
-			else
-			{
-				for (unsigned i=0; i < particleFeature_Iter->size; ++i)
+				FillVertex(data, stepAttrs, p, vrt_vec);
+				if (shiftStep)
 				{
-					pFloatData[i] = vertex[particleFeature_Iter->offset + i];
+					const float * velocity = data->data<float>(velocityAttr, p);
+					for (unsigned int k=0; k < 3; ++k)
+					{
+						vrt_vec[shiftStep->offset + k] += velocity[k] * shutterOffset;
+					}
 				}
+
+				LxResult rc;
+				unsigned index;
+				rc = tri_soup.Vertex  (vrt_vec, &index);
+				if (LXx_FAIL (rc))
+					throw (rc);
+
+				rc = tri_soup.Polygon (index, 0, 0);
+				if (LXx_FAIL (rc))
+					throw (rc);
+				emit.Count(1);
 			}
 		}
-		else
-		{
-			for (unsigned i=0; i < particleFeature_Iter->size; ++i)
-			{
-				pFloatData[i] = vertex[particleFeature_Iter->offset + i];
-			}
-		}
+	} catch (LxResult rc)
+	{
+		result = rc;
 	}
-	*index  = (unsigned int)particleIndex;	//	not sure this is needed
-	
-	return;
+
+	return result;
 }
 
 
 /*
- * ----------------------------------------------------------------
- * Particle Object
- *
- * The particle object can be enumerated by a client to get the data for
- * all particles. It also can preset an attributes interface to allow the
- * client to set hints, in this case the random seed.
+ * Sampling a frame too large to hold. The reader decodes a chunk of particles
+ * at a time into a buffer laid out like the schema, so the copy steps bound
+ * to the schema read it unchanged, and each chunk is emitted before the next
+ * is read. Particles outside a partial box are dropped as they pass.
  */
-CModoPartioGenerator::CModoPartioGenerator ()
+        LxResult
+CModoPartioGenerator::SampleStream (
+        ChunkReader		*reader,
+        const LXtTableauBox	 bbox,
+        ILxUnknownID		 trisoup)
 {
-	data = NULL;
-        //dyna_Add (LXsPARTICLEATTR_SEED, "integer");
-        //attr_SetInt (0, 137);
-}
+	static const int chunkSize = 65536;
 
-/*
- * Like tableau surfaces, particle sources have features. These are the
- * properties of each particle as a vector of floats. We provide the standard
- * 3 particle features: position, transform, and ID.
- */
-        unsigned int
-CModoPartioGenerator::tsrf_FeatureCount (
-        LXtID4			 type)
-{
-	boost::filesystem::path filePath(s_path);
-	if (!filePath.has_parent_path())
+	Partio::ParticlesDataMutable * chunk = Partio::create();
+	std::vector<char *> columns(schema.attributes.size());
+	for (size_t i = 0; i < schema.attributes.size(); ++i)
 	{
-		return 0;
+		const Partio::ParticleAttribute & attr = schema.attributes[i];
+		chunk->addAttribute(attr.name.c_str(), attr.type, attr.count);		//	same order, so the attribute indices match the schema
+	}
+	chunk->addParticles(std::min(chunkSize, schema.numParticles));
+	for (size_t i = 0; i < columns.size(); ++i)
+	{
+		columns[i] = (char *)chunk->dataWrite<float>(schema.attributes[i], 0);
 	}
-	boost::filesystem::path fileParentPath = filePath.parent_path();
-
-	fileType = filePath.extension().string();
-	std::string fileStem = filePath.stem().string();
-	size_t numbers = fileStem.find_last_not_of("#1234567890");
 
-	boost::filesystem::path cacheFilePath;
+	Partio::ParticleAttribute idAttr, positionAttr;
+	bool haveIds = FindAttribute(chunk, idNames, 1, idAttr);
+	schema.Find("position", positionAttr);
+	bool partial = bbox[0] > -1.0e29f || bbox[1] > -1.0e29f || bbox[2] > -1.0e29f || bbox[3] < 1.0e29f || bbox[4] < 1.0e29f || bbox[5] < 1.0e29f;
 
-	std::string filterString = fileStem.substr(0, numbers + 1) + "0*" + std::to_string((_ULONGLONG)frame) + fileType;
-	boost::regex cacheFileFilter(filterString.c_str());
-	boost::filesystem::directory_iterator end_iter; // Default ctor yields past-the-end
-	boost::smatch m;
-	for (boost::filesystem::directory_iterator iter(fileParentPath); iter != end_iter; ++iter)
+	std::vector<Partio::ParticleAttribute> stepAttrs(plan->steps.size());
+	for (size_t s = 0; s < plan->steps.size(); ++s)
 	{
-		if (!boost::filesystem::is_regular_file(iter->status()))
-		{
-			continue;
-		}
-		if (boost::regex_match(iter->path().filename().string(), m, cacheFileFilter))
+		stepAttrs[s].count = 0;
+		if (plan->steps[s].bound)
 		{
-			cacheFilePath = iter->path();
-			break;
+			stepAttrs[s] = *plan->steps[s].attr;
 		}
 	}
-	if (cacheFilePath.empty())
-	{
-		return 0;
-	}
-
-	boost::algorithm::to_lower(fileType);	//	Partio readers expect lower case
-	cacheFilePath.replace_extension(boost::filesystem::path(fileType));
+	Partio::ParticleAttribute velocityAttr;
+	const CopyStep * shiftStep = ShiftStep(chunk, velocityAttr);
 
-	conversion.SetFormat(fileType);
+	ScratchArena::Scope scratch;
+	vrt_vec = scratch.Alloc<float>(vrt_size);
+	for (int i = 0; i < vrt_size; i++)
+		vrt_vec[i] = 0.0f;
 
-	data = Partio::readCached(cacheFilePath.string().c_str(), false);
-	if (!data)
+	LxResult result = LXe_OK;
+	try
 	{
-		return 0;
-	}
-
-	int attribCount = data->numAttributes();
-	particleAttributeNames.clear();
-	Partio::ParticleAttribute attr;
+		tri_soup.set (trisoup);
+		tri_soup.Segment (1, LXiTBLX_SEG_POINT);
 
-	if (!data->attributeInfo("position",attr) || attr.type != Partio::VECTOR || attr.count != 3) 
-	{
-		return 0;							//	always need particle position data
-	}
-	particleAttributeNames.push_back(LXsTBLX_PARTICLE_POS);
-	for (int i=0; i < attribCount; ++i)
-	{
-		data->attributeInfo(i, attr);
-		if (attr.name != "position")
+		int first = 0, count;
+		for (;;)
 		{
-			if (modoParticleFeaturesSet.find(attr.name) != modoParticleFeaturesSet.end())
 			{
-				particleAttributeNames.push_back(attr.name);	//	if attribute has same name as a standard modo particle feature use it
+				StageTimer decode(STAGE_DECODE);
+				count = reader->Read(columns, chunkSize);
+				decode.Count(std::max(count, 0), (unsigned long long)std::max(count, 0) * schema.Bytes() / std::max(schema.numParticles, 1));
 			}
-			else if(fileType == ".icecache" || fileType == ".bin")
+			if (count <= 0)
 			{
-				ConversionBimap::right_const_iterator conversionIter = conversion.bimap.right.find(attr.name);
-				if (conversionIter != conversion.bimap.right.end())
+				break;
+			}
+			StageTimer emit(STAGE_EMIT);		//	converted as they're emitted
+
+			for (int p = 0; p < count; ++p)
+			{
+				if (!Keeps(chunk, haveIds ? &idAttr : NULL, haveIds ? p : first + p))
+				{
+					continue;
+				}
+				if (partial)
+				{
+					const float * position = chunk->data<float>(positionAttr, p);
+					if (position[0] < bbox[0] || position[1] < bbox[1] || position[2] < bbox[2] || position[0] > bbox[3] || position[1] > bbox[4] || position[2] > bbox[5])
+					{
+						continue;
+					}
+				}
+				FillVertex(chunk, stepAttrs, p, vrt_vec);
+				if (shiftStep)
 				{
-					particleAttributeNames.push_back(conversionIter->second);	//	conversion available
-				} 
+					const float * velocity = chunk->data<float>(velocityAttr, p);
+					for (unsigned int k=0; k < 3; ++k)
+					{
+						vrt_vec[shiftStep->offset + k] += velocity[k] * shutterOffset;
+					}
+				}
+
+				LxResult rc;
+				unsigned index;
+				rc = tri_soup.Vertex  (vrt_vec, &index);
+				if (LXx_FAIL (rc))
+					throw (rc);
+
+				rc = tri_soup.Polygon (index, 0, 0);
+				if (LXx_FAIL (rc))
+					throw (rc);
+				emit.Count(1);
 			}
+			first += count;
 		}
-	}
-
-	if (std::find(particleAttributeNames.begin(), particleAttributeNames.end(), LXsTBLX_PARTICLE_ID) == particleAttributeNames.end())
-	{
-		particleAttributeNames.push_back(LXsTBLX_PARTICLE_ID);					//	always set particle id
-	}
-	if (std::find(particleAttributeNames.begin(), particleAttributeNames.end(), LXsTBLX_PARTICLE_XFRM) == particleAttributeNames.end())
+		if (count < 0)
+		{
+			CLxUser_LogService log;
+			log.DebugOut(LXi_DBLOG_ERROR, "ModoPartio: %s ended early after %d particles", cacheFileName.c_str(), first);
+		}
+	} catch (LxResult rc)
 	{
-		particleAttributeNames.push_back(LXsTBLX_PARTICLE_XFRM);							//	always set particle xfrm
+		result = rc;
 	}
 
-    return (type == LXiTBLX_PARTICLES ? (unsigned int)particleAttributeNames.size() : 0);
-}
-
-        LxResult
-CModoPartioGenerator::tsrf_FeatureByIndex (
-        LXtID4			 type,
-        unsigned int		 index,
-        const char	       **name)
-{
-        if (type != LXiTBLX_PARTICLES || index > (unsigned int)(particleAttributeNames.size()))
-                return LXe_OUTOFBOUNDS;
-
-		name[0] = particleAttributeNames[index].c_str();
+	chunk->release();
 
-        return LXe_OK;
+	return result;
 }
 
 
 /*
- * Given a tableau vertex allocated by the client, we need to determine the
- * features they want and their offsets into the vertex vector.
+ * Fill a vertex from one particle of either frame by random access, as the
+ * particles of the next frame are reached through the id join rather than
+ * in order. stepAttrs holds the attribute of each copy step in frameData, with
+ * a count of zero where the frame has none.
  */
-        LxResult
-CModoPartioGenerator::tsrf_SetVertex (
-        ILxUnknownID		 vdesc)
+        void
+CModoPartioGenerator::FillVertex (
+        const Partio::ParticlesData	*frameData,
+        const std::vector<Partio::ParticleAttribute> & stepAttrs,
+        int			 particle,
+        float			*vertex)
 {
-    CLxUser_TableauVertex	 vrx (vdesc);
-
-
-    vrt_size = vrx.Size ();
-    if (vrt_size == 0)
-            return LXe_OK;
-
-    unsigned		 offset;
-	const char * featureName;		//	name of modo particle feature
-	std::string attrName;			//	Partio attribute name
-	Partio::ParticleAttribute partioAttr;
-	LXtID4 type;
-	unsigned int featureCount = vrx.Count();
-	particleFeatures.clear();
-	for (unsigned int i=0; i < featureCount; ++i)
+	for (size_t s = 0; s < plan->steps.size(); ++s)
 	{
-		vrx.ByIndex(i, &type, &featureName, &offset);
+		const CopyStep & step = plan->steps[s];
+		const Partio::ParticleAttribute & attr = stepAttrs[s];
+		float * out = vertex + step.offset;
 
-		attrName = featureName;
-		if (attrName == LXsTBLX_PARTICLE_POS)
+		if (step.kernel == KERNEL_RANDOM_ID)
 		{
-			attrName = "position";
+			out[0] = rand_seq.uniform ();
 		}
-		else if (fileType == ".icecache" || fileType == ".bin")
+		else if (step.kernel == KERNEL_IDENTITY_XFRM || (step.feature == FEATURE_XFRM && attr.count == 0))
 		{
-			ConversionBimap::left_const_iterator conversionIter = conversion.bimap.left.find(std::string(featureName));
-			if (conversionIter != conversion.bimap.left.end())
+			for (unsigned i = 0; i < 9; ++i)
 			{
-				attrName = conversionIter->second;
-			} 
-			else
+				out[i] = (i % 4 == 0) ? 1.0f : 0.0f;
+			}
+		}
+		else if (attr.count == 0)
+		{
+			for (unsigned i = 0; i < step.size; ++i)
 			{
-				attrName = featureName;
+				out[i] = 0.0f;
 			}
 		}
-
-
-		if(data && data->attributeInfo(attrName.c_str(), partioAttr))		//	when feeding into a particle modifier, the modifier node still asks for data even after we tell it we have zero particle features, so check for data here
+		else if (step.kernel == KERNEL_QUAT_XFRM)
+		{
+			QuatToMatrixScalar(frameData->data<float>(attr, particle), attr.count, 1, out, 1);
+		}
+		else if (step.kernel == KERNEL_INT)
 		{
-			particleFeatures.push_back(new ParticleFeature(featureName, offset, 0, partioAttr, new Partio::ParticleAccessor(partioAttr)));
+			const int * featureData = frameData->data<int>(attr, particle);
+			for (unsigned i = 0; i < step.size; ++i)
+			{
+				out[i] = (float)featureData[i];
+			}
 		}
 		else
 		{
-			particleFeatures.push_back(new ParticleFeature(featureName, offset, 0));
+			const float * featureData = frameData->data<float>(attr, particle);
+			for (unsigned i = 0; i < step.size; ++i)
+			{
+				out[i] = featureData[i];
+			}
 		}
 	}
+}
 
-	Compare cmp;
-	particleFeatures.sort(cmp);	//	sorting probably not necessary since features already seem to be in this order
 
-	int prev_offset = vrt_size;
-	boost::ptr_vector<ParticleFeature>::reverse_iterator particleFeatures_Iter = particleFeatures.rbegin();	//	calculate size of features (# floats)
-	for (; particleFeatures_Iter != particleFeatures.rend(); ++particleFeatures_Iter)
+/*
+ * Where SampleInterpolated emits a particle of either frame, worked out from
+ * the positions alone so the cells can be bounded before anything is
+ * converted. velocityAttr is NULL when the frames have no velocities.
+ */
+        void
+CModoPartioGenerator::BlendedPosition (
+        const Partio::ParticlesData * const frames[2],
+        const Partio::ParticleAttribute positionAttr[2],
+        const Partio::ParticleAttribute *velocityAttr,
+        int			 frame,
+        int			 particle,
+        float			*position) const
+{
+	float alpha = subFrame, dt = matchTime;
+	const float * a = frames[frame]->data<float>(positionAttr[frame], particle);
+	int next = (frame == 0) ? match[particle] : -1;
+	if (next >= 0 && velocityAttr && dt > 0.0f)
 	{
-		int checkOffset = particleFeatures_Iter->offset;
-		int checkCount = particleFeatures_Iter->attr.count;
-		if (particleFeatures_Iter->pacc)
+		const float * b = frames[1]->data<float>(positionAttr[1], next);
+		const float * v0 = frames[0]->data<float>(velocityAttr[0], particle);
+		const float * v1 = frames[1]->data<float>(velocityAttr[1], next);
+		float t = alpha, t2 = t * t, t3 = t2 * t;
+		float h00 = 2.0f * t3 - 3.0f * t2 + 1.0f, h10 = t3 - 2.0f * t2 + t, h01 = -2.0f * t3 + 3.0f * t2, h11 = t3 - t2;
+		for (int i = 0; i < 3; ++i)
 		{
-			particleFeatures_Iter->size = std::min((int)(prev_offset - particleFeatures_Iter->offset), particleFeatures_Iter->attr.count);	//	make sure not trying to read more data than present in Partio
-		} 
-		else
+			position[i] = h00 * a[i] + h10 * dt * v0[i] + h01 * b[i] + h11 * dt * v1[i];
+		}
+	}
+	else if (next >= 0)
+	{
+		const float * b = frames[1]->data<float>(positionAttr[1], next);
+		for (int i = 0; i < 3; ++i)
 		{
-			particleFeatures_Iter->size = 0;
+			position[i] = a[i] + alpha * (b[i] - a[i]);
+		}
+	}
+	else
+	{
+		const float * v = (velocityAttr && dt > 0.0f) ? frames[frame]->data<float>(velocityAttr[frame], particle) : NULL;
+		float offset = (frame == 0) ? alpha * dt : (alpha - 1.0f) * dt;
+		for (int i = 0; i < 3; ++i)
+		{
+			position[i] = v ? a[i] + v[i] * offset : a[i];
 		}
-		prev_offset = particleFeatures_Iter->offset;
 	}
-
-    return LXe_OK;
 }
 
 
 /*
- * Sampling walks the particles.
+ * Sampling between two cached frames. Particles of the next frame are found by
+ * id through a hash index, or by index when the frames have no ids and the
+ * counts agree. Matched particles blend: positions follow a Hermite curve when
+ * both frames have velocities, rotations are interpolated as quaternions, ids
+ * and other integer features come from the first frame, and everything else is
+ * linear. Particles that die before the next frame carry on along their
+ * velocity, and particles born before it are placed back along theirs, so
+ * neither pops. The time between the frames in the units of the velocities is
+ * fitted from the matched particles, so no frame rate is needed. Particles are
+ * emitted a grid cell at a time, each cell bounded by where its particles end
+ * up, so buckets and partial boxes skip the cells they can't see.
  */
         LxResult
-CModoPartioGenerator::tsrf_Sample (
+CModoPartioGenerator::SampleInterpolated (
         const LXtTableauBox	 bbox,
-        float			 scale,
         ILxUnknownID		 trisoup)
 {
-        int			 i;
-        LxResult		 result;
+	const Partio::ParticlesData * frames[2] = {data, nextData};
+	int numParticles[2] = {data->numParticles(), nextData->numParticles()};
+	float alpha = subFrame;
 
-		if (!data)
+	std::vector<Partio::ParticleAttribute> stepAttrs[2];		//	attribute of each copy step in each frame
+	for (int f = 0; f < 2; ++f)
+	{
+		stepAttrs[f].resize(plan->steps.size());
+		for (size_t s = 0; s < plan->steps.size(); ++s)
 		{
-			return LXe_OK;	//	when feeding into a particle modifier, the modifier node still asks for data even after we tell it we have zero particle features, so check for data here
+			Partio::ParticleAttribute & attr = stepAttrs[f][s];
+			attr.count = 0;
+			const CopyStep & step = plan->steps[s];
+			if (step.attr && step.bound && (!frames[f]->attributeInfo(step.attr->name.c_str(), attr) || attr.type != step.attr->type || attr.count != step.attr->count))
+			{
+				attr.count = 0;
+			}
 		}
+	}
 
-        /*
-         * Allocate the vertex vector and init to zeros. We only need one
-         * since points are sampled sequentially.
-         */
-        vrt_vec = new float[vrt_size];
-        if (!vrt_vec)
-                return LXe_OUTOFMEMORY;
-
-        for (i = 0; i < vrt_size; i++)
-                vrt_vec[i] = 0.0f;
-
+	Partio::ParticleAttribute positionAttr[2], velocityAttr[2], idAttr[2];
+	bool havePositions = true, haveVelocity = true, haveIds = true;
+	for (int f = 0; f < 2; ++f)
+	{
+		havePositions = frames[f]->attributeInfo("position", positionAttr[f]) && positionAttr[f].type == Partio::VECTOR && positionAttr[f].count == 3 && havePositions;
+		haveVelocity = FindAttribute(frames[f], velocityNames, 3, velocityAttr[f]) && velocityAttr[f].type != Partio::INT && haveVelocity;
+		haveIds = FindAttribute(frames[f], idNames, 1, idAttr[f]) && haveIds;
+	}
+	if (!havePositions)
+	{
+		return LXe_OK;
+	}
 
-        result = LXe_OK;
-        try 
+	boost::shared_ptr<const ParticleGrid> grids[2] = {FrameCache::Get().Grid(frames[0]), FrameCache::Get().Grid(frames[1])};
+	if (!matchReady)		//	once per evaluation, the other buckets reuse it
+	{
+		match.assign(numParticles[0], -1);
+		matched.assign(numParticles[1], false);
+		if (haveIds)
+		{
+			boost::unordered_map<unsigned, int> nextById(numParticles[1]);
+			for (int p = 0; p < numParticles[1]; ++p)
+			{
+				nextById[ParticleId(frames[1], idAttr[1], p)] = p;
+			}
+			for (int p = 0; p < numParticles[0]; ++p)
+			{
+				boost::unordered_map<unsigned, int>::const_iterator found = nextById.find(ParticleId(frames[0], idAttr[0], p));
+				if (found != nextById.end() && !matched[found->second])
+				{
+					match[p] = found->second;
+					matched[found->second] = true;
+				}
+			}
+		}
+		else if (numParticles[0] == numParticles[1])
 		{
-            /*
-             * Init the triangle soup.
-             */
-            tri_soup.set (trisoup);
-            tri_soup.Segment (1, LXiTBLX_SEG_POINT);
+			for (int p = 0; p < numParticles[0]; ++p)
+			{
+				match[p] = p;
+				matched[p] = true;
+			}
+		}
 
-			Partio::ParticlesData::const_iterator data_iter = data->begin();
+		matchTime = 0.0f;		//	least squares fit of displacement = dt * mean velocity
+		if (haveVelocity)
+		{
+			double num = 0.0, den = 0.0;
+			for (int p = 0; p < numParticles[0]; ++p)
+			{
+				if (match[p] < 0)
+				{
+					continue;
+				}
+				const float * p0 = frames[0]->data<float>(positionAttr[0], p);
+				const float * p1 = frames[1]->data<float>(positionAttr[1], match[p]);
+				const float * v0 = frames[0]->data<float>(velocityAttr[0], p);
+				const float * v1 = frames[1]->data<float>(velocityAttr[1], match[p]);
+				for (int i = 0; i < 3; ++i)
+				{
+					double v = 0.5 * (v0[i] + v1[i]);
+					num += (p1[i] - p0[i]) * v;
+					den += v * v;
+				}
+			}
+			matchTime = (den > 0.0 && num > 0.0) ? (float)(num / den) : 0.0f;
+		}
 
-			boost::ptr_vector<ParticleFeature>::const_iterator particleFeature_Iter = particleFeatures.cbegin();
-			for (; particleFeature_Iter != particleFeatures.cend(); ++particleFeature_Iter)
-			{	
-				if (particleFeature_Iter->pacc)
+		for (int f = 0; f < 2; ++f)		//	particles are emitted away from their cells, so each cell gets the bounds of where its particles end up
+		{
+			const ParticleGrid & grid = *grids[f];
+			cellBounds[f].resize(grid.Cells() * 6);
+			for (unsigned c = 0; c < grid.Cells(); ++c)
+			{
+				float * box = &cellBounds[f][c * 6];
+				box[0] = box[1] = box[2] = 1.0e30f;
+				box[3] = box[4] = box[5] = -1.0e30f;
+				for (unsigned i = grid.cellStart[c]; i < grid.cellStart[c + 1]; ++i)
 				{
-					data_iter.addAccessor(*particleFeature_Iter->pacc);
+					int p = grid.particles[i];
+					if (f == 1 && matched[p])
+					{
+						continue;
+					}
+					float position[3];
+					BlendedPosition(frames, positionAttr, haveVelocity ? velocityAttr : NULL, f, p, position);
+					for (int k = 0; k < 3; ++k)
+					{
+						box[k] = std::min(box[k], position[k]);
+						box[k + 3] = std::max(box[k + 3], position[k]);
+					}
 				}
 			}
+		}
+		matchReady = true;
+	}
+	float dt = matchTime;
+
+	const CopyStep * positionStep = NULL;
+	for (size_t s = 0; s < plan->steps.size(); ++s)
+	{
+		if (plan->steps[s].feature == FEATURE_POS && plan->steps[s].size == 3)
+		{
+			positionStep = &plan->steps[s];
+		}
+	}
+
+	bool partial = bbox[0] > -1.0e29f || bbox[1] > -1.0e29f || bbox[2] > -1.0e29f || bbox[3] < 1.0e29f || bbox[4] < 1.0e29f || bbox[5] < 1.0e29f;
 
-			for (; data_iter != data->end(); ++data_iter)
+	ScratchArena::Scope scratch;
+	vrt_vec = scratch.Alloc<float>(vrt_size);
+	float * nextVertex = scratch.Alloc<float>(vrt_size);
+	for (int i = 0; i < vrt_size; i++)
+		vrt_vec[i] = nextVertex[i] = 0.0f;
+
+	StageTimer emit(STAGE_EMIT);		//	converted as they're emitted
+	LxResult result = LXe_OK;
+	try
+	{
+		tri_soup.set (trisoup);
+
+		for (int f = 0; f < 2; ++f)
+		{
+			const ParticleGrid & grid = *grids[f];
+			for (unsigned c = 0; c < grid.Cells(); ++c)
 			{
-				particleFeature_Iter = particleFeatures.cbegin();
-				for (; particleFeature_Iter != particleFeatures.cend(); ++particleFeature_Iter)
+				const float * box = &cellBounds[f][c * 6];
+				if (box[0] > box[3] || (partial && (box[0] > bbox[3] || box[1] > bbox[4] || box[2] > bbox[5] || box[3] < bbox[0] || box[4] < bbox[1] || box[5] < bbox[2])) || !tri_soup.TestBox(box))
 				{
-					if (particleFeature_Iter->offset >= 0)
+					continue;
+				}
+				bool inside = !partial || (box[0] >= bbox[0] && box[1] >= bbox[1] && box[2] >= bbox[2] && box[3] <= bbox[3] && box[4] <= bbox[4] && box[5] <= bbox[5]);
+				tri_soup.Segment (f * grids[0]->Cells() + c + 1, LXiTBLX_SEG_POINT);
+
+				for (unsigned entry = grid.cellStart[c]; entry < grid.cellStart[c + 1]; ++entry)
+				{
+					int p = grid.particles[entry];
+					if ((f == 1 && matched[p]) || !Keeps(frames[f], haveIds ? &idAttr[f] : NULL, p))
+					{
+						continue;
+					}
+					FillVertex(frames[f], stepAttrs[f], p, vrt_vec);
+
+					if (f == 0 && match[p] >= 0)
 					{
-						if( particleFeature_Iter->pacc != NULL)
+						FillVertex(frames[1], stepAttrs[1], match[p], nextVertex);
+						for (size_t s = 0; s < plan->steps.size(); ++s)
 						{
-							if (particleFeature_Iter->attr.type == Partio::FLOAT || particleFeature_Iter->attr.type == Partio::VECTOR)
+							const CopyStep & step = plan->steps[s];
+							float * a = vrt_vec + step.offset;
+							const float * b = &nextVertex[step.offset];
+							if (stepAttrs[1][s].count == 0 || step.kernel == KERNEL_INT || step.kernel == KERNEL_RANDOM_ID || step.feature == FEATURE_ID || step.feature == FEATURE_ITEM)
+							{
+								continue;
+							}
+							if (&step == positionStep && dt > 0.0f)		//	cubic Hermite through both positions with the cached velocities as tangents
 							{
-								float * featureData = particleFeature_Iter->pacc->raw<float, Partio::ParticlesData::const_iterator>(data_iter);
-								if (fileType == ".icecache" && particleFeature_Iter->name == LXsTBLX_PARTICLE_XFRM)
+								const float * v0 = frames[0]->data<float>(velocityAttr[0], p);
+								const float * v1 = frames[1]->data<float>(velocityAttr[1], match[p]);
+								float t = alpha, t2 = t * t, t3 = t2 * t;
+								float h00 = 2.0f * t3 - 3.0f * t2 + 1.0f, h10 = t3 - 2.0f * t2 + t, h01 = -2.0f * t3 + 3.0f * t2, h11 = t3 - t2;
+								for (int i = 0; i < 3; ++i)
 								{
-									float magnitude = sqrtf(featureData[0] * featureData[0] + featureData[1] * featureData[1] + featureData[2] * featureData[2] + featureData[3] * featureData[3]);
-									for (int i=0; i < 4; ++i)
-									{
-										featureData[i] = featureData[i] / magnitude;
-									}
-									vrt_vec[particleFeature_Iter->offset + 0] = 1.0f - 2.0f * featureData[2] * featureData[2] - 2.0f * featureData[3] * featureData[3];	//	convert from icecache quaternion to rotation matrix
-									vrt_vec[particleFeature_Iter->offset + 1] = 2.0f * featureData[1] * featureData[2] + 2.0f * featureData[3] * featureData[0];
-									vrt_vec[particleFeature_Iter->offset + 2] = 2.0f * featureData[1] * featureData[3] - 2.0f * featureData[2] * featureData[0];
-									vrt_vec[particleFeature_Iter->offset + 3] = 2.0f * featureData[1] * featureData[2] - 2.0f * featureData[3] * featureData[0];
-									vrt_vec[particleFeature_Iter->offset + 4] = 1.0f - 2.0f * featureData[1] * featureData[1] - 2.0f * featureData[3] * featureData[3];
-									vrt_vec[particleFeature_Iter->offset + 5] = 2.0f * featureData[2] * featureData[3] + 2.0f * featureData[1] * featureData[0];
-									vrt_vec[particleFeature_Iter->offset + 6] = 2.0f * featureData[1] * featureData[3] + 2.0f * featureData[2] * featureData[0];
-									vrt_vec[particleFeature_Iter->offset + 7] = 2.0f * featureData[2] * featureData[3] - 2.0f * featureData[1] * featureData[0];
-									vrt_vec[particleFeature_Iter->offset + 8] = 1.0f - 2.0f * featureData[1] * featureData[1] - 2.0f * featureData[2] * featureData[2];
+									a[i] = h00 * a[i] + h10 * dt * v0[i] + h01 * b[i] + h11 * dt * v1[i];
 								}
-								else
+							}
+							else if (step.feature == FEATURE_XFRM && step.size == 9)
+							{
+								float q0[4], q1[4], q[4];
+								ExportMatrixToQuatScalar(a, 0, 1, q0, 0);
+								ExportMatrixToQuatScalar(b, 0, 1, q1, 0);
+								float sign = (q0[0] * q1[0] + q0[1] * q1[1] + q0[2] * q1[2] + q0[3] * q1[3] < 0.0f) ? -1.0f : 1.0f;	//	take the short way round
+								for (int i = 0; i < 4; ++i)
 								{
-									if (particleFeature_Iter->name == LXsTBLX_PARTICLE_XFRM && particleFeature_Iter->size != 9)
-									{
-										{
-											vrt_vec[particleFeature_Iter->offset + 0] = 1.0f;		//	set identity rotation if we don't have the right number of matrix elements
-											vrt_vec[particleFeature_Iter->offset + 4] = 1.0f;
-											vrt_vec[particleFeature_Iter->offset + 8] = 1.0f;
-										}
-									}
-									else
-									{
-										for (unsigned int i=0; i < particleFeature_Iter->size; ++i)
-										{
-											vrt_vec[particleFeature_Iter->offset + i] = featureData[i];
-										}
-									}
+									q[i] = (1.0f - alpha) * q0[i] + alpha * sign * q1[i];
 								}
+								QuatToMatrixScalar(q, 4, 1, a, 1);		//	normalizes
 							}
-							else if (particleFeature_Iter->attr.type == Partio::INT)
+							else
 							{
-								int * featureData = particleFeature_Iter->pacc->raw<int, Partio::ParticlesData::const_iterator>(data_iter);
-								for (unsigned int i=0; i < particleFeature_Iter->size; ++i)
+								for (unsigned i = 0; i < step.size; ++i)
 								{
-									vrt_vec[particleFeature_Iter->offset + i] = (float)featureData[i];
+									a[i] += alpha * (b[i] - a[i]);
 								}
 							}
 						}
-						else		//	pacc == NULL so no imported data
+					}
+					else if (positionStep && haveVelocity && dt > 0.0f)		//	died before the next frame or born after this one
+					{
+						const float * v = frames[f]->data<float>(velocityAttr[f], p);
+						float offset = (f == 0) ? alpha * dt : (alpha - 1.0f) * dt;
+						for (int i = 0; i < 3; ++i)
 						{
-							if (particleFeature_Iter->name == LXsTBLX_PARTICLE_ID)		
-							{
-								vrt_vec[particleFeature_Iter->offset] = rand_seq.uniform ();	//	use random values for particle id
-							}
-							else if (particleFeature_Iter->name == LXsTBLX_PARTICLE_XFRM)
-							{
-								vrt_vec[particleFeature_Iter->offset + 0] = 1.0f;		//	set identity rotation
-								vrt_vec[particleFeature_Iter->offset + 4] = 1.0f;
-								vrt_vec[particleFeature_Iter->offset + 8] = 1.0f;
-							}
+							vrt_vec[positionStep->offset + i] += v[i] * offset;
+						}
+					}
+					if (!inside && positionStep)
+					{
+						const float * position = vrt_vec + positionStep->offset;
+						if (position[0] < bbox[0] || position[1] < bbox[1] || position[2] < bbox[2] || position[0] > bbox[3] || position[1] > bbox[4] || position[2] > bbox[5])
+						{
+							continue;
 						}
 					}
-				}
 
-				LxResult rc;
-				unsigned index;
-				rc = tri_soup.Vertex  (vrt_vec, &index);
-				if (LXx_FAIL (rc))
-					throw (rc);
+					LxResult rc;
+					unsigned index;
+					rc = tri_soup.Vertex  (vrt_vec, &index);
+					if (LXx_FAIL (rc))
+						throw (rc);
 
-				rc = tri_soup.Polygon (index, 0, 0);
-				if (LXx_FAIL (rc))
-					throw (rc);
+					rc = tri_soup.Polygon (index, 0, 0);
+					if (LXx_FAIL (rc))
+						throw (rc);
+					emit.Count(1);
+				}
 			}
+		}
+	} catch (LxResult rc)
+	{
+		result = rc;
+	}
 
-			data->release();
-
-
-        } catch (LxResult rc) 
-		{
-                result = rc;
-        }
-
-        delete [] vrt_vec;
-
-        return result;
+	return result;
 }
 
 
@@ -1358,6 +6935,12 @@ initialize ()
         CModoPartioPackage   :: initialize ();
         CModoPartioGenerator :: initialize ();
         CModoPartioInstance  :: initialize ();
+
+        CLxUser_LogService log;
+        log.DebugOut(LXi_DBLOG_NORMAL, "ModoPartio: frame cache %d MB (%s), write queue %d MB (%s), streamed reads above %d MB (%s)",
+                BudgetMegabytes(BUDGET_CACHE), budgetVariables[BUDGET_CACHE],
+                BudgetMegabytes(BUDGET_WRITE_QUEUE), budgetVariables[BUDGET_WRITE_QUEUE],
+                BudgetMegabytes(BUDGET_STREAM), budgetVariables[BUDGET_STREAM]);
 }
 
 
@@ -16,6 +16,7 @@ def SelectFile():
     else:                       #   reading cache
         lx.command( 'dialog.setup',   style = 'fileOpen' )
     lx.command( 'dialog.title', title='Select Cache File' )
+    lx.command( 'dialog.fileTypeCustom', format='mpc', username='ModoPartio Native', loadPattern="*.mpc", saveExtension="mpc" )
     lx.command( 'dialog.fileTypeCustom', format='icecache', username='Softimage ICECACHE', loadPattern="*.icecache;", saveExtension="icecache" )
     lx.command( 'dialog.fileTypeCustom', format='bin', username='Realflow BIN', loadPattern="*.bin", saveExtension="bin" )
     lx.command( 'dialog.fileTypeCustom', format='prt', username='Krakatoa PRT', loadPattern="*.prt", saveExtension="prt" )
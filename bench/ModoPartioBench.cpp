@@ -0,0 +1,481 @@
+/*
+ * ModoPartioBench.cpp	Read and write throughput of ModoPartio outside Modo
+ *
+ *	Builds ModoPartio.cpp unchanged against the mock SDK in bench/mock, and
+ *	drives the plug-in through the same calls Modo makes. The write path bakes
+ *	a synthetic particle surface through pcache_Initialize, pcache_SaveFrame
+ *	and pcache_Cleanup, so every vertex goes through AddVertex and the frame
+ *	writer. The read path evaluates the item with prti_Evaluate and samples the
+ *	cache back through tsrf_FeatureCount, tsrf_SetVertex and tsrf_Sample into
+ *	a soup that only counts.
+ *
+ *	    ModoPartioBench [-o dir] [-f mpc,prt,...] [-n 1000,100000,...] [-r frames] [-c] [-k]
+ *	                    [-d interval] [-s snap|interpolate|velocity] [-b]
+ *
+ *	-c bakes with the compact export precision, at the default tolerances.
+ *	-d bakes .mpc deltas with a full frame every interval frames.
+ *	-s reads between the baked frames: halfway, joining particles by id, or a
+ *	quarter frame along the velocities.
+ *	-b samples one octant of the particles instead of all of them, in 4x4x4
+ *	buckets, so the read goes through the culling grid.
+ *
+ *	The particles keep their ids, sizes and colors from frame to frame and move
+ *	along their velocities, so each read can be checked against where they
+ *	should be.
+ *
+ *	Each format and particle count runs in its own process, so the peak RSS
+ *	reported is that case's alone. Files are read back straight after they are
+ *	written, so reads usually come from the OS page cache.
+ */
+#include "../ModoPartio.cpp"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+
+static double Now()
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1.0e-9;
+}
+
+static std::vector<std::string> SplitList(const std::string & list)
+{
+	std::vector<std::string> items;
+	boost::algorithm::split(items, list, boost::algorithm::is_any_of(","), boost::algorithm::token_compress_on);
+	return items;
+}
+
+
+static void BucketBox(const LXtTableauBox box, unsigned buckets, unsigned bucket, LXtTableauBox out)		//	bucket of box split buckets times along each axis
+{
+	unsigned index[3] = {bucket % buckets, (bucket / buckets) % buckets, bucket / (buckets * buckets)};
+	for (int i = 0; i < 3; ++i)
+	{
+		float width = (box[i + 3] - box[i]) / buckets;
+		out[i] = box[i] + index[i] * width;
+		out[i + 3] = (index[i] + 1 == buckets) ? box[i + 3] : out[i] + width;
+	}
+}
+
+static float BenchId(unsigned p)		//	in [0,1) like Modo's ids, and distinct for the first 2^24 particles
+{
+	unsigned h = (p * 0x9e3779b1u) & 0xffffff;
+	h ^= h >> 12;
+	h = (h * 0x2c1b3c6du) & 0xffffff;
+	return h * (1.0f / 16777216.0f);
+}
+
+
+/*
+ * A particle source with position, id, velocity, size and color, standing in
+ * for a Modo particle simulation.
+ */
+class BenchSurface : public CLxImpl_TableauSurface
+{
+public:
+	unsigned count;
+	double time;		//	seconds
+
+	BenchSurface(unsigned count) : count(count), time(0.0), size(0)
+	{}
+
+	static void Particle(CLxPseudoRandom & rand, unsigned p, double time, float values[11])		//	position, id, velocity, size, color
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			values[i] = rand.uniform() * 20.0f - 10.0f;
+		}
+		for (int i = 4; i < 7; ++i)
+		{
+			values[i] = (rand.uniform() - 0.5f) * 96.0f;		//	up to two units a frame, so a motion blur sample crosses cells
+			values[i - 4] += (float)(values[i] * time);
+		}
+		values[3] = BenchId(p);
+		values[7] = 0.05f + rand.uniform() * 0.1f;
+		for (int i = 8; i < 11; ++i)
+		{
+			values[i] = rand.uniform();
+		}
+	}
+
+	void Expect(double at, const LXtTableauBox box, unsigned buckets, float margin, unsigned & lower, unsigned & upper) const		//	particles surely inside a bucket, and times any are near one
+	{
+		CLxPseudoRandom rand;
+		rand.seed(1);
+		lower = upper = 0;
+		for (unsigned p = 0; p < count; ++p)
+		{
+			float values[11];
+			Particle(rand, p, at, values);
+			bool inside = true;
+			unsigned near = 1;
+			for (unsigned i = 0, stride = 1; i < 3; ++i, stride *= buckets)
+			{
+				bool insideAxis = false;
+				unsigned nearAxis = 0;
+				for (unsigned b = 0; b < buckets; ++b)
+				{
+					LXtTableauBox bucketBox;
+					BucketBox(box, buckets, b * stride, bucketBox);		//	the b'th along this axis
+					insideAxis = insideAxis || (values[i] >= bucketBox[i] + margin && values[i] <= bucketBox[i + 3] - margin);
+					nearAxis += (values[i] >= bucketBox[i] - 2.0f * margin && values[i] <= bucketBox[i + 3] + 2.0f * margin) ? 1 : 0;
+				}
+				inside = inside && insideAxis;
+				near *= nearAxis;
+			}
+			lower += inside ? 1 : 0;
+			upper += near;
+		}
+	}
+
+	LxResult tsrf_SetVertex(ILxUnknownID vdesc) LXx_OVERRIDE
+	{
+		CLxUser_TableauVertex vrx(vdesc);
+		size = vrx.Size();
+		const char * names[] = {LXsTBLX_PARTICLE_POS, LXsTBLX_PARTICLE_ID, LXsTBLX_PARTICLE_VEL, LXsTBLX_PARTICLE_SIZE, LXsTBLX_PARTICLE_RGB};
+		for (int i = 0; i < 5; ++i)
+		{
+			unsigned offset;
+			offsets[i] = LXx_OK(vrx.Lookup(LXiTBLX_PARTICLES, names[i], &offset)) ? (int)offset : -1;
+		}
+		return LXe_OK;
+	}
+
+	LxResult tsrf_Sample(const LXtTableauBox bbox, float scale, ILxUnknownID trisoup) LXx_OVERRIDE
+	{
+		CLxUser_TriangleSoup soup;
+		soup.set(trisoup);
+		soup.Segment(1, LXiTBLX_SEG_POINT);
+
+		CLxPseudoRandom rand;
+		rand.seed(1);		//	the same particles every frame
+		std::vector<float> vertex(size, 0.0f);
+		for (unsigned p = 0; p < count; ++p)
+		{
+			float values[11];
+			Particle(rand, p, time, values);
+			static const int first[] = {0, 3, 4, 7, 8}, sizes[] = {3, 1, 3, 1, 3};
+			for (int i = 0; i < 5; ++i)
+			{
+				if (offsets[i] >= 0)
+				{
+					memcpy(&vertex[offsets[i]], values + first[i], sizes[i] * sizeof(float));
+				}
+			}
+
+			unsigned index;
+			soup.Vertex(&vertex[0], &index);
+			soup.Polygon(index, 0, 0);
+		}
+		return LXe_OK;
+	}
+
+private:
+	unsigned size;
+	int offsets[5];
+};
+
+
+/*
+ * Counts the vertices a sample emits, and those whose position lies within
+ * margin of box. The positions are summed so the conversion can't be optimised
+ * away. Like a render bucket, it turns away segments whose bounds miss box.
+ */
+class CountingSoup : public CLxImpl_TriangleSoup
+{
+public:
+	unsigned vertices;
+	unsigned inside;
+	double checksum;
+
+	CountingSoup(unsigned position, const LXtTableauBox box, float margin) : vertices(0), inside(0), checksum(0.0), position(position), box(box), margin(margin)
+	{}
+
+	unsigned soup_TestBox(const LXtTableauBox bbox) LXx_OVERRIDE
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			if (bbox[i] > box[i + 3] || bbox[i + 3] < box[i])
+			{
+				return 0;
+			}
+		}
+		return 1;
+	}
+
+	LxResult soup_Vertex(const float * vertex, unsigned * index) LXx_OVERRIDE
+	{
+		const float * pos = vertex + position;
+		checksum += pos[0];
+		bool in = true;
+		for (int i = 0; i < 3; ++i)
+		{
+			in = in && pos[i] >= box[i] - margin && pos[i] <= box[i + 3] + margin;
+		}
+		inside += in ? 1 : 0;
+		*index = vertices++;
+		return LXe_OK;
+	}
+
+private:
+	unsigned position;
+	const float * box;
+	float margin;
+};
+
+
+/*
+ * Bakes and reads back one format at one particle count, then prints a line of
+ * results. Runs in a child process.
+ */
+static int RunCase(const std::string & dir, const std::string & format, unsigned count, unsigned frames, bool compact, bool keep, int keyframeInterval, int subFrameMode, bool partial)
+{
+	std::string name = dir + "/bench_" + std::to_string((_ULONGLONG)count) + "_";
+	std::vector<std::string> files;
+	for (unsigned f = 1; f <= frames; ++f)
+	{
+		char number[16];
+		sprintf(number, "%04u", f);
+		files.push_back(name + number + "." + format);
+	}
+
+	CModoPartioInstance * instance = new CModoPartioInstance();
+	BenchSurface surface(count);
+
+	/*
+	 * Write path, as a Modo point cache bake.
+	 */
+	CLxUser_TableauService tsrv;
+	CLxUser_TableauVertex vrx;
+	tsrv.NewVertex(vrx);
+	const char * features[] = {LXsTBLX_PARTICLE_POS, LXsTBLX_PARTICLE_ID, LXsTBLX_PARTICLE_VEL, LXsTBLX_PARTICLE_SIZE, LXsTBLX_PARTICLE_RGB};
+	for (int i = 0; i < 5; ++i)
+	{
+		unsigned index;
+		vrx.AddFeature(LXiTBLX_PARTICLES, features[i], &index);
+	}
+
+	MockAttributes cacheAttributes;
+	cacheAttributes.strings[0] = name + "####." + format;
+	cacheAttributes.values[1] = 3;		//	four digit padding
+	cacheAttributes.values[2] = 1;		//	parallel compression
+	cacheAttributes.values[3] = keyframeInterval;
+	cacheAttributes.values[4] = compact ? PRECISION_COMPACT : PRECISION_FULL;
+	cacheAttributes.values[5] = 0.0001;	//	position tolerance
+	cacheAttributes.values[6] = 0.002;	//	value tolerance
+
+	double start = Now();
+	LxResult result = instance->pcache_Initialize(vrx, &cacheAttributes, 0, 1.0 / mockSceneFPS, 0.0);
+	for (unsigned f = 1; f <= frames && LXx_OK(result); ++f)
+	{
+		surface.time = f / mockSceneFPS;
+		result = instance->pcache_SaveFrame(static_cast<CLxImpl_TableauSurface *>(&surface), f / mockSceneFPS);
+	}
+	if (LXx_OK(result))
+	{
+		result = instance->pcache_Cleanup();
+	}
+	double writeTime = Now() - start;
+
+	double bytes = 0.0;
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		boost::system::error_code error;
+		boost::uintmax_t size = boost::filesystem::file_size(files[i], error);
+		bytes += error ? 0.0 : (double)size;
+	}
+	if (LXx_FAIL(result) || bytes == 0.0)
+	{
+		printf("%-9s %10u  write failed\n", format.c_str(), count);
+		return 1;
+	}
+
+	/*
+	 * Read path, as the item is evaluated and sampled for a render.
+	 */
+	static const float margin = 0.001f;		//	above the compact position tolerance
+	LXtTableauBox bbox = {-1.0e30f, -1.0e30f, -1.0e30f, 1.0e30f, 1.0e30f, 1.0e30f};
+	unsigned buckets = 1;
+	if (partial)
+	{
+		bbox[0] = bbox[1] = bbox[2] = -10.0f;
+		bbox[3] = bbox[4] = bbox[5] = 0.0f;
+		buckets = 4;
+	}
+	double offset = (subFrameMode == SUBFRAME_INTERPOLATE) ? 0.5 : (subFrameMode == SUBFRAME_VELOCITY) ? 0.25 : 0.0;
+	unsigned reads = (subFrameMode == SUBFRAME_INTERPOLATE) ? frames - 1 : frames;		//	the last frame has nothing after it
+	std::vector<unsigned> inside(reads + 1);
+
+	start = Now();
+	for (unsigned f = 1; f <= reads; ++f)
+	{
+		MockAttributes itemAttributes;
+		itemAttributes.strings[0] = files[f - 1];
+		itemAttributes.values[2] = f;					//	frame
+		itemAttributes.values[3] = 0;					//	no read ahead, so each frame is timed on its own
+		itemAttributes.values[4] = subFrameMode;
+		itemAttributes.values[5] = mockSceneFPS;
+		itemAttributes.values[6] = 1.0;					//	full preview density
+		itemAttributes.values[7] = 0;					//	one file per frame
+		itemAttributes.values[8] = offset;				//	frame time, the fraction of a frame sampled
+
+		void * obj;
+		instance->prti_Evaluate(&itemAttributes, 0, &obj);
+		CModoPartioGenerator * gen = (CModoPartioGenerator *)obj;
+
+		CLxUser_TableauVertex sampleVrx;
+		tsrv.NewVertex(sampleVrx);
+		unsigned featureCount = gen->tsrf_FeatureCount(LXiTBLX_PARTICLES);
+		for (unsigned i = 0; i < featureCount; ++i)
+		{
+			const char * featureName;
+			unsigned index;
+			gen->tsrf_FeatureByIndex(LXiTBLX_PARTICLES, i, &featureName);
+			sampleVrx.AddFeature(LXiTBLX_PARTICLES, featureName, &index);
+		}
+		gen->tsrf_SetVertex(sampleVrx);
+		unsigned position = 0;
+		sampleVrx.Lookup(LXiTBLX_PARTICLES, LXsTBLX_PARTICLE_POS, &position);
+
+		for (unsigned b = 0; b < buckets * buckets * buckets; ++b)
+		{
+			LXtTableauBox bucketBox;
+			BucketBox(bbox, buckets, b, bucketBox);
+			CountingSoup soup(position, bucketBox, margin);
+			gen->tsrf_Sample(bucketBox, 1.0f, static_cast<CLxImpl_TriangleSoup *>(&soup));
+			inside[f] += soup.inside;
+		}
+		delete gen;
+	}
+	double readTime = Now() - start;
+
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	unsigned wrong = 0;		//	reads missing particles, or with particles out of place
+	for (unsigned f = 1; f <= reads; ++f)
+	{
+		unsigned lower = count, upper = count;
+		if (partial || offset != 0.0)
+		{
+			surface.Expect((f + offset) / mockSceneFPS, bbox, buckets, margin, lower, upper);
+		}
+		wrong += (inside[f] < lower || inside[f] > upper) ? 1 : 0;
+	}
+
+	double particles = (double)count * reads;
+	printf("%-9s %10u %12.2f %10.1f %12.2f %10.1f %10.1f %10.1f%s\n", format.c_str(), count,
+		particles / writeTime * 1.0e-6, bytes / writeTime / 1048576.0,
+		particles / readTime * 1.0e-6, bytes / readTime / 1048576.0,
+		bytes / frames / 1048576.0, usage.ru_maxrss / 1024.0,
+		wrong == 0 ? "" : "  particle count mismatch");
+
+	if (!keep)
+	{
+		for (size_t i = 0; i < files.size(); ++i)
+		{
+			boost::system::error_code error;
+			boost::filesystem::remove(files[i], error);
+		}
+	}
+	return wrong == 0 ? 0 : 1;
+}
+
+
+int main(int argc, char * argv[])
+{
+	std::string dir = "/tmp/modopartio-bench";
+	std::vector<std::string> formats = SplitList("mpc,prt,bgeo,pdc,pda,bin,icecache");
+	std::vector<std::string> counts = SplitList("1000,100000,1000000,10000000,50000000");
+	unsigned frames = 1;
+	bool compact = false;
+	bool keep = false;
+	int keyframeInterval = 0;
+	int subFrameMode = SUBFRAME_SNAP;
+	bool partial = false;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "-k")
+		{
+			keep = true;
+		}
+		else if (arg == "-c")
+		{
+			compact = true;
+		}
+		else if (arg == "-b")
+		{
+			partial = true;
+		}
+		else if (i + 1 < argc && arg == "-d")
+		{
+			keyframeInterval = std::max(0, atoi(argv[++i]));
+		}
+		else if (i + 1 < argc && arg == "-s" && (std::string(argv[i + 1]) == "snap" || std::string(argv[i + 1]) == "interpolate" || std::string(argv[i + 1]) == "velocity"))
+		{
+			std::string mode = argv[++i];
+			subFrameMode = (mode == "interpolate") ? SUBFRAME_INTERPOLATE : (mode == "velocity") ? SUBFRAME_VELOCITY : SUBFRAME_SNAP;
+		}
+		else if (i + 1 < argc && arg == "-o")
+		{
+			dir = argv[++i];
+		}
+		else if (i + 1 < argc && arg == "-f")
+		{
+			formats = SplitList(argv[++i]);
+		}
+		else if (i + 1 < argc && arg == "-n")
+		{
+			counts = SplitList(argv[++i]);
+		}
+		else if (i + 1 < argc && arg == "-r")
+		{
+			frames = std::max(1, atoi(argv[++i]));
+		}
+		else
+		{
+			fprintf(stderr, "usage: %s [-o dir] [-f mpc,prt,...] [-n 1000,100000,...] [-r frames] [-c] [-k] [-d interval] [-s snap|interpolate|velocity] [-b]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (subFrameMode == SUBFRAME_INTERPOLATE)
+	{
+		frames = std::max(frames, 2u);		//	reads between each frame and the next
+	}
+	boost::filesystem::create_directories(dir);
+
+	printf("%-9s %10s %12s %10s %12s %10s %10s %10s\n", "format", "particles", "write Mp/s", "write MB/s", "read Mp/s", "read MB/s", "file MB", "peak MB");
+	fflush(stdout);
+
+	int failures = 0;
+	for (size_t f = 0; f < formats.size(); ++f)
+	{
+		for (size_t c = 0; c < counts.size(); ++c)
+		{
+			pid_t child = fork();		//	before any worker threads exist in this process
+			if (child == 0)
+			{
+				int status = RunCase(dir, formats[f], (unsigned)atol(counts[c].c_str()), frames, compact, keep, keyframeInterval, subFrameMode, partial);
+				fflush(stdout);
+				_exit(status);
+			}
+			int status = 1;
+			if (child < 0 || waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			{
+				if (child > 0 && WIFSIGNALED(status))
+				{
+					printf("%-9s %10s  crashed with signal %d\n", formats[f].c_str(), counts[c].c_str(), WTERMSIG(status));
+				}
+				++failures;
+			}
+			fflush(stdout);
+		}
+	}
+	return failures == 0 ? 0 : 1;
+}
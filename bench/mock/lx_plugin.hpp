@@ -0,0 +1 @@
+#include "lxmock.hpp"
@@ -0,0 +1,554 @@
+/*
+ * lxmock.hpp	Stand-in for the parts of the Modo SDK that ModoPartio uses
+ *
+ *	Only enough of the SDK to build ModoPartio.cpp outside Modo for the
+ *	benchmark. The tableau interfaces work: a vertex description holds real
+ *	features and offsets, a triangle soup or tableau surface passed as an
+ *	ILxUnknownID is a pointer to its CLxImpl_ object, and attributes read from
+ *	a MockAttributes table. Everything to do with items, scenes and the UI is
+ *	a no-op.
+ */
+#pragma once
+
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+typedef int			 LxResult;
+typedef unsigned int		 LXtID4;
+typedef void			*ILxUnknownID;
+typedef void			*LXtObjectID;
+typedef float			 LXtTableauBox[6];
+typedef unsigned long long	 _ULONGLONG;
+
+struct LXtGUID {};
+struct LXtTagInfoDesc
+{
+	const char		*type;
+	const char		*info;
+};
+
+#define LXx_OVERRIDE			override
+#define LXx_FAIL(r)			((r) < 0)
+#define LXx_OK(r)			((r) >= 0)
+
+#define LXe_OK				0
+#define LXe_TRUE			1
+#define LXe_FALSE			2
+#define LXe_FAILED			((int)0x80000000)
+#define LXe_OUTOFBOUNDS			((int)0x80000001)
+#define LXe_OUTOFMEMORY			((int)0x80000002)
+#define LXe_NOTFOUND			((int)0x80000003)
+#define LXe_CMD_DISABLED		((int)0x80000004)
+#define LXe_ABORT			((int)0x80000005)
+
+#define LXi_DBLOG_ERROR			0
+#define LXi_DBLOG_NORMAL		1
+
+#define LXiTBLX_PARTICLES		1
+#define LXiTBLX_SEG_POINT		1
+#define LXfTBLX_PREVIEW_UPDATE_NONE	0
+#define LXfTBLX_PREVIEW_UPDATE_GEOMETRY	1
+
+#define LXsTBLX_PARTICLE_POS		"pos"
+#define LXsTBLX_PARTICLE_XFRM		"xfrm"
+#define LXsTBLX_PARTICLE_ID		"id"
+#define LXsTBLX_PARTICLE_SIZE		"size"
+#define LXsTBLX_PARTICLE_VEL		"vel"
+#define LXsTBLX_PARTICLE_MASS		"mass"
+#define LXsTBLX_PARTICLE_FORCE		"force"
+#define LXsTBLX_PARTICLE_AGE		"age"
+#define LXsTBLX_PARTICLE_PATH		"path"
+#define LXsTBLX_PARTICLE_DISS		"diss"
+#define LXsTBLX_PARTICLE_RATE		"rate"
+#define LXsTBLX_PARTICLE_ITEM		"item"
+#define LXsTBLX_PARTICLE_ANGVEL		"angvel"
+#define LXsTBLX_PARTICLE_TORQUE		"torque"
+#define LXsTBLX_PARTICLE_PPREV		"pprev"
+#define LXsTBLX_PARTICLE_LUM		"lum"
+#define LXsTBLX_PARTICLE_RGB		"rgb"
+
+#define LXsGRAPH_PARTICLE		"particle"
+#define LXsTYPE_STRING			"string"
+#define LXsTYPE_INTEGER			"integer"
+#define LXsTYPE_FLOAT			"float"
+#define LXsTYPE_PERCENT			"percent"
+#define LXsTYPE_BOOLEAN			"boolean"
+#define LXsTYPE_TIME			"time"
+#define LXsTYPE_DISTANCE		"distance"
+#define LXsPKG_SUPERTYPE		"super"
+#define LXsITYPE_LOCATOR		"locator"
+#define LXsITYPE_SCENE			"scene"
+#define LXsICHAN_XFRMCORE_WORLDMATRIX	"worldMatrix"
+#define LXsICHAN_SCENE_FPS		"fps"
+#define LXsICHAN_SCENE_TIME		"time"
+
+
+/*
+ * Frame rate the scene reports, which pcache_SaveFrame turns times into
+ * frames with.
+ */
+static double mockSceneFPS = 24.0;
+
+
+/*
+ * Server registration.
+ */
+struct CLxGenericPolymorph
+{
+	void AddInterface (void *ifc) {}
+};
+
+template <class T> struct CLxPolymorph : public CLxGenericPolymorph {};
+
+struct CLxSingletonPolymorph
+{
+	void AddInterface (void *ifc) {}
+};
+
+#define LXxSINGLETON_METHOD	operator ILxUnknownID () { return (ILxUnknownID) static_cast<CLxImpl_TriangleSoup *> (this); }		//	the soup is the only singleton ModoPartio passes on
+
+template <class T> struct CLxIfc_Package {};
+template <class T> struct CLxIfc_StaticDesc {};
+template <class T> struct CLxIfc_PackageInstance {};
+template <class T> struct CLxIfc_ParticleItem {};
+template <class T> struct CLxIfc_TableauSource {};
+template <class T> struct CLxIfc_TableauSurface {};
+template <class T> struct CLxIfc_TriangleSoup {};
+template <class T> struct CLxIfc_PointCacheItem {};
+template <class T> struct CLxIfc_SceneItemListener {};
+template <class T> struct CLxIfc_ChannelUI {};
+
+namespace lx {
+	inline void AddSpawner (const char *name, void *srv) {}
+	inline void AddServer (const char *name, void *srv) {}
+}
+
+template <class T> struct CLxSpawner
+{
+	CLxSpawner (const char *name) {}
+
+	T * Alloc (void **ppvObj)		//	the caller owns the object
+	{
+		T *obj = new T;
+		*ppvObj = obj;
+		return obj;
+	}
+
+	LxResult TestInterfaceRC (const LXtGUID *guid) { return LXe_FALSE; }
+};
+
+
+/*
+ * Interfaces ModoPartio implements.
+ */
+struct CLxImpl_Package
+{
+	virtual ~CLxImpl_Package () {}
+	virtual LxResult pkg_SetupChannels (ILxUnknownID addChan) { return LXe_OK; }
+	virtual LxResult pkg_TestInterface (const LXtGUID *guid) { return LXe_FALSE; }
+	virtual LxResult pkg_Attach (void **ppvObj) { return LXe_OK; }
+};
+
+struct CLxImpl_PackageInstance
+{
+	virtual ~CLxImpl_PackageInstance () {}
+	virtual LxResult pins_Initialize (ILxUnknownID item, ILxUnknownID super) { return LXe_OK; }
+	virtual void pins_Cleanup () {}
+	virtual LxResult pins_Newborn (ILxUnknownID original, unsigned flags) { return LXe_OK; }
+};
+
+struct CLxImpl_ParticleItem
+{
+	virtual ~CLxImpl_ParticleItem () {}
+	virtual LxResult prti_Prepare (ILxUnknownID eval, unsigned *index) { return LXe_OK; }
+	virtual LxResult prti_Evaluate (ILxUnknownID attr, unsigned index, void **ppvObj) { return LXe_OK; }
+};
+
+struct CLxImpl_TableauSource
+{
+	virtual ~CLxImpl_TableauSource () {}
+	virtual LxResult tsrc_PreviewUpdate (int chanIndex, int *update) { return LXe_OK; }
+	virtual LxResult tsrc_Elements (ILxUnknownID tableau) { return LXe_OK; }
+};
+
+struct CLxImpl_TableauSurface
+{
+	virtual ~CLxImpl_TableauSurface () {}
+	virtual unsigned tsrf_FeatureCount (LXtID4 type) { return 0; }
+	virtual LxResult tsrf_FeatureByIndex (LXtID4 type, unsigned index, const char **name) { return LXe_OUTOFBOUNDS; }
+	virtual LxResult tsrf_SetVertex (ILxUnknownID vdesc) { return LXe_OK; }
+	virtual LxResult tsrf_Sample (const LXtTableauBox bbox, float scale, ILxUnknownID trisoup) { return LXe_OK; }
+	virtual LxResult tsrf_Bound (LXtTableauBox bbox) { return LXe_OK; }
+	virtual LxResult tsrf_Padding (float *dist) { return LXe_OK; }
+};
+
+struct CLxImpl_TriangleSoup
+{
+	virtual ~CLxImpl_TriangleSoup () {}
+	virtual unsigned soup_TestBox (const LXtTableauBox bbox) { return 1; }
+	virtual LxResult soup_Segment (unsigned segID, unsigned type) { return LXe_TRUE; }
+	virtual LxResult soup_Vertex (const float *vertex, unsigned *index) { return LXe_OK; }
+	virtual LxResult soup_Polygon (unsigned v0, unsigned v1, unsigned v2) { return LXe_OK; }
+	virtual void soup_Connect (unsigned type) {}
+};
+
+struct CLxImpl_PointCacheItem
+{
+	virtual ~CLxImpl_PointCacheItem () {}
+	virtual LxResult pcache_Prepare (ILxUnknownID eval, unsigned *index) { return LXe_OK; }
+	virtual LxResult pcache_Initialize (ILxUnknownID vdesc, ILxUnknownID attr, unsigned index, double time, double sample) { return LXe_OK; }
+	virtual LxResult pcache_SaveFrame (ILxUnknownID pobj, double time) { return LXe_OK; }
+	virtual LxResult pcache_Cleanup () { return LXe_OK; }
+};
+
+struct CLxImpl_SceneItemListener
+{
+	virtual ~CLxImpl_SceneItemListener () {}
+	virtual void sil_LinkAdd (const char *graph, ILxUnknownID itemFrom, ILxUnknownID itemTo) {}
+	virtual void sil_LinkRemBefore (const char *graph, ILxUnknownID itemFrom, ILxUnknownID itemTo) {}
+	virtual void sil_ItemRemove (ILxUnknownID item) {}
+};
+
+struct CLxImpl_ChannelUI
+{
+	virtual ~CLxImpl_ChannelUI () {}
+	virtual LxResult cui_UIHints (const char *channelName, ILxUnknownID hints) { return LXe_OK; }
+	virtual LxResult cui_Enabled (const char *channelName, ILxUnknownID msg, ILxUnknownID item, ILxUnknownID read) { return LXe_OK; }
+};
+
+
+/*
+ * Vertex descriptions. Features are laid out in the order they are added, at
+ * the sizes Modo gives the standard particle features.
+ */
+struct MockVertex
+{
+	std::vector<std::string>	 names;
+	std::vector<unsigned>		 offsets;
+	unsigned			 size;
+
+	MockVertex () : size (0) {}
+
+	static unsigned FeatureSize (const std::string &name)
+	{
+		if (name == LXsTBLX_PARTICLE_XFRM)
+			return 9;
+		if (name == LXsTBLX_PARTICLE_POS || name == LXsTBLX_PARTICLE_VEL || name == LXsTBLX_PARTICLE_FORCE || name == LXsTBLX_PARTICLE_ANGVEL
+		 || name == LXsTBLX_PARTICLE_TORQUE || name == LXsTBLX_PARTICLE_PPREV || name == LXsTBLX_PARTICLE_RGB)
+			return 3;
+		return 1;
+	}
+};
+
+class CLxUser_TableauVertex
+{
+public:
+	CLxUser_TableauVertex () : vertex (0) {}
+	CLxUser_TableauVertex (ILxUnknownID vdesc) : vertex ((MockVertex *) vdesc) {}
+
+	unsigned Size () { return vertex->size; }
+	unsigned Count () { return (unsigned) vertex->names.size (); }
+
+	LxResult ByIndex (unsigned index, LXtID4 *type, const char **name, unsigned *offset)
+	{
+		if (index >= vertex->names.size ())
+			return LXe_OUTOFBOUNDS;
+		*type = LXiTBLX_PARTICLES;
+		*name = vertex->names[index].c_str ();
+		*offset = vertex->offsets[index];
+		return LXe_OK;
+	}
+
+	LxResult AddFeature (LXtID4 type, const char *name, unsigned *index)
+	{
+		*index = (unsigned) vertex->names.size ();
+		vertex->names.push_back (name);
+		vertex->offsets.push_back (vertex->size);
+		vertex->size += MockVertex::FeatureSize (name);
+		return LXe_OK;
+	}
+
+	LxResult Lookup (LXtID4 type, const char *name, unsigned *offset)
+	{
+		for (size_t i = 0; i < vertex->names.size (); ++i)
+			if (vertex->names[i] == name) {
+				*offset = vertex->offsets[i];
+				return LXe_OK;
+			}
+		return LXe_NOTFOUND;
+	}
+
+	operator ILxUnknownID () { return vertex; }
+
+private:
+	MockVertex			*vertex;
+	boost::shared_ptr<MockVertex>	 owned;
+
+	friend class CLxUser_TableauService;
+};
+
+class CLxUser_TableauService
+{
+public:
+	bool NewVertex (CLxUser_TableauVertex &vrx)
+	{
+		vrx.owned.reset (new MockVertex);
+		vrx.vertex = vrx.owned.get ();
+		return true;
+	}
+};
+
+
+/*
+ * Soups and surfaces forward to the object the ILxUnknownID points at.
+ */
+class CLxUser_TriangleSoup
+{
+public:
+	CLxUser_TriangleSoup () : soup (0) {}
+
+	void set (ILxUnknownID obj) { soup = (CLxImpl_TriangleSoup *) obj; }
+
+	unsigned TestBox (const LXtTableauBox bbox) { return soup->soup_TestBox (bbox); }
+	LxResult Segment (unsigned segID, unsigned type) { return soup->soup_Segment (segID, type); }
+	LxResult Vertex (const float *vertex, unsigned *index) { return soup->soup_Vertex (vertex, index); }
+	LxResult Polygon (unsigned v0, unsigned v1, unsigned v2) { return soup->soup_Polygon (v0, v1, v2); }
+
+private:
+	CLxImpl_TriangleSoup		*soup;
+};
+
+class CLxUser_TableauSurface
+{
+public:
+	CLxUser_TableauSurface (ILxUnknownID obj) : surf ((CLxImpl_TableauSurface *) obj) {}
+
+	LxResult SetVertex (ILxUnknownID vdesc) { return surf->tsrf_SetVertex (vdesc); }
+	LxResult Sample (const LXtTableauBox bbox, float scale, ILxUnknownID trisoup) { return surf->tsrf_Sample (bbox, scale, trisoup); }
+
+private:
+	CLxImpl_TableauSurface		*surf;
+};
+
+
+/*
+ * Evaluated channel values, set by the caller by index.
+ */
+struct MockAttributes
+{
+	std::map<unsigned, std::string>	 strings;
+	std::map<unsigned, double>	 values;
+};
+
+class CLxUser_Matrix {};
+
+class CLxUser_Attributes
+{
+public:
+	CLxUser_Attributes (ILxUnknownID obj) : attr ((MockAttributes *) obj) {}
+
+	bool String (unsigned index, std::string &value)
+	{
+		std::map<unsigned, std::string>::const_iterator iter = attr->strings.find (index);
+		value = (iter == attr->strings.end ()) ? std::string () : iter->second;
+		return iter != attr->strings.end ();
+	}
+
+	double Float (unsigned index)
+	{
+		std::map<unsigned, double>::const_iterator iter = attr->values.find (index);
+		return (iter == attr->values.end ()) ? 0.0 : iter->second;
+	}
+
+	int Int (unsigned index) { return (int) Float (index); }
+	bool ObjectRO (unsigned index, CLxUser_Matrix &matrix) { return true; }
+
+private:
+	MockAttributes			*attr;
+};
+
+
+/*
+ * Items, scenes and channels.
+ */
+class CLxUser_Item
+{
+public:
+	CLxUser_Item () {}
+	CLxUser_Item (ILxUnknownID obj) {}
+
+	void set (ILxUnknownID obj) {}
+	void clear () {}
+	bool test () const { return false; }
+	bool operator== (const CLxUser_Item &other) const { return true; }
+	bool operator!= (const CLxUser_Item &other) const { return false; }
+	std::string GetIdentity () { return std::string (); }
+	LxResult ChannelLookup (const char *name, unsigned *index) { *index = 0; return LXe_OK; }
+	LxResult Ident (const char **ident) { *ident = ""; return LXe_OK; }
+	bool GetUniqueName (std::string &name) { name.clear (); return true; }
+	operator ILxUnknownID () { return 0; }
+};
+
+class CLxUser_ChannelRead
+{
+public:
+	CLxUser_ChannelRead () {}
+	CLxUser_ChannelRead (ILxUnknownID obj) {}
+
+	int IValue (CLxUser_Item &item, const char *channel) { return 0; }
+	LxResult Double (CLxUser_Item &item, unsigned index, double *value) { *value = mockSceneFPS; return LXe_OK; }		//	only the scene's frame rate is read
+};
+
+class CLxUser_ChannelWrite
+{
+public:
+	void from (CLxUser_Item &item) {}
+	LxResult Set (CLxUser_Item &item, const char *channel, int value) { return LXe_OK; }
+};
+
+class CLxUser_ItemGraph
+{
+public:
+	void FwdCount (CLxUser_Item &item, unsigned *count) { *count = 0; }
+	bool Forward (CLxUser_Item &item, unsigned index, CLxUser_Item &to) { return false; }
+	void DeleteLink (CLxUser_Item &from, CLxUser_Item &to) {}
+};
+
+class CLxUser_Scene
+{
+public:
+	CLxUser_Scene () {}
+	CLxUser_Scene (CLxUser_Item &item) {}
+
+	void from (CLxUser_Item &item) {}
+	bool GetGraph (const char *name, CLxUser_ItemGraph &graph) { return true; }
+	LxResult ItemByIndex (LXtID4 type, unsigned index, LXtObjectID *obj) { *obj = 0; return LXe_OK; }
+	bool GetChannels (CLxUser_ChannelRead &chan, double time) { return true; }
+};
+
+class CLxUser_SceneService
+{
+public:
+	LXtID4 ItemType (const char *name) { return 0; }
+};
+
+class CLxUser_ListenerPort
+{
+public:
+	CLxUser_ListenerPort (CLxUser_Scene &scene) {}
+	void AddListener (ILxUnknownID obj) {}
+	void RemoveListener (ILxUnknownID obj) {}
+};
+
+class CLxUser_Evaluation
+{
+public:
+	CLxUser_Evaluation (ILxUnknownID obj) {}
+	unsigned AddChan (CLxUser_Item &item, const char *channel, unsigned type = 1) { return 0; }
+	unsigned AddTime () { return 0; }
+};
+
+class CLxUser_AddChannel
+{
+public:
+	CLxUser_AddChannel (ILxUnknownID obj) {}
+	LxResult NewChannel (const char *name, const char *type) { return LXe_OK; }
+	LxResult SetStorage (const char *type) { return LXe_OK; }
+	LxResult SetDefaultObj (void *obj) { return LXe_OK; }
+	LxResult SetDefault (double value, int ivalue) { return LXe_OK; }
+	LxResult SetHint (const void *hint) { return LXe_OK; }
+};
+
+class CLxUser_Value
+{
+public:
+	void take (LXtObjectID obj) {}
+	LxResult SetString (const char *value) { return LXe_OK; }
+};
+
+class CLxUser_UIHints
+{
+public:
+	CLxUser_UIHints (ILxUnknownID obj) {}
+	void Class (const char *name) {}
+	void Label (const char *label) {}
+	void StringList (const char **strings) {}
+	void MinInt (int value) {}
+	void MaxInt (int value) {}
+	void MinFloat (double value) {}
+	void MaxFloat (double value) {}
+};
+
+class CLxUser_Message
+{
+public:
+	CLxUser_Message (ILxUnknownID obj) {}
+	void SetCode (LxResult code) {}
+};
+
+
+/*
+ * Utilities.
+ */
+class CLxPseudoRandom
+{
+public:
+	CLxPseudoRandom () : state (1) {}
+
+	void seed (unsigned value) { state = value ? value : 1; }
+
+	float uniform ()
+	{
+		state = state * 1664525u + 1013904223u;
+		return (float) (state >> 8) * (1.0f / 16777216.0f);
+	}
+
+private:
+	unsigned			 state;
+};
+
+class CLxUser_LogService
+{
+public:
+	LxResult DebugOut (unsigned level, const char *format, ...)		//	straight to stderr
+	{
+		va_list args;
+		va_start (args, format);
+		vfprintf (stderr, format, args);
+		va_end (args);
+		fputc ('\n', stderr);
+		return LXe_OK;
+	}
+};
+
+class CLxLogMessage
+{
+public:
+	CLxLogMessage (const char *name) {}
+	virtual ~CLxLogMessage () {}
+	virtual const char * GetFormat () { return ""; }
+	virtual const char * GetVersion () { return ""; }
+	virtual const char * GetCopyright () { return ""; }
+	void Setup () {}
+	void Info (const char *text) {}
+	void Warning (const char *text) {}
+	void Error (const char *text) {}
+	void Message (LxResult code, const char *text) {}
+	void SetFormat (const char *format, ...) {}
+};
+
+class CLxLuxologyLogMessage : public CLxLogMessage
+{
+public:
+	CLxLuxologyLogMessage (const char *name) : CLxLogMessage (name) {}
+};
+
+struct CLxLocalize {};